@@ -0,0 +1,2871 @@
+// ================= BENCH.CPP =================
+// Công cụ đo hiệu năng broker (chỉ chạy trên Linux).
+// Các chế độ:
+// - fanout: publish vào 1 topic nhỏ trong khi có rất nhiều
+//           connection khác đang online, để xem chi phí fanout
+//           có phụ thuộc tổng số connection hay không
+// - throughput: nhiều cặp publisher/subscriber chạy song song, dùng để
+//           đo khả năng scale của server khi chạy --threads N
+// - ws: publish tin nhắn nhỏ tới các subscriber WebSocket
+// - storm: rất nhiều user cùng login/subscribe rồi cùng rớt mạng
+// - file: truyền 1 file lớn tới nhiều người nhận (lưu / chỉ chuyển tiếp)
+// - load: tải tổng hợp TCP + WS, đo msgs/s, bytes/s và độ trễ p50/p99/p999
+// - slow: 1 subscriber ngừng đọc trên topic bận, xem policy --sendq-policy
+// - dedup: tải lên bộ file có nhiều bản trùng/sửa nhẹ, đo dung lượng lưu + thời gian
+// - fetch: nhiều người vào sau cùng xin lại 1 file đã lưu qua /sys/fetch_file
+// - stripe: gửi/nhận 1 file lớn trên K connection song song qua proxy giả lập độ trễ
+// - compress: so byte trên dây và CPU khi bật/tắt nén payload (chat, tài liệu, dữ liệu ngẫu nhiên)
+// - wire: so byte mỗi message và thời gian encode/parse của header v1 và v2
+// - batch: gửi từng tin chat nhỏ so với gộp nhiều tin vào 1 MSG_BUNDLE
+// - crc: tốc độ (GB/s) checksum XOR, CRC32C phần mềm và CRC32C phần cứng
+// =============================================
+
+#include "protocol.h"
+
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <unordered_map>
+#include <memory>
+#include <algorithm>
+#include <random>
+#include <array>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <cmath>
+#include <iomanip>
+#include <cstring>
+#include <ctime>
+
+using Clock = std::chrono::steady_clock;
+
+/* ================= OPTIONS ================= */
+struct Options
+{
+    std::unordered_map<std::string, std::string> kv;
+
+    std::string str(const std::string &k, const std::string &def) const
+    {
+        auto it = kv.find(k);
+        return it == kv.end() ? def : it->second;
+    }
+    long num(const std::string &k, long def) const
+    {
+        auto it = kv.find(k);
+        return it == kv.end() ? def : std::stol(it->second);
+    }
+};
+
+Options parse_options(int argc, char **argv)
+{
+    Options o;
+    for (int i = 2; i < argc; i++)
+    {
+        std::string k = argv[i];
+        if (k.rfind("--", 0) != 0)
+            continue;
+        k = k.substr(2);
+        if (i + 1 < argc && strncmp(argv[i + 1], "--", 2) != 0)
+            o.kv[k] = argv[++i];
+        else
+            o.kv[k] = "1";
+    }
+    return o;
+}
+
+/* ================= SOCKET HELPERS ================= */
+int tcp_connect(const std::string &host, int port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, host.c_str(), &addr.sin_addr);
+    if (connect(fd, (sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    return fd;
+}
+
+bool send_all(int fd, const void *d, size_t n)
+{
+    const char *p = (const char *)d;
+    while (n)
+    {
+        ssize_t s = send(fd, p, n, MSG_NOSIGNAL);
+        if (s <= 0)
+            return false;
+        p += s;
+        n -= s;
+    }
+    return true;
+}
+
+bool recv_all(int fd, void *d, size_t n)
+{
+    char *p = (char *)d;
+    while (n)
+    {
+        ssize_t r = recv(fd, p, n, 0);
+        if (r <= 0)
+            return false;
+        p += r;
+        n -= r;
+    }
+    return true;
+}
+
+/* ================= PACKET ================= */
+uint32_t checksum(const uint8_t *d, size_t n)
+{
+    uint32_t c = 0;
+    for (size_t i = 0; i < n; i++)
+        c ^= d[i];
+    return c;
+}
+
+// Thêm 1 packet (header + payload) vào cuối out. v2: header v2 (chỉ dùng sau
+// khi server ACK login "wire=2")
+void append_packet(std::vector<uint8_t> &out, uint32_t type, const std::string &sender, const std::string &topic,
+                   uint8_t flags, const void *payload, size_t len, uint32_t msgId = 0, bool v2 = false)
+{
+    PacketHeader h{};
+    h.msgType = type;
+    h.payloadLength = (uint32_t)len;
+    h.messageId = msgId;
+    h.timestamp = (uint64_t)time(nullptr);
+    h.version = PROTOCOL_VERSION;
+    h.flags = flags;
+    strncpy(h.sender, sender.c_str(), MAX_USERNAME_LEN - 1);
+    strncpy(h.topic, topic.c_str(), MAX_TOPIC_LEN - 1);
+    if (len)
+        h.checksum = checksum((const uint8_t *)payload, len);
+
+    size_t at = out.size();
+    out.resize(at + WIRE_HEADER_MAX + len);
+    size_t hn = wire_encode_header(h, v2, out.data() + at);
+    if (len)
+        memcpy(out.data() + at + hn, payload, len);
+    out.resize(at + hn + len);
+}
+
+bool send_packet(int fd, uint32_t type, const std::string &sender, const std::string &topic,
+                 uint8_t flags, const void *payload, size_t len, uint32_t msgId = 0, bool v2 = false)
+{
+    // gửi header + payload bằng 1 lần send để tránh tách segment
+    std::vector<uint8_t> buf;
+    append_packet(buf, type, sender, topic, flags, payload, len, msgId, v2);
+    return send_all(fd, buf.data(), buf.size());
+}
+
+// Đọc header v1 hoặc v2: 2 byte đầu cho biết dạng và độ dài header
+bool recv_header(int fd, PacketHeader &h)
+{
+    uint8_t buf[WIRE_HEADER_MAX];
+    if (!recv_all(fd, buf, 2))
+        return false;
+    size_t hn = buf[0] == WIRE_V2_MAGIC ? buf[1] : sizeof(h);
+    return hn >= 2 && hn <= sizeof(buf) && recv_all(fd, buf + 2, hn - 2) &&
+           wire_decode_header(buf, hn, h) == (long)hn;
+}
+
+bool recv_packet(int fd, PacketHeader &h, std::vector<uint8_t> &payload)
+{
+    if (!recv_header(fd, h))
+        return false;
+    payload.resize(h.payloadLength);
+    return h.payloadLength == 0 || recv_all(fd, payload.data(), payload.size());
+}
+
+// Đợi tới khi nhận được packet có msgType mong muốn
+bool wait_for(int fd, uint32_t type)
+{
+    PacketHeader h{};
+    std::vector<uint8_t> payload;
+    while (recv_packet(fd, h, payload))
+        if (h.msgType == type)
+            return true;
+    return false;
+}
+
+// Login của người nhận file có key: xin CAP_KEYED_FILES (chunk kèm offset, LAST kèm hash)
+static const std::string KEYED_LOGIN = [] {
+    char caps[16];
+    snprintf(caps, sizeof(caps), "caps=%x", CAP_KEYED_FILES);
+    return std::string(caps);
+}();
+
+// Kết nối + login + subscribe, đợi ACK của cả hai. login: payload MSG_LOGIN
+// (ví dụ "caps=8"), agreed: nhận payload ACK login
+int open_session(const std::string &host, int port, const std::string &user, const std::string &topic,
+                 const std::string &login = "", std::string *agreed = nullptr)
+{
+    int fd = tcp_connect(host, port);
+    if (fd < 0)
+        return -1;
+    PacketHeader h{};
+    std::vector<uint8_t> payload;
+    bool ok = send_packet(fd, MSG_LOGIN, user, "", 0, login.data(), login.size(), 1);
+    while (ok && (ok = recv_packet(fd, h, payload)) && h.msgType != MSG_ACK)
+        ;
+    if (ok && agreed)
+        agreed->assign(payload.begin(), payload.end());
+    if (!ok || !send_packet(fd, MSG_SUBSCRIBE, user, topic, 0, nullptr, 0, 2) || !wait_for(fd, MSG_ACK))
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Đọc bộ đếm của server qua topic /sys/stats
+std::unordered_map<std::string, long> fetch_stats(const std::string &host, int port)
+{
+    std::unordered_map<std::string, long> st;
+    int fd = tcp_connect(host, port);
+    if (fd < 0)
+        return st;
+    send_packet(fd, MSG_PUBLISH_TEXT, "bench_stats", "/sys/stats", 0, nullptr, 0, 1);
+    PacketHeader h{};
+    std::vector<uint8_t> payload;
+    while (recv_packet(fd, h, payload))
+    {
+        if (h.msgType != MSG_PUBLISH_TEXT || strcmp(h.topic, "/sys/stats") != 0)
+            continue;
+        std::string text(payload.begin(), payload.end());
+        size_t pos = 0;
+        while (pos < text.size())
+        {
+            size_t nl = text.find('\n', pos), eq = text.find('=', pos);
+            if (nl == std::string::npos)
+                nl = text.size();
+            if (eq != std::string::npos && eq < nl)
+                st[text.substr(pos, eq - pos)] = std::stol(text.substr(eq + 1, nl - eq - 1));
+            pos = nl + 1;
+        }
+        break;
+    }
+    close(fd);
+    return st;
+}
+
+/* ================= WEBSOCKET ================= */
+// Kết nối WS tới /websocket, trả về fd sau khi handshake xong
+int ws_connect(const std::string &host, int port)
+{
+    int fd = tcp_connect(host, port);
+    if (fd < 0)
+        return -1;
+    std::string req = "GET /websocket HTTP/1.1\r\nHost: " + host +
+                      "\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                      "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                      "Sec-WebSocket-Version: 13\r\n\r\n";
+    if (!send_all(fd, req.data(), req.size()))
+    {
+        close(fd);
+        return -1;
+    }
+    // đọc từng byte tới hết header HTTP để không nuốt frame đầu tiên
+    std::string resp;
+    char ch;
+    while (resp.size() < 4 || resp.compare(resp.size() - 4, 4, "\r\n\r\n") != 0)
+    {
+        if (recv(fd, &ch, 1, 0) != 1)
+        {
+            close(fd);
+            return -1;
+        }
+        resp += ch;
+    }
+    if (resp.find(" 101 ") == std::string::npos)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Gửi 1 packet trong 1 frame WS (client bắt buộc mask)
+bool ws_send_packet(int fd, uint32_t type, const std::string &sender, const std::string &topic,
+                    uint8_t flags, const void *payload, size_t len, uint32_t msgId = 0)
+{
+    PacketHeader h{};
+    h.msgType = type;
+    h.payloadLength = (uint32_t)len;
+    h.messageId = msgId;
+    h.timestamp = (uint64_t)time(nullptr);
+    h.version = PROTOCOL_VERSION;
+    h.flags = flags;
+    strncpy(h.sender, sender.c_str(), MAX_USERNAME_LEN - 1);
+    strncpy(h.topic, topic.c_str(), MAX_TOPIC_LEN - 1);
+    if (len)
+        h.checksum = checksum((const uint8_t *)payload, len);
+
+    size_t n = sizeof(h) + len;
+    std::vector<uint8_t> buf;
+    buf.reserve(n + 14);
+    buf.push_back(0x82); // FIN + binary
+    if (n < 126)
+        buf.push_back(0x80 | (uint8_t)n);
+    else if (n < 65536)
+    {
+        buf.push_back(0x80 | 126);
+        buf.push_back((uint8_t)(n >> 8));
+        buf.push_back((uint8_t)n);
+    }
+    else
+    {
+        buf.push_back(0x80 | 127);
+        for (int i = 7; i >= 0; i--)
+            buf.push_back((uint8_t)((uint64_t)n >> (8 * i)));
+    }
+    const uint8_t mask[4] = {0x12, 0x34, 0x56, 0x78};
+    buf.insert(buf.end(), mask, mask + 4);
+    size_t start = buf.size();
+    buf.insert(buf.end(), (const uint8_t *)&h, (const uint8_t *)&h + sizeof(h));
+    if (len)
+        buf.insert(buf.end(), (const uint8_t *)payload, (const uint8_t *)payload + len);
+    for (size_t i = start; i < buf.size(); i++)
+        buf[i] ^= mask[(i - start) & 3];
+    return send_all(fd, buf.data(), buf.size());
+}
+
+// Đọc 1 frame WS (server không mask)
+bool ws_recv_frame(int fd, std::vector<uint8_t> &data)
+{
+    uint8_t hdr[2];
+    if (!recv_all(fd, hdr, 2))
+        return false;
+    uint64_t n = hdr[1] & 0x7f;
+    if (n == 126 || n == 127)
+    {
+        uint8_t ext[8];
+        int k = n == 126 ? 2 : 8;
+        if (!recv_all(fd, ext, k))
+            return false;
+        n = 0;
+        for (int i = 0; i < k; i++)
+            n = (n << 8) | ext[i];
+    }
+    data.resize(n);
+    return n == 0 || recv_all(fd, data.data(), n);
+}
+
+// Đọc 1 packet qua WS, đếm số frame đã dùng. Server cũ gửi header và
+// payload thành 2 frame nên vẫn hỗ trợ để so sánh.
+bool ws_recv_packet(int fd, PacketHeader &h, std::vector<uint8_t> &payload, long &frames)
+{
+    std::vector<uint8_t> data;
+    if (!ws_recv_frame(fd, data) || data.size() < sizeof(h))
+        return false;
+    frames++;
+    memcpy(&h, data.data(), sizeof(h));
+    if (data.size() >= sizeof(h) + h.payloadLength)
+    {
+        payload.assign(data.begin() + sizeof(h), data.begin() + sizeof(h) + h.payloadLength);
+        return true;
+    }
+    if (!ws_recv_frame(fd, payload))
+        return false;
+    frames++;
+    return true;
+}
+
+bool ws_wait_for(int fd, uint32_t type)
+{
+    PacketHeader h{};
+    std::vector<uint8_t> payload;
+    long frames = 0;
+    while (ws_recv_packet(fd, h, payload, frames))
+        if (h.msgType == type)
+            return true;
+    return false;
+}
+
+// Phiên WS: login + subscribe, đợi ACK
+int ws_open_session(const std::string &host, int port, const std::string &user, const std::string &topic)
+{
+    int fd = ws_connect(host, port);
+    if (fd < 0)
+        return -1;
+    if (!ws_send_packet(fd, MSG_LOGIN, user, "", 0, nullptr, 0, 1) || !ws_wait_for(fd, MSG_ACK) ||
+        !ws_send_packet(fd, MSG_SUBSCRIBE, user, topic, 0, nullptr, 0, 2) || !ws_wait_for(fd, MSG_ACK))
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void raise_fd_limit()
+{
+    rlimit rl{};
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+/* ================= FANOUT ================= */
+// --idle N        : số connection chỉ login + subscribe topic riêng
+// --idle-topics T : số topic mà các connection idle chia nhau
+// --subs K        : số subscriber của topic đo
+// --msgs M        : số message publish
+// --size S        : kích thước payload
+int bench_fanout(const Options &o)
+{
+    std::string host = o.str("host", "127.0.0.1");
+    int port = (int)o.num("port", DEFAULT_PORT);
+    long idle = o.num("idle", 0);
+    long idleTopics = o.num("idle-topics", 1000);
+    long subs = o.num("subs", 3);
+    long msgs = o.num("msgs", 20000);
+    long size = o.num("size", 64);
+
+    std::vector<int> idleFds;
+    for (long i = 0; i < idle; i++)
+    {
+        int fd = open_session(host, port, "idle" + std::to_string(i),
+                              "idle_" + std::to_string(i % idleTopics));
+        if (fd < 0)
+        {
+            std::cerr << "Cannot open idle session " << i << "\n";
+            return 1;
+        }
+        idleFds.push_back(fd);
+    }
+
+    std::vector<int> subFds;
+    for (long i = 0; i < subs; i++)
+    {
+        int fd = open_session(host, port, "sub" + std::to_string(i), "bench");
+        if (fd < 0)
+        {
+            std::cerr << "Cannot open subscriber " << i << "\n";
+            return 1;
+        }
+        subFds.push_back(fd);
+    }
+
+    int pub = open_session(host, port, "pub", "bench");
+    if (pub < 0)
+    {
+        std::cerr << "Cannot open publisher\n";
+        return 1;
+    }
+
+    // publisher cũng là subscriber nên phải đọc echo + ACK song song
+    std::thread pubReader([&] {
+        PacketHeader h{};
+        std::vector<uint8_t> payload;
+        long acks = 0;
+        while (acks < msgs && recv_packet(pub, h, payload))
+            if (h.msgType == MSG_ACK)
+                acks++;
+    });
+
+    std::atomic<long> done{0};
+    std::vector<std::thread> readers;
+    for (int fd : subFds)
+        readers.emplace_back([&, fd] {
+            PacketHeader h{};
+            std::vector<uint8_t> payload;
+            long got = 0;
+            while (got < msgs && recv_packet(fd, h, payload))
+                if (h.msgType == MSG_PUBLISH_TEXT)
+                    got++;
+            done++;
+        });
+
+    auto st0 = fetch_stats(host, port);
+    std::vector<uint8_t> body(size, 'x');
+    auto t0 = Clock::now();
+    for (long i = 0; i < msgs; i++)
+        if (!send_packet(pub, MSG_PUBLISH_TEXT, "pub", "bench", FLAG_GROUP, body.data(), body.size(), (uint32_t)i + 10))
+        {
+            std::cerr << "Publish failed\n";
+            return 1;
+        }
+    for (auto &t : readers)
+        t.join();
+    auto t1 = Clock::now();
+    pubReader.join();
+    auto st1 = fetch_stats(host, port);
+
+    double sec = std::chrono::duration<double>(t1 - t0).count();
+    std::cout << "mode=fanout idle=" << idle << " subs=" << subs << " msgs=" << msgs
+              << " size=" << size << " elapsed_ms=" << (long)(sec * 1000)
+              << " msgs_per_sec=" << (long)(msgs / sec)
+              << " us_per_publish=" << (sec * 1e6 / msgs);
+    // bộ đếm phía server, tính trung bình trên mỗi message publish
+    for (const char *k : {"bytes_copied", "checksum_bytes", "frames_encoded", "writev_calls", "cpu_us"})
+        std::cout << " server_" << k << "_per_msg=" << (double)(st1[k] - st0[k]) / msgs;
+    std::cout << "\n";
+
+    close(pub);
+    for (int fd : subFds)
+        close(fd);
+    for (int fd : idleFds)
+        close(fd);
+    return done == subs ? 0 : 1;
+}
+
+/* ================= THROUGHPUT ================= */
+// --topics N   : số topic, mỗi topic có 1 publisher
+// --subs K     : số subscriber mỗi topic
+// --seconds D  : thời gian đo
+// --size S     : kích thước payload
+// --window W   : số message chưa được ACK tối đa của mỗi publisher
+int bench_throughput(const Options &o)
+{
+    std::string host = o.str("host", "127.0.0.1");
+    int port = (int)o.num("port", DEFAULT_PORT);
+    long topics = o.num("topics", 16);
+    long subs = o.num("subs", 1);
+    long seconds = o.num("seconds", 5);
+    long size = o.num("size", 64);
+    long window = o.num("window", 64);
+
+    std::vector<int> pubFds, subFds;
+    for (long t = 0; t < topics; t++)
+    {
+        std::string topic = "tp_" + std::to_string(t);
+        for (long j = 0; j < subs; j++)
+        {
+            int fd = open_session(host, port, "tp_sub" + std::to_string(t) + "_" + std::to_string(j), topic);
+            if (fd < 0)
+            {
+                std::cerr << "Cannot open subscriber\n";
+                return 1;
+            }
+            subFds.push_back(fd);
+        }
+        int fd = open_session(host, port, "tp_pub" + std::to_string(t), topic);
+        if (fd < 0)
+        {
+            std::cerr << "Cannot open publisher\n";
+            return 1;
+        }
+        pubFds.push_back(fd);
+    }
+
+    std::atomic<bool> stop{false};
+    std::atomic<long> delivered{0}, published{0};
+    std::vector<std::thread> threads;
+
+    for (int fd : subFds)
+        threads.emplace_back([&, fd] {
+            PacketHeader h{};
+            std::vector<uint8_t> payload;
+            while (recv_packet(fd, h, payload))
+                if (h.msgType == MSG_PUBLISH_TEXT)
+                    delivered++;
+        });
+
+    for (long t = 0; t < topics; t++)
+    {
+        int fd = pubFds[t];
+        auto acked = std::make_shared<std::atomic<long>>(0);
+        threads.emplace_back([fd, acked] {
+            PacketHeader h{};
+            std::vector<uint8_t> payload;
+            while (recv_packet(fd, h, payload))
+                if (h.msgType == MSG_ACK)
+                    (*acked)++;
+        });
+        threads.emplace_back([&, fd, t, acked] {
+            std::string user = "tp_pub" + std::to_string(t), topic = "tp_" + std::to_string(t);
+            std::vector<uint8_t> body(size, 'x');
+            long sent = 0;
+            while (!stop)
+            {
+                if (sent - *acked >= window)
+                {
+                    std::this_thread::yield();
+                    continue;
+                }
+                if (!send_packet(fd, MSG_PUBLISH_TEXT, user, topic, FLAG_GROUP, body.data(), body.size(), (uint32_t)sent + 10))
+                    break;
+                sent++;
+                published++;
+            }
+        });
+    }
+
+    // bỏ 1 giây đầu để các connection ổn định
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    long d0 = delivered, p0 = published;
+    auto t0 = Clock::now();
+    std::this_thread::sleep_for(std::chrono::seconds(seconds));
+    long d1 = delivered, p1 = published;
+    double sec = std::chrono::duration<double>(Clock::now() - t0).count();
+
+    stop = true;
+    for (int fd : pubFds)
+        shutdown(fd, SHUT_RDWR);
+    for (int fd : subFds)
+        shutdown(fd, SHUT_RDWR);
+    for (auto &t : threads)
+        t.join();
+    for (int fd : pubFds)
+        close(fd);
+    for (int fd : subFds)
+        close(fd);
+
+    std::cout << "mode=throughput topics=" << topics << " subs=" << subs << " size=" << size
+              << " seconds=" << seconds << " published_per_sec=" << (long)((p1 - p0) / sec)
+              << " delivered_per_sec=" << (long)((d1 - d0) / sec) << "\n";
+    return 0;
+}
+
+/* ================= WS ================= */
+// --ws-port P  : port WebSocket của server
+// --subs K     : số subscriber WS
+// --msgs M     : số message publish (publisher cũng là client WS)
+// --size S     : kích thước payload
+int bench_ws(const Options &o)
+{
+    std::string host = o.str("host", "127.0.0.1");
+    int port = (int)o.num("ws-port", 8000);
+    long subs = o.num("subs", 4);
+    long msgs = o.num("msgs", 50000);
+    long size = o.num("size", 32);
+
+    std::vector<int> subFds;
+    for (long i = 0; i < subs; i++)
+    {
+        int fd = ws_open_session(host, port, "ws_sub" + std::to_string(i), "ws_bench");
+        if (fd < 0)
+        {
+            std::cerr << "Cannot open WS subscriber " << i << "\n";
+            return 1;
+        }
+        subFds.push_back(fd);
+    }
+    int pub = ws_open_session(host, port, "ws_pub", "ws_bench");
+    if (pub < 0)
+    {
+        std::cerr << "Cannot open WS publisher\n";
+        return 1;
+    }
+
+    std::thread pubReader([&] {
+        PacketHeader h{};
+        std::vector<uint8_t> payload;
+        long acks = 0, frames = 0;
+        while (acks < msgs && ws_recv_packet(pub, h, payload, frames))
+            if (h.msgType == MSG_ACK)
+                acks++;
+    });
+
+    std::atomic<long> frames{0};
+    std::vector<std::thread> readers;
+    for (int fd : subFds)
+        readers.emplace_back([&, fd] {
+            PacketHeader h{};
+            std::vector<uint8_t> payload;
+            long got = 0, n = 0;
+            while (got < msgs && ws_recv_packet(fd, h, payload, n))
+                if (h.msgType == MSG_PUBLISH_TEXT)
+                    got++;
+            frames += n;
+        });
+
+    std::vector<uint8_t> body(size, 'x');
+    auto t0 = Clock::now();
+    for (long i = 0; i < msgs; i++)
+        if (!ws_send_packet(pub, MSG_PUBLISH_TEXT, "ws_pub", "ws_bench", FLAG_GROUP, body.data(), body.size(), (uint32_t)i + 10))
+        {
+            std::cerr << "Publish failed\n";
+            return 1;
+        }
+    for (auto &t : readers)
+        t.join();
+    double sec = std::chrono::duration<double>(Clock::now() - t0).count();
+    pubReader.join();
+
+    std::cout << "mode=ws subs=" << subs << " msgs=" << msgs << " size=" << size
+              << " elapsed_ms=" << (long)(sec * 1000)
+              << " msgs_per_sec=" << (long)(msgs / sec)
+              << " deliveries_per_sec=" << (long)(msgs * subs / sec)
+              << " ws_frames_per_delivery=" << (double)frames / (msgs * subs) << "\n";
+
+    close(pub);
+    for (int fd : subFds)
+        close(fd);
+    return 0;
+}
+
+/* ================= RECONNECT STORM ================= */
+// Đếm số user online qua /sys/get_users
+long count_online(const std::string &host, int port)
+{
+    int fd = tcp_connect(host, port);
+    if (fd < 0)
+        return -1;
+    send_packet(fd, MSG_PUBLISH_TEXT, "", "/sys/get_users", 0, nullptr, 0, 1);
+    PacketHeader h{};
+    std::vector<uint8_t> payload;
+    long n = -1;
+    while (recv_packet(fd, h, payload))
+        if (h.msgType == MSG_PUBLISH_TEXT)
+        {
+            n = 0;
+            for (uint8_t ch : payload)
+                n += ch == '\n';
+            break;
+        }
+    close(fd);
+    return n;
+}
+
+// --users N   : số user
+// --subs K    : số topic mỗi user subscribe
+// --topics T  : tổng số topic
+// --rounds R  : số lần cả N user cùng online rồi cùng rớt
+int bench_storm(const Options &o)
+{
+    std::string host = o.str("host", "127.0.0.1");
+    int port = (int)o.num("port", DEFAULT_PORT);
+    long users = o.num("users", 10000);
+    long subs = o.num("subs", 2);
+    long topics = o.num("topics", 100);
+    long rounds = o.num("rounds", 2);
+
+    double loginSec = 0, dropSec = 0;
+    for (long r = 0; r < rounds; r++)
+    {
+        // 1. mọi user kết nối, login + subscribe liên tục không chờ
+        auto t0 = Clock::now();
+        std::vector<int> fds;
+        for (long i = 0; i < users; i++)
+        {
+            int fd = tcp_connect(host, port);
+            if (fd < 0)
+            {
+                std::cerr << "Cannot connect user " << i << "\n";
+                return 1;
+            }
+            std::string user = "storm" + std::to_string(i);
+            send_packet(fd, MSG_LOGIN, user, "", 0, nullptr, 0, 1);
+            for (long k = 0; k < subs; k++)
+                send_packet(fd, MSG_SUBSCRIBE, user, "storm_t" + std::to_string((i + k * 7) % topics), 0, nullptr, 0, (uint32_t)k + 2);
+            fds.push_back(fd);
+        }
+        // 2. đợi đủ ACK của từng user
+        for (int fd : fds)
+            for (long k = 0; k < subs + 1; k++)
+                if (!wait_for(fd, MSG_ACK))
+                {
+                    std::cerr << "Missing ACK\n";
+                    return 1;
+                }
+        auto t1 = Clock::now();
+
+        // 3. tất cả rớt cùng lúc, đợi server dọn xong
+        for (int fd : fds)
+            close(fd);
+        while (count_online(host, port) > 0)
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        auto t2 = Clock::now();
+
+        loginSec += std::chrono::duration<double>(t1 - t0).count();
+        dropSec += std::chrono::duration<double>(t2 - t1).count();
+    }
+
+    std::cout << "mode=storm users=" << users << " subs=" << subs << " topics=" << topics
+              << " rounds=" << rounds
+              << " login_ms_per_round=" << (long)(loginSec * 1000 / rounds)
+              << " drop_ms_per_round=" << (long)(dropSec * 1000 / rounds)
+              << " logins_per_sec=" << (long)(users * rounds / loginSec)
+              << " disconnects_per_sec=" << (long)(users * rounds / dropSec) << "\n";
+    return 0;
+}
+
+/* ================= FILE ================= */
+// 1 người gửi truyền file qua topic tới N người nhận.
+// --recipients N : số người nhận
+// --mb M         : kích thước file (MB)
+// --chunk C      : kích thước chunk xin server (dùng kích thước server đồng ý)
+// --window W     : cửa sổ credit xin server (số chunk chưa được ACK)
+// --legacy       : không xin cửa sổ: server ACK từng chunk, bench tự giới hạn W chunk
+// --relay        : xin server chỉ chuyển tiếp (không lưu vào upload/)
+// --slow-rx-us U : người nhận đầu tiên ngủ U micro giây sau mỗi chunk (subscriber chậm)
+// --server-pid P : lấy mẫu RSS của server trong lúc truyền
+
+// RSS hiện tại của process (KB), 0 nếu không đọc được
+static long read_rss_kb(long pid)
+{
+    FILE *fp = fopen(("/proc/" + std::to_string(pid) + "/status").c_str(), "r");
+    if (!fp)
+        return 0;
+    char line[256];
+    long kb = 0;
+    while (fgets(line, sizeof(line), fp))
+        if (strncmp(line, "VmRSS:", 6) == 0)
+            kb = atol(line + 6);
+    fclose(fp);
+    return kb;
+}
+
+int bench_file(const Options &o)
+{
+    std::string host = o.str("host", "127.0.0.1");
+    int port = (int)o.num("port", DEFAULT_PORT);
+    long recipients = o.num("recipients", 10);
+    uint64_t total = (uint64_t)o.num("mb", 1024) << 20;
+    long chunk = o.num("chunk", 65536);
+    long window = o.num("window", 16);
+    bool legacy = o.kv.count("legacy") > 0;
+    bool relay = o.kv.count("relay") > 0;
+    long slowUs = o.num("slow-rx-us", 0);
+    long serverPid = o.num("server-pid", 0);
+
+    std::vector<int> rxFds;
+    for (long i = 0; i < recipients; i++)
+    {
+        int fd = open_session(host, port, "frx" + std::to_string(i), "file_bench");
+        if (fd < 0)
+        {
+            std::cerr << "Cannot open recipient " << i << "\n";
+            return 1;
+        }
+        rxFds.push_back(fd);
+    }
+    int tx = open_session(host, port, "ftx", "file_bench_tx");
+    if (tx < 0)
+    {
+        std::cerr << "Cannot open sender\n";
+        return 1;
+    }
+
+    std::atomic<long> done{0};
+    std::vector<std::thread> readers;
+    for (size_t i = 0; i < rxFds.size(); i++)
+        readers.emplace_back([&, i] {
+            PacketHeader h{};
+            std::vector<uint8_t> payload;
+            uint64_t got = 0;
+            while (recv_packet(rxFds[i], h, payload))
+            {
+                if (h.msgType != MSG_FILE_DATA)
+                    continue;
+                got += payload.size();
+                if (h.flags & FLAG_LAST)
+                    break;
+                if (i == 0 && slowUs)
+                    std::this_thread::sleep_for(std::chrono::microseconds(slowUs));
+            }
+            if (got == total)
+                done++;
+        });
+
+    auto st0 = fetch_stats(host, port);
+    const uint32_t msgId = 7000;
+    std::string req = std::string("bench.bin") + '\0' + (relay ? "relay=1" : "relay=0") +
+                      ";chunk=" + std::to_string(chunk);
+    if (!legacy)
+        req += ";window=" + std::to_string(window);
+    auto t0 = Clock::now();
+    if (!send_packet(tx, MSG_PUBLISH_FILE, "ftx", "file_bench", FLAG_GROUP, req.data(), req.size(), msgId))
+        return 1;
+
+    // đọc ACK song song: số chunk đã được ACK quyết định được gửi tiếp bao nhiêu
+    std::string agreed;
+    std::atomic<long> chunks{-1}; // biết sau ACK đầu tiên
+    std::atomic<long> ackedChunks{0};
+    long ackPackets = 0;
+    std::thread ackReader([&] {
+        PacketHeader h{};
+        std::vector<uint8_t> payload;
+        long opens = 0;
+        while (recv_packet(tx, h, payload))
+        {
+            if (h.msgType == MSG_ERROR)
+                std::cerr << "Server error: " << std::string(payload.begin(), payload.end()) << "\n";
+            if (h.msgType != MSG_ACK || h.messageId != msgId)
+                continue;
+            ackPackets++;
+            std::string text(payload.begin(), payload.end());
+            if (chunks < 0)
+            {
+                agreed = text;
+                auto kv = [&](const char *k, long def) {
+                    size_t p = text.find(std::string(";") + k + "=");
+                    return p == std::string::npos ? def : std::stol(text.substr(p + strlen(k) + 2));
+                };
+                chunk = kv("chunk", chunk);
+                window = kv("window", window);
+                chunks = (long)((total + chunk - 1) / chunk) + 1; // + chunk LAST
+                opens++;
+                continue;
+            }
+            if (legacy && opens < 2)
+            {
+                opens++; // server gửi 2 ACK cho PUBLISH_FILE kiểu cũ
+                continue;
+            }
+            if (legacy)
+                ackedChunks++;
+            else
+            {
+                size_t p = text.find("acked=");
+                if (p != std::string::npos)
+                    ackedChunks = std::stol(text.substr(p + 6));
+            }
+            if (ackedChunks >= chunks)
+                break;
+        }
+    });
+    while (chunks < 0)
+        std::this_thread::yield();
+
+    std::atomic<bool> sampling{serverPid > 0};
+    long rssMax = 0;
+    std::thread sampler([&] {
+        while (sampling)
+        {
+            rssMax = std::max(rssMax, read_rss_kb(serverPid));
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        }
+    });
+
+    std::vector<uint8_t> body(chunk);
+    for (long i = 0; i < chunk; i++)
+        body[i] = (uint8_t)(i * 131);
+    long sent = 0;
+    for (uint64_t off = 0; off < total; off += chunk)
+    {
+        while (sent - ackedChunks >= window)
+            std::this_thread::sleep_for(std::chrono::microseconds(20));
+        size_t n = (size_t)std::min<uint64_t>(chunk, total - off);
+        if (!send_packet(tx, MSG_FILE_DATA, "ftx", "file_bench", FLAG_GROUP, body.data(), n, msgId))
+            return 1;
+        sent++;
+    }
+    send_packet(tx, MSG_FILE_DATA, "ftx", "file_bench", FLAG_GROUP | FLAG_LAST, nullptr, 0, msgId);
+
+    for (auto &t : readers)
+        t.join();
+    auto t1 = Clock::now();
+    ackReader.join();
+    sampling = false;
+    sampler.join();
+    auto st1 = fetch_stats(host, port);
+
+    double sec = std::chrono::duration<double>(t1 - t0).count();
+    double mb = (double)total / (1 << 20);
+    std::cout << "mode=file recipients=" << recipients << " mb=" << (long)mb << " chunk=" << chunk
+              << " chunks=" << chunks << " flow=" << (legacy ? "ack-per-chunk" : "credit") << " window=" << window
+              << " requested=" << (relay ? "relay" : "store") << " agreed=" << agreed
+              << " elapsed_ms=" << (long)(sec * 1000)
+              << " mb_per_sec=" << (long)(mb / sec)
+              << " delivered_mb_per_sec=" << (long)(mb * recipients / sec)
+              << " ack_packets=" << ackPackets;
+    if (serverPid)
+        std::cout << " server_rss_max_mb=" << rssMax / 1024;
+    for (const char *k : {"file_bytes_relayed", "file_bytes_archived", "file_acks", "file_credit_stalls",
+                          "persist_flush_us", "cpu_us"})
+        std::cout << " server_" << k << "=" << st1[k] - st0[k];
+    std::cout << "\n";
+
+    close(tx);
+    for (int fd : rxFds)
+        close(fd);
+    return done == recipients ? 0 : 1;
+}
+
+/* ================= LOAD ================= */
+// Bộ sinh tải end-to-end: mở nhiều session TCP + WS, subscribe/publish theo
+// phân phối topic, publish với tốc độ mục tiêu và đo độ trễ giao nhận
+// (8 byte đầu payload là thời điểm gửi).
+// --tcp N / --ws M       : số session TCP / WebSocket (--ws-port cho WS)
+// --topics T             : số topic
+// --dist uniform|zipf    : phân phối chọn topic khi subscribe
+// --zipf-s S             : hệ số Zipf (mặc định 1.0)
+// --subs-per-session K   : số topic mỗi session subscribe
+// --publishers P         : số session publish (lấy đều từ TCP và WS); server chỉ cho
+//                          publish vào topic đã subscribe nên mỗi publisher chọn ngẫu nhiên
+//                          trong các topic của mình, tần suất topic theo đúng --dist
+// --rate R               : tổng số message publish mỗi giây
+// --seconds D            : thời gian đo (sau --warmup W giây khởi động)
+// --size S               : kích thước payload (>= 8)
+// --readers N            : số thread đọc
+// --json                 : in kết quả 1 dòng JSON để lưu lại so sánh giữa các commit
+
+static uint64_t now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+}
+
+// Chọn topic theo phân phối (CDF tích lũy)
+struct TopicPicker
+{
+    std::vector<double> cdf;
+
+    TopicPicker(long n, bool zipf, double s)
+    {
+        double total = 0;
+        for (long i = 0; i < n; i++)
+        {
+            total += zipf ? 1.0 / std::pow((double)(i + 1), s) : 1.0;
+            cdf.push_back(total);
+        }
+        for (auto &x : cdf)
+            x /= total;
+    }
+    long pick(std::mt19937_64 &rng) const
+    {
+        double u = std::uniform_real_distribution<double>(0, 1)(rng);
+        return std::min<long>(std::lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin(), (long)cdf.size() - 1);
+    }
+};
+
+struct LoadSession
+{
+    int fd;
+    bool ws;
+    std::string user;
+    std::vector<long> topics;
+};
+
+// Kết quả đọc của 1 thread
+struct LoadReader
+{
+    std::vector<int> fds;
+    std::vector<bool> ws;
+    std::vector<uint32_t> lat_us; // độ trễ các message trong cửa sổ đo
+    std::atomic<uint64_t> delivered{0}; // thread chính đọc để biết khi nào hết message
+    uint64_t bytes = 0;
+};
+
+// Một packet tới: chỉ tính message của bench gửi trong cửa sổ đo
+static void load_on_packet(LoadReader &r, const PacketHeader &h, const uint8_t *payload,
+                           uint64_t from, uint64_t to)
+{
+    if (h.msgType != MSG_PUBLISH_TEXT || h.payloadLength < 8 || strncmp(h.topic, "ld_", 3) != 0)
+        return;
+    uint64_t sent;
+    memcpy(&sent, payload, 8);
+    if (sent < from || sent >= to)
+        return;
+    r.lat_us.push_back((uint32_t)std::min<uint64_t>((now_ns() - sent) / 1000, UINT32_MAX));
+    r.delivered.fetch_add(1, std::memory_order_relaxed);
+    r.bytes += sizeof(PacketHeader) + h.payloadLength;
+}
+
+// Tách các packet trong buf (TCP: nối tiếp; WS: mỗi frame chứa packet), trả số byte đã dùng
+static size_t load_parse(LoadReader &r, bool ws, const uint8_t *p, size_t n, uint64_t from, uint64_t to)
+{
+    size_t pos = 0;
+    while (true)
+    {
+        const uint8_t *q = p + pos;
+        size_t left = n - pos;
+        if (!ws)
+        {
+            PacketHeader h;
+            if (left < sizeof(h))
+                break;
+            memcpy(&h, q, sizeof(h));
+            if (left < sizeof(h) + h.payloadLength)
+                break;
+            load_on_packet(r, h, q + sizeof(h), from, to);
+            pos += sizeof(h) + h.payloadLength;
+            continue;
+        }
+        if (left < 2)
+            break;
+        size_t hl = 2;
+        uint64_t len = q[1] & 0x7f;
+        if (len >= 126)
+        {
+            size_t k = len == 126 ? 2 : 8;
+            if (left < 2 + k)
+                break;
+            len = 0;
+            for (size_t i = 0; i < k; i++)
+                len = (len << 8) | q[2 + i];
+            hl += k;
+        }
+        if (left < hl + len)
+            break;
+        // frame có thể chứa nhiều packet
+        for (size_t off = 0; off + sizeof(PacketHeader) <= len;)
+        {
+            PacketHeader h;
+            memcpy(&h, q + hl + off, sizeof(h));
+            if (off + sizeof(h) + h.payloadLength > len)
+                break;
+            load_on_packet(r, h, q + hl + off + sizeof(h), from, to);
+            off += sizeof(h) + h.payloadLength;
+        }
+        pos += hl + len;
+    }
+    return pos;
+}
+
+static void load_reader_loop(LoadReader &r, std::atomic<bool> &stop, uint64_t from, uint64_t to)
+{
+    int ep = epoll_create1(0);
+    std::vector<std::vector<uint8_t>> bufs(r.fds.size());
+    for (size_t i = 0; i < r.fds.size(); i++)
+    {
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.u64 = i;
+        epoll_ctl(ep, EPOLL_CTL_ADD, r.fds[i], &ev);
+    }
+    std::vector<epoll_event> evs(256);
+    uint8_t tmp[65536];
+    while (!stop)
+    {
+        int n = epoll_wait(ep, evs.data(), (int)evs.size(), 100);
+        for (int k = 0; k < n; k++)
+        {
+            size_t i = evs[k].data.u64;
+            ssize_t got = recv(r.fds[i], tmp, sizeof(tmp), MSG_DONTWAIT);
+            if (got <= 0)
+            {
+                if (got == 0)
+                    epoll_ctl(ep, EPOLL_CTL_DEL, r.fds[i], nullptr);
+                continue;
+            }
+            auto &b = bufs[i];
+            if (b.empty())
+            {
+                // thường gặp: xử lý thẳng trên tmp, chỉ giữ phần dở dang
+                size_t used = load_parse(r, r.ws[i], tmp, got, from, to);
+                b.assign(tmp + used, tmp + got);
+            }
+            else
+            {
+                b.insert(b.end(), tmp, tmp + got);
+                size_t used = load_parse(r, r.ws[i], b.data(), b.size(), from, to);
+                b.erase(b.begin(), b.begin() + used);
+            }
+        }
+    }
+    close(ep);
+}
+
+// In kết quả dạng key=value hoặc 1 dòng JSON
+static void print_report(const std::vector<std::pair<std::string, std::string>> &kv, bool json)
+{
+    if (!json)
+    {
+        for (size_t i = 0; i < kv.size(); i++)
+            std::cout << (i ? " " : "") << kv[i].first << "=" << kv[i].second;
+        std::cout << "\n";
+        return;
+    }
+    std::cout << "{";
+    for (size_t i = 0; i < kv.size(); i++)
+    {
+        const std::string &v = kv[i].second;
+        bool num = !v.empty() && v.find_first_not_of("0123456789.-") == std::string::npos;
+        std::cout << (i ? "," : "") << "\"" << kv[i].first << "\":" << (num ? v : "\"" + v + "\"");
+    }
+    std::cout << "}\n";
+}
+
+int bench_load(const Options &o)
+{
+    std::string host = o.str("host", "127.0.0.1");
+    int port = (int)o.num("port", DEFAULT_PORT);
+    int wsPort = (int)o.num("ws-port", 8000);
+    long tcpN = o.num("tcp", 1000);
+    long wsN = o.num("ws", 0);
+    long topics = o.num("topics", 100);
+    std::string dist = o.str("dist", "uniform");
+    double zipfS = std::stod(o.str("zipf-s", "1.0"));
+    long perSession = std::max(1L, std::min(o.num("subs-per-session", 1), topics));
+    long pubs = o.num("publishers", 50);
+    long rate = o.num("rate", 10000);
+    long seconds = o.num("seconds", 10);
+    long warmup = o.num("warmup", 1);
+    long size = std::max(8L, o.num("size", 64));
+    long readersN = std::max(1L, o.num("readers", 2));
+    bool json = o.kv.count("json") > 0;
+
+    TopicPicker picker(topics, dist == "zipf", zipfS);
+    std::mt19937_64 rng(42);
+    std::vector<long> subCount(topics, 0);
+    std::vector<LoadSession> sessions;
+
+    // 1. mở session: login + subscribe K topic khác nhau
+    for (long i = 0; i < tcpN + wsN; i++)
+    {
+        LoadSession s;
+        s.ws = i >= tcpN;
+        s.user = "ld" + std::to_string(i);
+        while ((long)s.topics.size() < perSession)
+        {
+            long t = picker.pick(rng);
+            if (std::find(s.topics.begin(), s.topics.end(), t) == s.topics.end())
+                s.topics.push_back(t);
+        }
+        std::string first = "ld_" + std::to_string(s.topics[0]);
+        s.fd = s.ws ? ws_open_session(host, wsPort, s.user, first) : open_session(host, port, s.user, first);
+        if (s.fd < 0)
+        {
+            std::cerr << "Cannot open session " << i << "\n";
+            return 1;
+        }
+        for (size_t k = 1; k < s.topics.size(); k++)
+        {
+            std::string t = "ld_" + std::to_string(s.topics[k]);
+            bool ok = s.ws ? ws_send_packet(s.fd, MSG_SUBSCRIBE, s.user, t, 0, nullptr, 0, 2) && ws_wait_for(s.fd, MSG_ACK)
+                           : send_packet(s.fd, MSG_SUBSCRIBE, s.user, t, 0, nullptr, 0, 2) && wait_for(s.fd, MSG_ACK);
+            if (!ok)
+            {
+                std::cerr << "Subscribe failed\n";
+                return 1;
+            }
+        }
+        for (long t : s.topics)
+            subCount[t]++;
+        sessions.push_back(std::move(s));
+    }
+
+    // 2. publisher lấy đều trong các session
+    std::vector<LoadSession *> pubList;
+    pubs = std::max(1L, std::min(pubs, (long)sessions.size()));
+    for (long i = 0; i < pubs; i++)
+        pubList.push_back(&sessions[i * sessions.size() / pubs]);
+
+    uint64_t t0 = now_ns();
+    uint64_t from = t0 + (uint64_t)warmup * 1000000000ull;
+    uint64_t to = from + (uint64_t)seconds * 1000000000ull;
+
+    std::vector<LoadReader> readers(readersN);
+    for (size_t i = 0; i < sessions.size(); i++)
+    {
+        readers[i % readersN].fds.push_back(sessions[i].fd);
+        readers[i % readersN].ws.push_back(sessions[i].ws);
+    }
+    std::atomic<bool> stop{false};
+    std::vector<std::thread> threads;
+    for (auto &r : readers)
+        threads.emplace_back(load_reader_loop, std::ref(r), std::ref(stop), from, to);
+
+    // 3. publish theo tốc độ mục tiêu (open-loop, không chờ ACK)
+    std::vector<uint8_t> body(size, 'x');
+    uint64_t sent = 0, measured = 0, expected = 0;
+    while (true)
+    {
+        uint64_t now = now_ns();
+        if (now >= to)
+            break;
+        uint64_t due = (uint64_t)((double)(now - t0) * rate / 1e9);
+        while (sent < due)
+        {
+            LoadSession *p = pubList[sent % pubList.size()];
+            long t = p->topics[rng() % p->topics.size()];
+            std::string topic = "ld_" + std::to_string(t);
+            uint64_t ts = now_ns();
+            memcpy(body.data(), &ts, 8);
+            bool ok = p->ws ? ws_send_packet(p->fd, MSG_PUBLISH_TEXT, p->user, topic, FLAG_GROUP, body.data(), body.size())
+                            : send_packet(p->fd, MSG_PUBLISH_TEXT, p->user, topic, FLAG_GROUP, body.data(), body.size());
+            if (!ok)
+            {
+                std::cerr << "Publish failed\n";
+                return 1;
+            }
+            sent++;
+            if (ts >= from && ts < to)
+            {
+                // mọi subscriber của topic nhận được, kể cả người publish
+                measured++;
+                expected += subCount[t];
+            }
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+
+    // 4. chờ các message còn trên đường tới (tối đa 5s, dừng khi không còn tăng)
+    auto delivered = [&] {
+        uint64_t n = 0;
+        for (auto &r : readers)
+            n += r.delivered;
+        return n;
+    };
+    uint64_t last = 0;
+    for (int i = 0; i < 50; i++)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        uint64_t d = delivered();
+        if (d >= expected || (i >= 5 && d == last))
+            break;
+        last = d;
+    }
+    stop = true;
+    for (auto &t : threads)
+        t.join();
+
+    std::vector<uint32_t> lat;
+    uint64_t got = 0, bytes = 0;
+    for (auto &r : readers)
+    {
+        lat.insert(lat.end(), r.lat_us.begin(), r.lat_us.end());
+        got += r.delivered;
+        bytes += r.bytes;
+    }
+    std::sort(lat.begin(), lat.end());
+    auto pct = [&](double q) -> uint32_t { return lat.empty() ? 0 : lat[std::min(lat.size() - 1, (size_t)(q * lat.size()))]; };
+
+    print_report({{"mode", "load"},
+                  {"tcp", std::to_string(tcpN)},
+                  {"ws", std::to_string(wsN)},
+                  {"topics", std::to_string(topics)},
+                  {"dist", dist},
+                  {"subs_per_session", std::to_string(perSession)},
+                  {"publishers", std::to_string(pubs)},
+                  {"size", std::to_string(size)},
+                  {"target_rate", std::to_string(rate)},
+                  {"seconds", std::to_string(seconds)},
+                  {"msgs_per_sec", std::to_string(measured / seconds)},
+                  {"deliveries_per_sec", std::to_string(got / seconds)},
+                  {"bytes_per_sec", std::to_string(bytes / seconds)},
+                  {"expected", std::to_string(expected)},
+                  {"delivered", std::to_string(got)},
+                  {"p50_us", std::to_string(pct(0.50))},
+                  {"p99_us", std::to_string(pct(0.99))},
+                  {"p999_us", std::to_string(pct(0.999))},
+                  {"max_us", std::to_string(lat.empty() ? 0 : lat.back())}},
+                 json);
+
+    for (auto &s : sessions)
+        close(s.fd);
+    return got == expected ? 0 : 1;
+}
+
+/* ================= SLOW SUBSCRIBER ================= */
+// 1 publisher đẩy message vào topic có K subscriber bình thường và 1
+// subscriber ngừng đọc trong --stall-ms rồi mới đọc tiếp.
+// --subs K       : số subscriber đọc bình thường
+// --msgs M       : số message publish
+// --size S       : kích thước payload
+// --stall-ms T   : thời gian subscriber chậm ngừng đọc
+// --server-pid P : lấy mẫu RSS của server trong lúc chạy
+int bench_slow(const Options &o)
+{
+    std::string host = o.str("host", "127.0.0.1");
+    int port = (int)o.num("port", DEFAULT_PORT);
+    long subs = o.num("subs", 3);
+    long msgs = o.num("msgs", 200000);
+    long size = o.num("size", 1024);
+    long stallMs = o.num("stall-ms", 3000);
+    long serverPid = o.num("server-pid", 0);
+
+    std::vector<int> subFds;
+    for (long i = 0; i < subs; i++)
+    {
+        int fd = open_session(host, port, "fast" + std::to_string(i), "slow_bench");
+        if (fd < 0)
+        {
+            std::cerr << "Cannot open subscriber " << i << "\n";
+            return 1;
+        }
+        subFds.push_back(fd);
+    }
+    int slow = open_session(host, port, "slow", "slow_bench");
+    int pub = open_session(host, port, "spub", "slow_bench");
+    if (slow < 0 || pub < 0)
+    {
+        std::cerr << "Cannot open slow subscriber / publisher\n";
+        return 1;
+    }
+
+    // publisher cũng là subscriber: đọc echo + ACK để không tự nghẽn
+    std::thread pubReader([&] {
+        PacketHeader h{};
+        std::vector<uint8_t> payload;
+        long acks = 0;
+        while (acks < msgs && recv_packet(pub, h, payload))
+            if (h.msgType == MSG_ACK)
+                acks++;
+    });
+
+    auto t0 = Clock::now();
+    std::atomic<long> fastDone{0};
+    std::atomic<long> fastLastMs{0};
+    std::vector<std::thread> readers;
+    for (int fd : subFds)
+        readers.emplace_back([&, fd] {
+            PacketHeader h{};
+            std::vector<uint8_t> payload;
+            long got = 0;
+            while (got < msgs && recv_packet(fd, h, payload))
+                if (h.msgType == MSG_PUBLISH_TEXT)
+                    got++;
+            if (got == msgs)
+                fastDone++;
+            long ms = (long)std::chrono::duration<double, std::milli>(Clock::now() - t0).count();
+            long prev = fastLastMs;
+            while (ms > prev && !fastLastMs.compare_exchange_weak(prev, ms))
+                ;
+        });
+
+    // subscriber chậm: ngừng đọc, sau đó đọc tới khi đủ hoặc 2s không có gì
+    long slowGot = 0;
+    bool slowClosed = false;
+    std::thread slowReader([&] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(stallMs));
+        timeval tv{2, 0};
+        setsockopt(slow, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        PacketHeader h{};
+        std::vector<uint8_t> payload;
+        while (slowGot < msgs)
+        {
+            if (!recv_packet(slow, h, payload))
+            {
+                slowClosed = errno != EAGAIN && errno != EWOULDBLOCK;
+                break;
+            }
+            if (h.msgType == MSG_PUBLISH_TEXT)
+                slowGot++;
+        }
+    });
+
+    std::atomic<bool> sampling{serverPid > 0};
+    long rssMax = 0;
+    std::thread sampler([&] {
+        while (sampling)
+        {
+            rssMax = std::max(rssMax, read_rss_kb(serverPid));
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        }
+    });
+
+    auto st0 = fetch_stats(host, port);
+    std::vector<uint8_t> body(size, 'x');
+    for (long i = 0; i < msgs; i++)
+        if (!send_packet(pub, MSG_PUBLISH_TEXT, "spub", "slow_bench", FLAG_GROUP, body.data(), body.size(), (uint32_t)i + 10))
+        {
+            std::cerr << "Publish failed\n";
+            break;
+        }
+    long publishMs = (long)std::chrono::duration<double, std::milli>(Clock::now() - t0).count();
+    for (auto &t : readers)
+        t.join();
+    slowReader.join();
+    sampling = false;
+    sampler.join();
+    auto st1 = fetch_stats(host, port);
+
+    std::cout << "mode=slow subs=" << subs << " msgs=" << msgs << " size=" << size << " stall_ms=" << stallMs
+              << " publish_ms=" << publishMs << " fast_done_ms=" << fastLastMs
+              << " fast_complete=" << fastDone << "/" << subs
+              << " slow_received=" << slowGot << " slow_closed=" << (slowClosed ? 1 : 0);
+    if (serverPid)
+        std::cout << " server_rss_max_mb=" << rssMax / 1024;
+    for (const char *k : {"sendq_drops", "sendq_pauses", "sendq_spills", "sendq_spill_bytes", "sendq_disconnects"})
+        std::cout << " server_" << k << "=" << st1[k] - st0[k];
+    std::cout << "\n";
+
+    close(pub);
+    pubReader.join();
+    close(slow);
+    for (int fd : subFds)
+        close(fd);
+    return fastDone == subs ? 0 : 1;
+}
+
+/* ================= DEDUP ================= */
+// Tải lên 1 bộ file giống thực tế: mỗi file gốc được gửi lại nguyên vẹn cho
+// người khác vài lần và có vài phiên bản sửa nhẹ (sửa 4 KB ở vị trí ngẫu
+// nhiên + ghi thêm 256 KB vào cuối, giống file log/tài liệu được cập nhật).
+// --files F    : số file gốc
+// --mb M       : kích thước mỗi file gốc (MB)
+// --resends R  : số lần gửi lại nguyên file
+// --versions V : số phiên bản sửa của mỗi file
+// --no-ref     : không hỏi MSG_FILE_HAVE, gửi đủ dữ liệu mọi block
+// --link-mbit L: giới hạn tốc độ gửi L Mbit/s (giả lập mạng thật, 0 = không giới hạn)
+// Chạy với server --files dedup, rồi --files store để so dung lượng lưu.
+
+// ACK của người gửi: tùy chọn/kết quả MSG_FILE_HAVE và số chunk đã ACK
+struct DedupAcks
+{
+    std::mutex mu;
+    std::condition_variable cv;
+    std::unordered_map<uint32_t, std::string> text;
+    std::unordered_map<uint32_t, long> acked;
+
+    // đợi ACK có nội dung của msgId ("" nếu hết giờ)
+    std::string wait_text(uint32_t id)
+    {
+        std::unique_lock<std::mutex> lk(mu);
+        cv.wait_for(lk, std::chrono::seconds(10), [&] { return text.count(id) > 0; });
+        auto it = text.find(id);
+        return it == text.end() ? "" : it->second;
+    }
+};
+
+static std::string opt_of(const std::string &opts, const std::string &k)
+{
+    size_t p = (";" + opts).find(";" + k + "=");
+    if (p == std::string::npos)
+        return "";
+    size_t e = opts.find(';', p + k.size() + 1);
+    return opts.substr(p + k.size() + 1, e == std::string::npos ? std::string::npos : e - p - k.size() - 1);
+}
+
+// Gửi 1 file theo offset + cửa sổ credit, block server đã có gửi bằng hash.
+// Trả về số byte payload đã gửi, -1 nếu lỗi.
+static long long dedup_upload(int fd, DedupAcks &acks, uint32_t msgId, const std::string &name,
+                              const std::vector<uint8_t> &data, bool useRef, long linkMbit)
+{
+    const char *user = "dtx", *topic = "dedup_bench";
+    std::string req = name + '\0' + "chunk=262144;window=16;key=" + name + ";size=" + std::to_string(data.size()) +
+                      (useRef ? ";dedup=1" : "");
+    if (!send_packet(fd, MSG_PUBLISH_FILE, user, topic, FLAG_GROUP, req.data(), req.size(), msgId))
+        return -1;
+    std::string agreed = acks.wait_text(msgId);
+    if (agreed.empty() || agreed[0] == '!')
+        return -1;
+    uint64_t chunk = std::stoull(opt_of(agreed, "chunk"));
+    long window = std::stol(opt_of(agreed, "window"));
+    uint64_t block = opt_of(agreed, "block").empty() ? 0 : std::stoull(opt_of(agreed, "block"));
+
+    std::vector<std::array<uint8_t, FILE_HASH_SIZE>> hashes;
+    std::string have;
+    if (block)
+    {
+        for (uint64_t off = 0; off < data.size(); off += block)
+        {
+            hashes.emplace_back();
+            sha256(data.data() + off, std::min<uint64_t>(block, data.size() - off), hashes.back().data());
+        }
+        std::vector<uint8_t> q(hashes.size() * FILE_HASH_SIZE);
+        for (size_t i = 0; i < hashes.size(); i++)
+            memcpy(q.data() + i * FILE_HASH_SIZE, hashes[i].data(), FILE_HASH_SIZE);
+        send_packet(fd, MSG_FILE_HAVE, user, "", 0, q.data(), q.size(), msgId + 1);
+        have = acks.wait_text(msgId + 1);
+        if (have.size() != hashes.size())
+            have.clear();
+    }
+
+    long long wire = 0;
+    long sent = 0;
+    auto tStart = Clock::now();
+    std::vector<uint8_t> buf(8 + std::max<uint64_t>(chunk, FILE_HASH_SIZE));
+    uint64_t pos = 0, size = data.size();
+    while (pos < size)
+    {
+        {
+            std::unique_lock<std::mutex> lk(acks.mu);
+            acks.cv.wait(lk, [&] { return sent - acks.acked[msgId] < window; });
+        }
+        memcpy(buf.data(), &pos, 8);
+        size_t bi = block ? (size_t)(pos / block) : 0;
+        if (bi < have.size() && have[bi] == '1')
+        {
+            memcpy(buf.data() + 8, hashes[bi].data(), FILE_HASH_SIZE);
+            send_packet(fd, MSG_FILE_REF, user, topic, FLAG_GROUP, buf.data(), 8 + FILE_HASH_SIZE, msgId);
+            wire += 8 + FILE_HASH_SIZE;
+            pos = std::min<uint64_t>((bi + 1) * block, size);
+        }
+        else
+        {
+            uint64_t n = std::min<uint64_t>(chunk, size - pos);
+            if (block)
+                n = std::min<uint64_t>(n, (bi + 1) * block - pos); // không vắt qua 2 block
+            memcpy(buf.data() + 8, data.data() + pos, n);
+            if (!send_packet(fd, MSG_FILE_DATA, user, topic, FLAG_GROUP, buf.data(), 8 + n, msgId))
+                return -1;
+            wire += 8 + n;
+            pos += n;
+        }
+        sent++;
+        if (linkMbit)
+            std::this_thread::sleep_until(tStart + std::chrono::microseconds(wire * 8 / linkMbit));
+    }
+    send_packet(fd, MSG_FILE_DATA, user, topic, FLAG_GROUP | FLAG_LAST, &size, 8, msgId);
+    sent++;
+
+    // đợi server ACK đủ mọi chunk
+    std::unique_lock<std::mutex> lk(acks.mu);
+    if (!acks.cv.wait_for(lk, std::chrono::seconds(30), [&] { return acks.acked[msgId] >= sent; }))
+        return -1;
+    return wire;
+}
+
+int bench_dedup(const Options &o)
+{
+    std::string host = o.str("host", "127.0.0.1");
+    int port = (int)o.num("port", DEFAULT_PORT);
+    long files = o.num("files", 20);
+    uint64_t fileBytes = (uint64_t)o.num("mb", 8) << 20;
+    long resends = o.num("resends", 2);
+    long versions = o.num("versions", 2);
+    bool useRef = o.kv.count("no-ref") == 0;
+    long linkMbit = o.num("link-mbit", 0);
+
+    // bộ file: gốc, gửi lại nguyên file, các phiên bản sửa nhẹ
+    std::mt19937_64 rng(42);
+    std::vector<std::vector<uint8_t>> uploads;
+    std::vector<uint8_t> base;
+    auto fill = [&](uint8_t *p, size_t n) {
+        for (size_t i = 0; i < n; i += 8)
+        {
+            uint64_t r = rng();
+            memcpy(p + i, &r, std::min<size_t>(8, n - i));
+        }
+    };
+    for (long f = 0; f < files; f++)
+    {
+        base.resize(fileBytes);
+        fill(base.data(), base.size());
+        for (long r = 0; r <= resends; r++)
+            uploads.push_back(base);
+        for (long v = 0; v < versions; v++)
+        {
+            fill(base.data() + rng() % (base.size() - 4096), 4096);
+            size_t old = base.size();
+            base.resize(old + 256 * 1024);
+            fill(base.data() + old, 256 * 1024);
+            uploads.push_back(base);
+        }
+    }
+    uint64_t logical = 0;
+    for (auto &u : uploads)
+        logical += u.size();
+
+    int rx = open_session(host, port, "drx", "dedup_bench", KEYED_LOGIN);
+    int tx = open_session(host, port, "dtx", "dedup_bench_tx");
+    if (rx < 0 || tx < 0)
+    {
+        std::cerr << "Cannot open sessions\n";
+        return 1;
+    }
+
+    // người nhận: đếm byte dữ liệu (bỏ 8 byte offset) và số file xong
+    std::atomic<uint64_t> rxBytes{0};
+    std::atomic<long> rxFiles{0};
+    std::thread rxReader([&] {
+        PacketHeader h{};
+        std::vector<uint8_t> payload;
+        while (rxFiles < (long)uploads.size() && recv_packet(rx, h, payload))
+        {
+            if (h.msgType != MSG_FILE_DATA)
+                continue;
+            if (h.flags & FLAG_LAST)
+                rxFiles++;
+            else if (payload.size() > 8)
+                rxBytes += payload.size() - 8;
+        }
+    });
+
+    DedupAcks acks;
+    std::thread ackReader([&] {
+        PacketHeader h{};
+        std::vector<uint8_t> payload;
+        while (recv_packet(tx, h, payload))
+        {
+            std::string text(payload.begin(), payload.end());
+            if (h.msgType == MSG_ERROR)
+                std::cerr << "Server error: " << text << "\n";
+            if (h.msgType != MSG_ACK && h.msgType != MSG_ERROR)
+                continue;
+            std::lock_guard<std::mutex> lk(acks.mu);
+            if (h.msgType == MSG_ACK && text.rfind("acked=", 0) == 0)
+                acks.acked[h.messageId] = std::stol(text.substr(6));
+            else if (!acks.text.count(h.messageId))
+                acks.text[h.messageId] = h.msgType == MSG_ERROR ? "!" + text : text;
+            acks.cv.notify_all();
+        }
+    });
+
+    auto st0 = fetch_stats(host, port);
+    auto t0 = Clock::now();
+    long long wire = 0;
+    bool ok = true;
+    for (size_t i = 0; i < uploads.size() && ok; i++)
+    {
+        long long w = dedup_upload(tx, acks, 8000 + 2 * (uint32_t)i, "dedup_" + std::to_string(i) + ".bin",
+                                   uploads[i], useRef, linkMbit);
+        ok = w >= 0;
+        wire += w;
+    }
+    auto t1 = Clock::now();
+    for (int i = 0; i < 500 && rxFiles < (long)uploads.size(); i++)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    // đợi thread ghi đĩa xử lý hết (block được hash + lưu ở đó)
+    auto st1 = fetch_stats(host, port);
+    for (int i = 0; i < 600 && st1["persist_queue_depth"] > 0; i++)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        st1 = fetch_stats(host, port);
+    }
+
+    double sec = std::chrono::duration<double>(t1 - t0).count();
+    long storeDelta = st1["store_bytes"] - st0["store_bytes"];
+    long archived = st1["file_bytes_archived"] - st0["file_bytes_archived"];
+    long stored = st1["store_logical_bytes"] != st0["store_logical_bytes"] ? storeDelta : archived;
+    std::cout << "mode=dedup uploads=" << uploads.size() << " ref=" << (useRef ? 1 : 0) << " link_mbit=" << linkMbit
+              << " logical_mb=" << (logical >> 20)
+              << " wire_mb=" << (wire >> 20) << " stored_mb=" << (stored >> 20)
+              << " dedup_ratio=" << (stored ? (double)logical / stored : 0.0)
+              << " elapsed_ms=" << (long)(sec * 1000) << " mb_per_sec=" << (long)((logical >> 20) / sec)
+              << " delivered=" << rxFiles << "/" << uploads.size()
+              << " delivered_ok=" << (rxBytes == logical ? 1 : 0);
+    for (const char *k : {"file_ref_bytes", "store_dup_blocks", "persist_errors", "cpu_us"})
+        std::cout << " server_" << k << "=" << st1[k] - st0[k];
+    std::cout << "\n";
+
+    shutdown(tx, SHUT_RDWR); // đánh thức các thread đang đợi recv
+    shutdown(rx, SHUT_RDWR);
+    ackReader.join();
+    rxReader.join();
+    close(tx);
+    close(rx);
+    return ok && rxBytes == logical ? 0 : 1;
+}
+
+/* ================= FETCH ================= */
+// 1 file được gửi lên topic (server lưu vào upload/), sau đó K người vào sau
+// cùng lúc xin lại file qua /sys/fetch_file.
+// --readers K : số người xin cùng lúc
+// --mb M      : kích thước file (MB)
+// --rounds R  : số lượt xin của mỗi người (lượt sau đọc từ page cache)
+// So fetch_bytes (byte gửi bằng sendfile) với fetch_read_bytes (byte server
+// đọc vào bộ nhớ) và bytes_copied để thấy dữ liệu không bị copy theo từng người.
+int bench_fetch(const Options &o)
+{
+    std::string host = o.str("host", "127.0.0.1");
+    int port = (int)o.num("port", DEFAULT_PORT);
+    long readers = o.num("readers", 16);
+    uint64_t size = (uint64_t)o.num("mb", 64) << 20;
+    long rounds = o.num("rounds", 1);
+
+    std::vector<uint8_t> data(size);
+    std::mt19937_64 rng(7);
+    for (size_t i = 0; i < data.size(); i += 8)
+    {
+        uint64_t r = rng();
+        memcpy(data.data() + i, &r, std::min<size_t>(8, data.size() - i));
+    }
+
+    // gửi file lên (cần ít nhất 1 subscriber đang online)
+    int rx = open_session(host, port, "drx", "dedup_bench", KEYED_LOGIN);
+    int tx = open_session(host, port, "dtx", "dedup_bench_tx");
+    if (rx < 0 || tx < 0)
+    {
+        std::cerr << "Cannot open sessions\n";
+        return 1;
+    }
+    std::thread rxReader([&] {
+        PacketHeader h{};
+        std::vector<uint8_t> payload;
+        while (recv_packet(rx, h, payload))
+            if (h.msgType == MSG_FILE_DATA && (h.flags & FLAG_LAST))
+                break;
+    });
+    DedupAcks acks;
+    std::thread ackReader([&] {
+        PacketHeader h{};
+        std::vector<uint8_t> payload;
+        while (recv_packet(tx, h, payload))
+        {
+            std::string text(payload.begin(), payload.end());
+            if (h.msgType != MSG_ACK && h.msgType != MSG_ERROR)
+                continue;
+            std::lock_guard<std::mutex> lk(acks.mu);
+            if (h.msgType == MSG_ACK && text.rfind("acked=", 0) == 0)
+                acks.acked[h.messageId] = std::stol(text.substr(6));
+            else if (!acks.text.count(h.messageId))
+                acks.text[h.messageId] = h.msgType == MSG_ERROR ? "!" + text : text;
+            acks.cv.notify_all();
+        }
+    });
+    bool ok = dedup_upload(tx, acks, 9000, "fetch.bin", data, false, 0) >= 0;
+    rxReader.join();
+    auto st0 = fetch_stats(host, port);
+    for (int i = 0; i < 600 && st0["persist_queue_depth"] > 0; i++)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        st0 = fetch_stats(host, port);
+    }
+    if (!ok)
+    {
+        std::cerr << "Upload failed\n";
+        return 1;
+    }
+
+    // người vào sau: subscribe topic rồi xin file, kiểm tra từng byte
+    std::vector<int> fds;
+    for (long i = 0; i < readers; i++)
+    {
+        int fd = open_session(host, port, "fch" + std::to_string(i), "dedup_bench");
+        if (fd < 0)
+        {
+            std::cerr << "Cannot open reader " << i << "\n";
+            return 1;
+        }
+        fds.push_back(fd);
+    }
+    std::atomic<long> good{0};
+    std::vector<std::thread> threads;
+    auto t0 = Clock::now();
+    for (long i = 0; i < readers; i++)
+        threads.emplace_back([&, i] {
+            const std::string user = "fch" + std::to_string(i);
+            const std::string req = "topic=dedup_bench;name=fetch.bin";
+            PacketHeader h{};
+            std::vector<uint8_t> payload;
+            for (long r = 0; r < rounds; r++)
+            {
+                if (!send_packet(fds[i], MSG_PUBLISH_TEXT, user, "/sys/fetch_file", 0, req.data(), req.size(), 100 + r))
+                    return;
+                uint64_t got = 0;
+                bool same = true;
+                while (recv_packet(fds[i], h, payload))
+                {
+                    if (h.msgType == MSG_ERROR)
+                    {
+                        std::cerr << "Server error: " << std::string(payload.begin(), payload.end()) << "\n";
+                        return;
+                    }
+                    if (h.msgType != MSG_FILE_DATA || payload.size() < 8)
+                        continue;
+                    if (h.flags & FLAG_LAST)
+                        break;
+                    uint64_t off;
+                    memcpy(&off, payload.data(), 8);
+                    size_t n = payload.size() - 8;
+                    same = same && off + n <= size && memcmp(data.data() + off, payload.data() + 8, n) == 0;
+                    got += n;
+                }
+                if (got == size && same)
+                    good++;
+            }
+        });
+    for (auto &t : threads)
+        t.join();
+    auto t1 = Clock::now();
+    auto st1 = fetch_stats(host, port);
+
+    double sec = std::chrono::duration<double>(t1 - t0).count();
+    double mb = (double)size / (1 << 20) * readers * rounds;
+    std::cout << "mode=fetch readers=" << readers << " rounds=" << rounds << " mb=" << (size >> 20)
+              << " elapsed_ms=" << (long)(sec * 1000) << " delivered_mb_per_sec=" << (long)(mb / sec)
+              << " ok=" << good << "/" << readers * rounds;
+    for (const char *k : {"fetches", "fetch_bytes", "fetch_read_bytes", "bytes_copied", "cpu_us"})
+        std::cout << " server_" << k << "=" << st1[k] - st0[k];
+    std::cout << "\n";
+
+    shutdown(tx, SHUT_RDWR);
+    ackReader.join();
+    close(tx);
+    close(rx);
+    for (int fd : fds)
+        close(fd);
+    return good == readers * rounds ? 0 : 1;
+}
+
+/* ================= STRIPE ================= */
+// 1 file lớn gửi tới 1 người nhận, người gửi dùng K connection phụ
+// (MSG_FILE_JOIN "transfer=") và người nhận dùng R connection phụ ("rx=<mã>"
+// lấy từ ACK login).
+// Mọi connection đi qua proxy trong bench: mỗi chiều giữ dữ liệu --delay-ms
+// rồi mới chuyển tiếp và chỉ giữ tối đa --conn-kb byte đang bay, giống 1
+// luồng TCP có cửa sổ giới hạn trên đường truyền có độ trễ (tốc độ 1
+// connection <= conn-kb / RTT). Máy có tc netem thì chạy --delay-ms 0 và
+// đặt độ trễ trên loopback bằng tc.
+// --stripes K : 0 = chỉ connection chính (như cũ), 1/2/4/8 = số connection phụ
+// --rx R      : số connection phụ của người nhận (mặc định = K)
+// --mb M      : kích thước file (MB)
+// --delay-ms D: độ trễ mỗi chiều (RTT = 2D)
+// --conn-kb C : số byte tối đa đang bay trên mỗi chiều của 1 connection
+struct DelayPipe
+{
+    int from, to;
+    long delayMs;
+    size_t cap;
+    std::mutex mu{};
+    std::condition_variable cv{};
+    std::deque<std::pair<Clock::time_point, std::vector<uint8_t>>> q{};
+    size_t queued = 0;
+    bool eof = false;
+
+    void read_loop()
+    {
+        std::vector<uint8_t> buf(64 * 1024);
+        for (;;)
+        {
+            {
+                std::unique_lock<std::mutex> lk(mu);
+                cv.wait(lk, [&] { return queued < cap; });
+            }
+            ssize_t n = recv(from, buf.data(), std::min(buf.size(), cap), 0);
+            std::lock_guard<std::mutex> lk(mu);
+            if (n <= 0)
+            {
+                eof = true;
+                cv.notify_all();
+                return;
+            }
+            q.emplace_back(Clock::now() + std::chrono::milliseconds(delayMs),
+                           std::vector<uint8_t>(buf.begin(), buf.begin() + n));
+            queued += n;
+            cv.notify_all();
+        }
+    }
+
+    void write_loop()
+    {
+        for (;;)
+        {
+            std::unique_lock<std::mutex> lk(mu);
+            cv.wait(lk, [&] { return eof || !q.empty(); });
+            if (q.empty())
+                break;
+            auto due = q.front().first;
+            lk.unlock();
+            std::this_thread::sleep_until(due);
+            lk.lock();
+            std::vector<uint8_t> chunk = std::move(q.front().second);
+            q.pop_front();
+            lk.unlock();
+            bool ok = send_all(to, chunk.data(), chunk.size());
+            lk.lock();
+            queued -= chunk.size();
+            cv.notify_all();
+            if (!ok)
+                break;
+        }
+        shutdown(to, SHUT_WR);
+        shutdown(from, SHUT_RD); // bên kia đóng: dừng cả read_loop
+    }
+};
+
+struct DelayProxy
+{
+    std::string host;
+    int port = 0, listenFd = -1, localPort = 0;
+    long delayMs;
+    size_t cap;
+    std::thread acceptor;
+    std::mutex mu;
+    std::vector<std::unique_ptr<DelayPipe>> pipes;
+    std::vector<std::thread> threads;
+    std::vector<int> fds;
+
+    bool start()
+    {
+        listenFd = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t len = sizeof(addr);
+        if (bind(listenFd, (sockaddr *)&addr, sizeof(addr)) != 0 || listen(listenFd, 64) != 0 ||
+            getsockname(listenFd, (sockaddr *)&addr, &len) != 0)
+            return false;
+        localPort = ntohs(addr.sin_port);
+        acceptor = std::thread([this] {
+            for (;;)
+            {
+                int a = accept(listenFd, nullptr, nullptr);
+                if (a < 0)
+                    return;
+                int b = tcp_connect(host, port);
+                if (b < 0)
+                {
+                    close(a);
+                    continue;
+                }
+                int on = 1;
+                setsockopt(a, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+                std::lock_guard<std::mutex> lk(mu);
+                fds.push_back(a);
+                fds.push_back(b);
+                for (auto [from, to] : {std::make_pair(a, b), std::make_pair(b, a)})
+                {
+                    pipes.emplace_back(new DelayPipe{from, to, delayMs, cap});
+                    DelayPipe *p = pipes.back().get();
+                    threads.emplace_back([p] { p->read_loop(); });
+                    threads.emplace_back([p] { p->write_loop(); });
+                }
+            }
+        });
+        return true;
+    }
+
+    void stop()
+    {
+        shutdown(listenFd, SHUT_RDWR);
+        acceptor.join();
+        close(listenFd);
+        for (int fd : fds)
+            shutdown(fd, SHUT_RDWR);
+        for (auto &t : threads)
+            t.join();
+        for (int fd : fds)
+            close(fd);
+    }
+};
+
+int bench_stripe(const Options &o)
+{
+    std::string host = o.str("host", "127.0.0.1");
+    int port = (int)o.num("port", DEFAULT_PORT);
+    long stripes = o.num("stripes", 4);
+    long rxStripes = o.num("rx", stripes);
+    uint64_t size = (uint64_t)o.num("mb", 64) << 20;
+    long delayMs = o.num("delay-ms", 25);
+
+    DelayProxy proxy;
+    proxy.host = host;
+    proxy.port = port;
+    proxy.delayMs = delayMs;
+    proxy.cap = (size_t)o.num("conn-kb", 1024) * 1024;
+    if (delayMs > 0)
+    {
+        if (!proxy.start())
+        {
+            std::cerr << "Cannot start delay proxy\n";
+            return 1;
+        }
+        host = "127.0.0.1";
+        port = proxy.localPort;
+    }
+
+    std::vector<uint8_t> data(size);
+    std::mt19937_64 rng(11);
+    for (size_t i = 0; i < data.size(); i += 8)
+    {
+        uint64_t r = rng();
+        memcpy(data.data() + i, &r, std::min<size_t>(8, data.size() - i));
+    }
+
+    const char *user = "stx", *topic = "stripe_bench";
+    std::string rxAgreed;
+    int rx = open_session(host, port, "srx", topic, KEYED_LOGIN, &rxAgreed);
+    int tx = open_session(host, port, user, "stripe_bench_tx");
+    if (rx < 0 || tx < 0)
+    {
+        std::cerr << "Cannot open sessions\n";
+        return 1;
+    }
+
+    // người nhận: connection chính + R connection phụ, đếm và so từng byte
+    std::vector<int> rxFds{rx};
+    std::string rxJoin = "rx=" + opt_of(rxAgreed, "rx");
+    for (long i = 0; i < rxStripes; i++)
+    {
+        int fd = tcp_connect(host, port);
+        if (fd < 0 || !send_packet(fd, MSG_FILE_JOIN, "srx", "", 0, rxJoin.data(), rxJoin.size(), 1) ||
+            !wait_for(fd, MSG_ACK))
+        {
+            std::cerr << "Cannot open rx stripe " << i << "\n";
+            return 1;
+        }
+        rxFds.push_back(fd);
+    }
+    std::atomic<uint64_t> got{0};
+    std::atomic<bool> same{true};
+    std::mutex doneMu;
+    std::condition_variable doneCv;
+    std::vector<std::thread> readers;
+    for (int fd : rxFds)
+        readers.emplace_back([&, fd] {
+            PacketHeader h{};
+            std::vector<uint8_t> payload;
+            while (recv_packet(fd, h, payload))
+            {
+                if (h.msgType != MSG_FILE_DATA || (h.flags & FLAG_LAST) || payload.size() < 8)
+                    continue;
+                uint64_t off;
+                memcpy(&off, payload.data(), 8);
+                size_t n = payload.size() - 8;
+                if (off + n > size || memcmp(data.data() + off, payload.data() + 8, n) != 0)
+                    same = false;
+                if (got.fetch_add(n) + n >= size)
+                {
+                    std::lock_guard<std::mutex> lk(doneMu);
+                    doneCv.notify_all();
+                }
+            }
+        });
+
+    DedupAcks acks;
+    std::thread ackReader([&] {
+        PacketHeader h{};
+        std::vector<uint8_t> payload;
+        while (recv_packet(tx, h, payload))
+        {
+            std::string text(payload.begin(), payload.end());
+            if (h.msgType != MSG_ACK && h.msgType != MSG_ERROR)
+                continue;
+            std::lock_guard<std::mutex> lk(acks.mu);
+            if (h.msgType == MSG_ACK && text.rfind("acked=", 0) == 0)
+                acks.acked[h.messageId] = std::stol(text.substr(6));
+            else if (!acks.text.count(h.messageId) || text.rfind("hash=", 0) == 0)
+                acks.text[h.messageId] = h.msgType == MSG_ERROR ? "!" + text : text; // "hash=": kết quả sau LAST
+            acks.cv.notify_all();
+        }
+    });
+
+    auto st0 = fetch_stats(o.str("host", "127.0.0.1"), (int)o.num("port", DEFAULT_PORT));
+    auto t0 = Clock::now();
+    const uint32_t msgId = 9000;
+    std::string name = "stripe" + std::to_string(t0.time_since_epoch().count()) + ".bin";
+    std::string req = name + '\0' + "chunk=262144;window=64;key=" + name + ";size=" + std::to_string(size) +
+                      (stripes ? ";stripes=" + std::to_string(stripes) : "") + ";hash=xxh64";
+    send_packet(tx, MSG_PUBLISH_FILE, user, topic, FLAG_GROUP, req.data(), req.size(), msgId);
+    std::string agreed = acks.wait_text(msgId);
+    if (agreed.empty() || agreed[0] == '!')
+    {
+        std::cerr << "Server rejected file: " << agreed << "\n";
+        return 1;
+    }
+    uint64_t chunk = std::stoull(opt_of(agreed, "chunk"));
+    long window = std::stol(opt_of(agreed, "window"));
+    std::string transfer = opt_of(agreed, "transfer");
+
+    // connection gửi: connection chính hoặc K connection phụ
+    std::vector<int> txFds;
+    for (long i = 0; i < stripes && !transfer.empty(); i++)
+    {
+        std::string join = "transfer=" + transfer;
+        int fd = tcp_connect(host, port);
+        if (fd < 0 || !send_packet(fd, MSG_FILE_JOIN, user, "", 0, join.data(), join.size(), msgId) ||
+            !wait_for(fd, MSG_ACK))
+        {
+            std::cerr << "Cannot open tx stripe " << i << "\n";
+            return 1;
+        }
+        txFds.push_back(fd);
+    }
+    if (txFds.empty())
+        txFds.push_back(tx);
+
+    // connection k gửi đoạn hash k, k+K, ... và tính hash từng đoạn trong lúc gửi
+    long sent = 0; // khóa bằng acks.mu
+    FileHash fh;
+    fh.reset(size);
+    std::vector<std::thread> senders;
+    for (size_t k = 0; k < txFds.size(); k++)
+        senders.emplace_back([&, k] {
+            std::vector<uint8_t> buf(8 + chunk);
+            for (uint64_t j = k; j * FILE_HASH_LEAF < size; j += txFds.size())
+            {
+                uint64_t end = std::min<uint64_t>((j + 1) * FILE_HASH_LEAF, size);
+                Xxh64 leaf;
+                xxh64_init(leaf);
+                for (uint64_t off = j * FILE_HASH_LEAF; off < end; off += chunk)
+                {
+                    {
+                        std::unique_lock<std::mutex> lk(acks.mu);
+                        acks.cv.wait(lk, [&] { return sent - acks.acked[msgId] < window; });
+                        sent++;
+                    }
+                    uint64_t n = std::min<uint64_t>(chunk, end - off);
+                    memcpy(buf.data(), &off, 8);
+                    memcpy(buf.data() + 8, data.data() + off, n);
+                    xxh64_update(leaf, buf.data() + 8, n);
+                    if (!send_packet(txFds[k], MSG_FILE_DATA, user, topic, FLAG_GROUP, buf.data(), 8 + n, msgId))
+                        return;
+                }
+                fh.leaves[j] = xxh64_digest(leaf);
+                fh.done[j] = 1;
+            }
+        });
+    for (auto &t : senders)
+        t.join();
+    // gửi song song: LAST đi trên connection chính, đợi server ACK đủ chunk
+    if (txFds[0] != tx)
+    {
+        std::unique_lock<std::mutex> lk(acks.mu);
+        acks.cv.wait_for(lk, std::chrono::seconds(60), [&] { return acks.acked[msgId] >= sent; });
+    }
+    // LAST: offset cuối + hash cả file
+    std::vector<uint8_t> tail((uint8_t *)&size, (uint8_t *)&size + 8), trailer = fh.trailer();
+    tail.insert(tail.end(), trailer.begin(), trailer.end());
+    send_packet(tx, MSG_FILE_DATA, user, topic, FLAG_GROUP | FLAG_LAST, tail.data(), tail.size(), msgId);
+    bool done;
+    {
+        std::unique_lock<std::mutex> lk(doneMu);
+        done = doneCv.wait_for(lk, std::chrono::seconds(120), [&] { return got >= size; });
+    }
+    auto t1 = Clock::now();
+    std::string verdict;
+    {
+        std::unique_lock<std::mutex> lk(acks.mu);
+        acks.cv.wait_for(lk, std::chrono::seconds(10), [&] { return acks.text[msgId].rfind("hash=", 0) == 0; });
+        verdict = acks.text[msgId];
+    }
+    auto st1 = fetch_stats(o.str("host", "127.0.0.1"), (int)o.num("port", DEFAULT_PORT));
+
+    double sec = std::chrono::duration<double>(t1 - t0).count();
+    bool ok = done && same && got == size && verdict == "hash=ok";
+    std::cout << "mode=stripe stripes=" << stripes << " rx=" << rxStripes << " mb=" << (size >> 20)
+              << " delay_ms=" << delayMs << " conn_kb=" << proxy.cap / 1024 << " elapsed_ms=" << (long)(sec * 1000)
+              << " mb_per_sec=" << (long)((double)size / (1 << 20) / sec) << " ok=" << (ok ? 1 : 0);
+    for (const char *k : {"file_stripe_joins", "file_striped", "file_credit_stalls", "file_hash_ok", "file_hash_bad",
+                          "persist_errors"})
+        std::cout << " server_" << k << "=" << st1[k] - st0[k];
+    std::cout << "\n";
+
+    for (int fd : txFds)
+        if (fd != tx)
+            close(fd);
+    for (int fd : rxFds)
+        shutdown(fd, SHUT_RDWR);
+    shutdown(tx, SHUT_RDWR);
+    for (auto &t : readers)
+        t.join();
+    ackReader.join();
+    for (int fd : rxFds)
+        close(fd);
+    close(tx);
+    if (delayMs > 0)
+        proxy.stop();
+    return ok ? 0 : 1;
+}
+
+/* ================= COMPRESS ================= */
+// 1 người gửi, --subs người nhận trên cùng topic, chạy 2 lượt: không nén và
+// nén (mọi connection login "compress=lz", người gửi nén trước khi gửi).
+// 3 loại dữ liệu (--kind chat|doc|random|all):
+// - chat  : --messages tin nhắn text 20-400 byte
+// - doc   : file --mb MB giống tài liệu (chữ lặp lại), chunk 256 KB
+// - random: file --mb MB ngẫu nhiên (không nén được, server phải bỏ qua nhanh)
+// In byte payload gốc, byte nhận được trên dây (header + payload), % tiết kiệm
+// và thời gian nén/giải nén ở server (compress_us, decompress_us) lẫn client.
+static uint64_t elapsed_us(Clock::time_point t0)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - t0).count();
+}
+
+static std::string chat_line(std::mt19937_64 &rng)
+{
+    static const char *words[] = {"chao", "ban", "minh", "di", "hoc", "lap", "trinh", "mang", "server", "client",
+                                  "topic", "file", "gui", "nhan", "tin", "nhan", "hom", "nay", "bai", "tap",
+                                  "socket", "mongoose", "nhe", "ok", "roi", "chua", "xong", "deadline", "tuan", "sau"};
+    std::string s;
+    size_t len = 20 + rng() % 380;
+    while (s.size() < len)
+        s += std::string(words[rng() % 30]) + (rng() % 8 ? " " : ". ");
+    return s.substr(0, len);
+}
+
+// Gửi packet, z: nén payload nếu nhỏ đi (như client)
+static bool send_packet_z(int fd, bool z, uint32_t type, const std::string &sender, const std::string &topic,
+                          uint8_t flags, const void *payload, size_t len, uint32_t msgId, uint64_t &us)
+{
+    static thread_local std::vector<uint8_t> buf;
+    if (z && len >= COMPRESS_MIN)
+    {
+        auto t0 = Clock::now();
+        buf.resize(len);
+        size_t n = compress_payload(payload, len, buf.data());
+        us += elapsed_us(t0);
+        if (n)
+            return send_packet(fd, type, sender, topic, flags | FLAG_COMPRESSED, buf.data(), n, msgId);
+    }
+    return send_packet(fd, type, sender, topic, flags, payload, len, msgId);
+}
+
+int bench_compress(const Options &o)
+{
+    std::string host = o.str("host", "127.0.0.1");
+    int port = (int)o.num("port", DEFAULT_PORT);
+    long subs = o.num("subs", 8);
+    long messages = o.num("messages", 20000);
+    uint64_t size = (uint64_t)o.num("mb", 32) << 20;
+    std::string kindOpt = o.str("kind", "all");
+
+    std::mt19937_64 rng(5);
+    std::vector<std::string> chat;
+    for (long i = 0; i < messages; i++)
+        chat.push_back(chat_line(rng));
+    std::vector<uint8_t> doc, noise(size);
+    while (doc.size() < size)
+    {
+        std::string l = chat_line(rng) + "\n";
+        doc.insert(doc.end(), l.begin(), l.end());
+    }
+    doc.resize(size);
+    for (size_t i = 0; i < noise.size(); i += 8)
+    {
+        uint64_t r = rng();
+        memcpy(noise.data() + i, &r, std::min<size_t>(8, noise.size() - i));
+    }
+
+    int rc = 0;
+    for (std::string kind : {"chat", "doc", "random"})
+    {
+        if (kindOpt != "all" && kindOpt != kind)
+            continue;
+        for (bool z : {false, true})
+        {
+            std::string topic = "zb_" + kind + (z ? "_1" : "_0");
+            char login[16];
+            snprintf(login, sizeof(login), "caps=%x", CAP_KEYED_FILES | (z ? CAP_COMPRESS : 0));
+            // kết nối, login (xin nén), subscribe
+            auto open = [&](const std::string &user, const std::string &t) {
+                int fd = tcp_connect(host, port);
+                if (fd < 0 || !send_packet(fd, MSG_LOGIN, user, "", 0, login, strlen(login), 1) ||
+                    !wait_for(fd, MSG_ACK) || !send_packet(fd, MSG_SUBSCRIBE, user, t, 0, nullptr, 0, 2) ||
+                    !wait_for(fd, MSG_ACK))
+                    return -1;
+                return fd;
+            };
+            int pub = open("zpub", topic); // chỉ subscriber mới được publish vào topic
+            std::vector<int> fds;
+            for (long i = 0; i < subs; i++)
+                fds.push_back(open("zsub" + std::to_string(i), topic));
+            if (pub < 0 || std::count(fds.begin(), fds.end(), -1))
+            {
+                std::cerr << "Cannot open sessions\n";
+                return 1;
+            }
+
+            bool isChat = kind == "chat";
+            const std::vector<uint8_t> &file = kind == "doc" ? doc : noise;
+            uint64_t rawTotal = 0;
+            for (auto &m : chat)
+                rawTotal += m.size();
+            if (!isChat)
+                rawTotal = size;
+
+            // người nhận: đếm byte trên dây, giải nén, đếm byte gốc
+            std::atomic<uint64_t> wire{0}, decompUs{0};
+            std::atomic<long> good{0};
+            std::vector<std::thread> readers;
+            for (int fd : fds)
+                readers.emplace_back([&, fd] {
+                    PacketHeader h{};
+                    std::vector<uint8_t> payload, raw;
+                    uint64_t got = 0, w = 0, us = 0;
+                    long texts = 0;
+                    while (recv_packet(fd, h, payload))
+                    {
+                        w += sizeof(h) + payload.size();
+                        const std::vector<uint8_t> *pl = &payload;
+                        if (h.flags & FLAG_COMPRESSED)
+                        {
+                            auto t0 = Clock::now();
+                            raw.resize(compressed_raw_size(payload.data(), payload.size()));
+                            if (!decompress_payload(payload.data(), payload.size(), raw.data(), raw.size()))
+                                break;
+                            us += elapsed_us(t0);
+                            pl = &raw;
+                        }
+                        if (isChat && h.msgType == MSG_PUBLISH_TEXT)
+                        {
+                            got += pl->size();
+                            if (++texts == messages)
+                                break;
+                        }
+                        if (!isChat && h.msgType == MSG_FILE_DATA && !(h.flags & FLAG_LAST) && pl->size() > 8)
+                        {
+                            uint64_t off;
+                            memcpy(&off, pl->data(), 8);
+                            if (off + pl->size() - 8 <= size && memcmp(file.data() + off, pl->data() + 8, pl->size() - 8) == 0)
+                                got += pl->size() - 8;
+                            if (got >= size)
+                                break;
+                        }
+                    }
+                    wire += w;
+                    decompUs += us;
+                    if (got == rawTotal)
+                        good++;
+                });
+
+            DedupAcks acks;
+            std::thread ackReader([&] {
+                PacketHeader h{};
+                std::vector<uint8_t> payload;
+                while (recv_packet(pub, h, payload))
+                {
+                    std::string text(payload.begin(), payload.end());
+                    if (h.msgType != MSG_ACK && h.msgType != MSG_ERROR)
+                        continue;
+                    std::lock_guard<std::mutex> lk(acks.mu);
+                    if (h.msgType == MSG_ACK && text.rfind("acked=", 0) == 0)
+                        acks.acked[h.messageId] = std::stol(text.substr(6));
+                    else if (!acks.text.count(h.messageId))
+                        acks.text[h.messageId] = h.msgType == MSG_ERROR ? "!" + text : text;
+                    acks.cv.notify_all();
+                }
+            });
+
+            auto st0 = fetch_stats(host, port);
+            auto t0 = Clock::now();
+            uint64_t compUs = 0;
+            bool sent = true;
+            if (isChat)
+            {
+                for (auto &m : chat)
+                    sent = sent && send_packet_z(pub, z, MSG_PUBLISH_TEXT, "zpub", topic, FLAG_GROUP, m.data(), m.size(), 0, compUs);
+            }
+            else
+            {
+                const uint32_t msgId = 9000;
+                std::string name = topic + std::to_string(t0.time_since_epoch().count()) + ".bin";
+                std::string req = name + '\0' + "chunk=262144;window=16;key=" + name + ";size=" + std::to_string(size);
+                send_packet(pub, MSG_PUBLISH_FILE, "zpub", topic, FLAG_GROUP, req.data(), req.size(), msgId);
+                std::string agreed = acks.wait_text(msgId);
+                sent = !agreed.empty() && agreed[0] != '!';
+                uint64_t chunk = sent ? std::stoull(opt_of(agreed, "chunk")) : 0;
+                long window = sent ? std::stol(opt_of(agreed, "window")) : 0;
+                long n = 0;
+                std::vector<uint8_t> buf(8 + chunk);
+                for (uint64_t off = 0; sent && off < size; off += chunk, n++)
+                {
+                    {
+                        std::unique_lock<std::mutex> lk(acks.mu);
+                        acks.cv.wait(lk, [&] { return n - acks.acked[msgId] < window; });
+                    }
+                    uint64_t len = std::min<uint64_t>(chunk, size - off);
+                    memcpy(buf.data(), &off, 8);
+                    memcpy(buf.data() + 8, file.data() + off, len);
+                    sent = send_packet_z(pub, z, MSG_FILE_DATA, "zpub", topic, FLAG_GROUP, buf.data(), 8 + len, msgId, compUs);
+                }
+                send_packet(pub, MSG_FILE_DATA, "zpub", topic, FLAG_GROUP | FLAG_LAST, &size, 8, msgId);
+            }
+            for (auto &t : readers)
+                t.join();
+            auto t1 = Clock::now();
+            auto st1 = fetch_stats(host, port);
+
+            double sec = std::chrono::duration<double>(t1 - t0).count();
+            uint64_t rawWire = (rawTotal + (isChat ? messages : (size + 262143) / 262144) * (sizeof(PacketHeader) + (isChat ? 0 : 8))) * subs;
+            std::cout << "mode=compress kind=" << kind << " z=" << z << " subs=" << subs
+                      << " raw_kb=" << rawTotal * subs / 1024 << " wire_kb=" << wire / 1024
+                      << " saved_pct=" << (long)(100.0 - 100.0 * wire / rawWire) << " elapsed_ms=" << (long)(sec * 1000)
+                      << " client_compress_us=" << compUs << " client_decompress_us=" << decompUs
+                      << " ok=" << good << "/" << subs;
+            for (const char *k : {"compress_in_bytes", "compress_out_bytes", "compress_skipped", "compress_reused",
+                                  "compress_us", "decompress_us", "cpu_us"})
+                std::cout << " server_" << k << "=" << st1[k] - st0[k];
+            std::cout << "\n";
+            if (!sent || good != subs)
+                rc = 1;
+
+            shutdown(pub, SHUT_RDWR);
+            ackReader.join();
+            close(pub);
+            for (int fd : fds)
+                close(fd);
+        }
+    }
+    return rc;
+}
+
+/* ================= WIRE ================= */
+// So header v1 (PacketHeader cố định) với header v2 (varint, trường rỗng bỏ):
+// - codec: --messages message mỗi loại (chat 20-400 byte, nước đi game 4 byte,
+//   ACK không payload, chunk file 256 KB), in byte trên dây mỗi message và
+//   thời gian encode / parse (ns mỗi message, parse giống parse_packets của server)
+// - live (--live 1, mặc định): 1 người gửi, --subs người nhận login v1 hoặc
+//   "wire=2", đếm byte thật nhận được cho --messages tin nhắn chat
+static double ns_per(Clock::time_point t0, long n)
+{
+    return std::chrono::duration<double, std::nano>(Clock::now() - t0).count() / std::max(n, 1L);
+}
+
+int bench_wire(const Options &o)
+{
+    long messages = o.num("messages", 200000);
+    std::mt19937_64 rng(21);
+
+    struct Kind
+    {
+        const char *name;
+        PacketHeader h;
+        std::vector<uint8_t> payload;
+        WireIds ids{}; // v2: sender / topic gửi bằng id server cấp
+    };
+    auto make = [](uint32_t type, const char *sender, const char *topic, uint8_t flags, size_t len, uint32_t id) {
+        PacketHeader h{};
+        h.msgType = type;
+        h.payloadLength = (uint32_t)len;
+        h.messageId = id;
+        h.timestamp = (uint64_t)time(nullptr);
+        h.version = PROTOCOL_VERSION;
+        h.flags = flags;
+        strncpy(h.sender, sender, MAX_USERNAME_LEN - 1);
+        strncpy(h.topic, topic, MAX_TOPIC_LEN - 1);
+        return h;
+    };
+    std::vector<Kind> kinds;
+    std::string line = chat_line(rng);
+    kinds.push_back({"chat", make(MSG_PUBLISH_TEXT, "nguyenvana", "lop_mang_int3304", FLAG_GROUP, line.size(), 1234),
+                     std::vector<uint8_t>(line.begin(), line.end())});
+    kinds.push_back({"chat_ids", kinds[0].h, kinds[0].payload, WireIds{3, 9}});
+    kinds.push_back({"game", make(MSG_PUBLISH_TEXT, "nguyenvana", "/game/move", 0, 4, 77), std::vector<uint8_t>(4, 5)});
+    kinds.push_back({"ack", make(MSG_ACK, "", "", 0, 0, 1234), {}});
+    kinds.push_back({"file", make(MSG_FILE_DATA, "nguyenvana", "lop_mang_int3304", FLAG_GROUP, 262144 + 8, 9000),
+                     std::vector<uint8_t>(262144 + 8, 7)});
+
+    int rc = 0;
+    for (auto &k : kinds)
+    {
+        if (!k.payload.empty())
+            k.h.checksum = checksum(k.payload.data(), k.payload.size());
+        // file: ít message hơn để không tốn quá nhiều bộ nhớ
+        long n = k.payload.size() > 4096 ? std::max(messages / 1000, 10L) : messages;
+        double encNs[2], parseNs[2];
+        size_t per[2];
+        for (int v2 = 0; v2 < 2; v2++)
+        {
+            std::vector<uint8_t> buf;
+            buf.reserve((size_t)n * (WIRE_HEADER_MAX + k.payload.size()));
+            uint8_t hb[WIRE_HEADER_MAX];
+            auto t0 = Clock::now();
+            for (long i = 0; i < n; i++)
+            {
+                k.h.messageId = (uint32_t)i;
+                size_t hn = wire_encode_header(k.h, v2, hb, &k.ids);
+                buf.insert(buf.end(), hb, hb + hn);
+                buf.insert(buf.end(), k.payload.begin(), k.payload.end());
+            }
+            encNs[v2] = ns_per(t0, n);
+            per[v2] = buf.size() / n;
+
+            t0 = Clock::now();
+            size_t off = 0;
+            long parsed = 0;
+            uint64_t sum = 0;
+            PacketHeader h;
+            WireIds ids;
+            while (off < buf.size())
+            {
+                long hn = wire_decode_header(buf.data() + off, buf.size() - off, h, &ids);
+                if (hn <= 0 || buf.size() - off - hn < h.payloadLength)
+                    break;
+                sum += h.messageId + h.msgType;
+                off += hn + h.payloadLength;
+                parsed++;
+            }
+            parseNs[v2] = ns_per(t0, n);
+            if (parsed != n || sum == 0)
+                rc = 1;
+        }
+        std::cout << "mode=wire part=codec kind=" << k.name << " messages=" << n << " v1_bytes=" << per[0]
+                  << " v2_bytes=" << per[1] << " saved_pct=" << (long)(100.0 - 100.0 * per[1] / per[0])
+                  << std::fixed << std::setprecision(1) << " v1_encode_ns=" << encNs[0]
+                  << " v2_encode_ns=" << encNs[1] << " v1_parse_ns=" << parseNs[0] << " v2_parse_ns=" << parseNs[1]
+                  << std::defaultfloat << (rc ? " ok=0" : " ok=1") << "\n";
+    }
+
+    if (!o.num("live", 1))
+        return rc;
+    std::string host = o.str("host", "127.0.0.1");
+    int port = (int)o.num("port", DEFAULT_PORT);
+    long subs = o.num("subs", 4), live = o.num("live-messages", 20000);
+    std::vector<std::string> chat;
+    for (long i = 0; i < live; i++)
+        chat.push_back(chat_line(rng));
+    for (bool v2 : {false, true})
+    {
+        std::string topic = std::string("wire_") + (v2 ? "v2" : "v1");
+        std::string login = v2 ? "wire=2" : "";
+        auto open = [&](const std::string &user) {
+            int fd = tcp_connect(host, port);
+            PacketHeader h{};
+            std::vector<uint8_t> payload;
+            if (fd < 0 || !send_packet(fd, MSG_LOGIN, user, "", 0, login.data(), login.size(), 1))
+                return -1;
+            while (recv_packet(fd, h, payload) && h.msgType != MSG_ACK)
+                ;
+            if (h.msgType != MSG_ACK || (v2 && std::string(payload.begin(), payload.end()).find("wire=2") == std::string::npos) ||
+                !send_packet(fd, MSG_SUBSCRIBE, user, topic, 0, nullptr, 0, 2, v2) || !wait_for(fd, MSG_ACK))
+                return -1;
+            return fd;
+        };
+        int pub = open("wpub");
+        std::vector<int> fds;
+        for (long i = 0; i < subs; i++)
+            fds.push_back(open("wsub" + std::to_string(i)));
+        if (pub < 0 || std::count(fds.begin(), fds.end(), -1))
+        {
+            std::cerr << "Cannot open sessions (server chua bat header v2?)\n";
+            return 1;
+        }
+        std::atomic<uint64_t> wire{0};
+        std::atomic<long> good{0};
+        std::vector<std::thread> readers;
+        for (int fd : fds)
+            readers.emplace_back([&, fd] {
+                PacketHeader h{};
+                std::vector<uint8_t> payload;
+                uint8_t hb[WIRE_HEADER_MAX];
+                uint64_t w = 0;
+                long texts = 0;
+                while (texts < live && recv_packet(fd, h, payload))
+                {
+                    w += wire_encode_header(h, v2, hb) + payload.size(); // = số byte header đã đọc
+                    if (h.msgType == MSG_PUBLISH_TEXT)
+                        texts++;
+                }
+                wire += w;
+                if (texts == live)
+                    good++;
+            });
+        uint64_t raw = 0;
+        auto t0 = Clock::now();
+        for (auto &m : chat)
+        {
+            send_packet(pub, MSG_PUBLISH_TEXT, "wpub", topic, FLAG_GROUP, m.data(), m.size(), 0, v2);
+            raw += m.size();
+        }
+        for (auto &t : readers)
+            t.join();
+        double sec = std::chrono::duration<double>(Clock::now() - t0).count();
+        std::cout << "mode=wire part=live v2=" << v2 << " subs=" << subs << " messages=" << live
+                  << " payload_kb=" << raw * subs / 1024 << " wire_kb=" << wire / 1024
+                  << " bytes_per_msg=" << wire / std::max<uint64_t>(live * subs, 1)
+                  << " header_pct=" << (long)(100.0 - 100.0 * raw * subs / std::max<uint64_t>(wire, 1))
+                  << " msgs_per_sec=" << (long)(live * subs / sec) << " ok=" << good << "/" << subs << "\n";
+        if (good != subs)
+            rc = 1;
+        close(pub);
+        for (int fd : fds)
+            close(fd);
+    }
+    return rc;
+}
+
+/* ================= BATCH ================= */
+// Nhiều tin chat nhỏ: gửi mỗi tin 1 packet (1 lần send, 1 ACK) so với gộp
+// --batch tin vào 1 MSG_BUNDLE (1 lần send, 1 ACK "batch=N"). Người gửi login
+// "caps=8" và chỉ gộp khi server ACK có CAP_BUNDLE, không thì gửi từng tin. In số lần send
+// của người gửi, số ACK nhận về, số frame server nhận (packets_in) và số
+// writev của server lấy từ /sys/stats.
+
+int bench_batch(const Options &o)
+{
+    std::string host = o.str("host", "127.0.0.1");
+    int port = (int)o.num("port", DEFAULT_PORT);
+    long messages = o.num("messages", 100000), batch = std::max(o.num("batch", 32), 1L), subs = o.num("subs", 1);
+    std::mt19937_64 rng(23);
+    std::vector<std::string> chat;
+    for (long i = 0; i < messages; i++)
+        chat.push_back(chat_line(rng));
+
+    int rc = 0;
+    for (long b : {1L, batch})
+    {
+        std::string topic = "batch_" + std::to_string(b), user = "bpub" + std::to_string(b);
+        std::string agreed;
+        char caps[16];
+        snprintf(caps, sizeof(caps), "caps=%x", CAP_BUNDLE);
+        int pub = open_session(host, port, user, topic, caps, &agreed);
+        std::vector<int> fds;
+        for (long i = 0; i < subs; i++)
+            fds.push_back(open_session(host, port, "bsub" + std::to_string(b) + "_" + std::to_string(i), topic));
+        if (pub < 0 || std::count(fds.begin(), fds.end(), -1))
+        {
+            std::cerr << "Cannot open sessions\n";
+            return 1;
+        }
+        if (b > 1 && !(strtoul(opt_of(agreed, "caps").c_str(), nullptr, 16) & CAP_BUNDLE))
+        {
+            std::cerr << "Server khong ho tro MSG_BUNDLE, gui tung tin\n";
+            b = 1;
+        }
+        auto before = fetch_stats(host, port);
+
+        std::atomic<long> good{0};
+        long acks = 0, acked = 0;
+        std::vector<std::thread> readers;
+        for (int fd : fds)
+            readers.emplace_back([&, fd] {
+                PacketHeader h{};
+                std::vector<uint8_t> payload;
+                long texts = 0;
+                while (texts < messages && recv_packet(fd, h, payload))
+                    if (h.msgType == MSG_PUBLISH_TEXT)
+                        texts++;
+                if (texts == messages)
+                    good++;
+            });
+        // người gửi cũng subscribe topic: đọc cả tin của mình lẫn ACK
+        readers.emplace_back([&] {
+            PacketHeader h{};
+            std::vector<uint8_t> payload;
+            while (acked < messages && recv_packet(pub, h, payload))
+            {
+                if (h.msgType == MSG_ERROR)
+                    break;
+                if (h.msgType != MSG_ACK)
+                    continue;
+                std::string text(payload.begin(), payload.end());
+                acks++;
+                acked += text.compare(0, 6, "batch=") == 0 ? std::stol(text.substr(6)) : 1;
+            }
+        });
+
+        long sends = 0;
+        std::vector<uint8_t> body;
+        auto t0 = Clock::now();
+        for (long i = 0; i < messages; i += b)
+        {
+            long end = std::min(messages, i + b);
+            if (b == 1)
+                send_packet(pub, MSG_PUBLISH_TEXT, user, topic, FLAG_GROUP, chat[i].data(), chat[i].size(), 100 + (uint32_t)i);
+            else
+            {
+                body.clear();
+                for (long j = i; j < end; j++)
+                    append_packet(body, MSG_PUBLISH_TEXT, user, topic, FLAG_GROUP, chat[j].data(), chat[j].size(), 100 + (uint32_t)j);
+                send_packet(pub, MSG_BUNDLE, user, "", 0, body.data(), body.size(), 100 + (uint32_t)i);
+            }
+            sends++;
+        }
+        for (auto &t : readers)
+            t.join();
+        double sec = std::chrono::duration<double>(Clock::now() - t0).count();
+        auto after = fetch_stats(host, port);
+        auto delta = [&](const char *k) { return after[k] - before[k]; };
+        std::cout << "mode=batch batch=" << b << " subs=" << subs << " messages=" << messages << " sends=" << sends
+                  << " acks=" << acks << " packets_in=" << delta("packets_in") - 1 << " writev_calls=" << delta("writev_calls")
+                  << " acks_merged=" << delta("batch_acks_merged") << " msgs_per_sec=" << (long)(messages / sec)
+                  << " ok=" << good << "/" << subs << "\n";
+        if (good != subs || acked != messages)
+            rc = 1;
+        close(pub);
+        for (int fd : fds)
+            close(fd);
+    }
+    return rc;
+}
+
+/* ================= CRC ================= */
+// Đo tốc độ checksum trên bộ đệm --mb MB dữ liệu ngẫu nhiên, chia thành khối
+// 64 B, 1 KB, 64 KB và 1 MB (như payload chat / chunk file), lặp --rounds lượt:
+// - xor: checksum cũ của PacketHeader (cờ FLAG_CRC32C tắt)
+// - sw : CRC32C bảng slicing-by-8 (máy không có lệnh CRC)
+// - hw : CRC32C lệnh SSE4.2 crc32 / ARMv8 crc32c (nếu CPU có)
+// Trước khi đo kiểm tra sw và hw cho cùng kết quả (giá trị chuẩn "123456789").
+
+int bench_crc(const Options &o)
+{
+    size_t size = (size_t)std::max(o.num("mb", 64), 1L) << 20;
+    long rounds = std::max(o.num("rounds", 5), 1L);
+    bool hw = crc32c_hw_available();
+
+    std::vector<uint8_t> data(size);
+    std::mt19937_64 rng(24);
+    for (size_t i = 0; i < size; i += 8)
+    {
+        uint64_t r = rng();
+        memcpy(data.data() + i, &r, std::min<size_t>(8, size - i));
+    }
+    bool ok = crc32c_sw(0, "123456789", 9) == 0xE3069283;
+    if (hw)
+    {
+        ok = ok && crc32c_hw(0, "123456789", 9) == 0xE3069283;
+        // độ dài / vị trí lệch 8 byte bất kỳ, và tính nối tiếp từng phần
+        for (int i = 0; i < 1000 && ok; i++)
+        {
+            size_t off = rng() % 64, n = rng() % 4096;
+            ok = crc32c_sw(0, data.data() + off, n) == crc32c_hw(0, data.data() + off, n) &&
+                 crc32c_hw(crc32c_hw(0, data.data() + off, n / 3), data.data() + off + n / 3, n - n / 3) ==
+                     crc32c_sw(0, data.data() + off, n);
+        }
+    }
+    std::cout << "mode=crc hw=" << (hw ? "yes" : "no") << " check=" << (ok ? "ok" : "FAIL") << "\n";
+    if (!ok)
+        return 1;
+
+    struct Impl
+    {
+        const char *name;
+        uint32_t (*fn)(const uint8_t *, size_t);
+    };
+    std::vector<Impl> impls = {
+        {"xor", [](const uint8_t *d, size_t n) { return checksum(d, n); }},
+        {"sw", [](const uint8_t *d, size_t n) { return crc32c_sw(0, d, n); }},
+    };
+    if (hw)
+        impls.push_back({"hw", [](const uint8_t *d, size_t n) { return crc32c_hw(0, d, n); }});
+
+    for (size_t block : {(size_t)64, (size_t)1024, (size_t)65536, (size_t)1 << 20})
+    {
+        std::cout << "mode=crc block=" << block;
+        for (const Impl &im : impls)
+        {
+            volatile uint32_t sink = 0;
+            auto t0 = Clock::now();
+            for (long r = 0; r < rounds; r++)
+                for (size_t off = 0; off + block <= size; off += block)
+                    sink = sink + im.fn(data.data() + off, block);
+            double sec = std::chrono::duration<double>(Clock::now() - t0).count();
+            std::cout << " " << im.name << "_gbps=" << std::fixed << std::setprecision(2)
+                      << (double)(size / block * block) * rounds / sec / 1e9;
+        }
+        std::cout << "\n";
+    }
+    return 0;
+}
+
+/* ================= MAIN ================= */
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        std::cerr << "Usage: bench <mode> [--key value ...]\n"
+                  << "Modes: fanout, throughput, ws, storm, file, load, slow, dedup, fetch, stripe, compress, wire, batch, crc\n";
+        return 1;
+    }
+    raise_fd_limit();
+    Options o = parse_options(argc, argv);
+    std::string mode = argv[1];
+    if (mode == "fanout")
+        return bench_fanout(o);
+    if (mode == "throughput")
+        return bench_throughput(o);
+    if (mode == "ws")
+        return bench_ws(o);
+    if (mode == "storm")
+        return bench_storm(o);
+    if (mode == "file")
+        return bench_file(o);
+    if (mode == "load")
+        return bench_load(o);
+    if (mode == "slow")
+        return bench_slow(o);
+    if (mode == "dedup")
+        return bench_dedup(o);
+    if (mode == "fetch")
+        return bench_fetch(o);
+    if (mode == "stripe")
+        return bench_stripe(o);
+    if (mode == "compress")
+        return bench_compress(o);
+    if (mode == "wire")
+        return bench_wire(o);
+    if (mode == "batch")
+        return bench_batch(o);
+    if (mode == "crc")
+        return bench_crc(o);
+
+    std::cerr << "Unknown mode: " << mode << "\n";
+    return 1;
+}
@@ -11,6 +11,14 @@
 #include <ctime>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
+#include <set>
+#include <map>
+#include <array>
+#include <algorithm>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
 #include <filesystem>
 #include <cstring>
 
@@ -21,6 +29,19 @@ SOCKET sock;
 std::atomic<bool> running(true);
 uint32_t g_msgId = 1;
 std::unordered_map<uint32_t, std::string> sent_files;
+std::mutex send_mu; // main thread và recv thread cùng gửi
+
+// ACK của MSG_PUBLISH_FILE mang các tùy chọn server đồng ý ("chunk=...;chunk_max=...")
+// Sau đó server gửi ACK cộng dồn "acked=<số chunk>" theo cửa sổ credit.
+const size_t FILE_CHUNK_WANT = 256 * 1024;
+const int FILE_WINDOW_WANT = 16;
+const int FILE_STRIPES_WANT = 4; // số connection phụ gửi song song 1 file (0 = chỉ connection chính)
+const int FILE_RX_STRIPES = 2;   // số connection phụ nhận chunk file (0 = nhận trên connection chính)
+const char *SERVER_IP = "10.11.192.187";
+std::mutex file_ack_mu;
+std::condition_variable file_ack_cv;
+std::unordered_map<uint32_t, std::string> file_acks;  // msgId -> tùy chọn, chỉ cho file đang chờ
+std::unordered_map<uint32_t, uint64_t> file_credit;   // msgId -> số chunk đã được ACK
 
 /* ================= UTILS ================= */
 uint32_t checksum(const uint8_t *d, size_t n) {
@@ -30,6 +51,25 @@ uint32_t checksum(const uint8_t *d, size_t n) {
     return c;
 }
 
+// Key ổn định của file (FNV-1a của tên + kích thước + thời gian sửa) để server
+// nhận ra lần gửi lại cùng 1 file và cho gửi tiếp từ offset đã có
+std::string file_key(const std::string &name, uint64_t size, uint64_t mtime) {
+    std::string s = name + "|" + std::to_string(size) + "|" + std::to_string(mtime);
+    uint64_t h = 1469598103934665603ULL;
+    for(unsigned char ch : s) { h ^= ch; h *= 1099511628211ULL; }
+    char buf[17]; snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)h);
+    return buf;
+}
+
+// Lấy giá trị "key=..." trong chuỗi "a=1;key=...;b=2"
+std::string opt_value(const std::string &opts, const std::string &key) {
+    size_t p = (";" + opts).find(";" + key + "=");
+    if(p == std::string::npos) return "";
+    p += key.size() + 1;
+    size_t e = opts.find(';', p);
+    return opts.substr(p, e == std::string::npos ? std::string::npos : e - p);
+}
+
 /* ================= GAME STATE ================= */
 std::vector<char> board(9, ' ');
 bool inGame = false;
@@ -59,30 +99,105 @@ bool win(char p) {
 }
 
 /* ================= SOCKET HELPERS ================= */
-bool send_all(const void *d, size_t n) {
+bool send_all(const void *d, size_t n, SOCKET to = sock) {
     const char *p = (const char*)d;
     while(n) {
-        int s = send(sock, p, (int)n, 0);
+        int s = send(to, p, (int)n, 0);
         if(s <= 0) return false;
         p += s; n -= s;
     }
     return true;
 }
 
-bool recv_all(void *d, size_t n) {
+bool recv_all(void *d, size_t n, SOCKET from = sock) {
     char *p = (char*)d;
     while(n) {
-        int r = recv(sock, p, (int)n, 0);
+        int r = recv(from, p, (int)n, 0);
         if(r <= 0) return false;
         p += r; n -= r;
     }
     return true;
 }
 
+SOCKET connect_server() {
+    SOCKET s=socket(AF_INET,SOCK_STREAM,0);
+    sockaddr_in addr{}; addr.sin_family=AF_INET; addr.sin_port=htons(DEFAULT_PORT);
+    inet_pton(AF_INET,SERVER_IP,&addr.sin_addr);
+    if(connect(s,(sockaddr*)&addr,sizeof(addr))!=0) { closesocket(s); return INVALID_SOCKET; }
+    return s;
+}
+
 /* ================= PACKET ================= */
+// Khả năng client xin lúc login; server ACK "caps=<hex>" chỉ gồm các bit nó cũng có
+// (server cũ ACK rỗng: giữ mọi thứ tắt) kèm giới hạn "max=<payload>;chunk=<chunk file>"
+const uint32_t CLIENT_CAPS = CAP_COMPRESS | CAP_WIRE_V2 | CAP_CRC32C | CAP_KEYED_FILES;
+// CAP_COMPRESS: text / chunk file gửi đi được nén
+std::atomic<bool> server_compress(false);
+// CAP_WIRE_V2: gửi header v2 (ngắn hơn, server luôn đọc được cả v1)
+std::atomic<bool> server_v2(false);
+// CAP_CRC32C: checksum gửi đi là CRC32C (cờ FLAG_CRC32C) thay cho XOR
+std::atomic<bool> server_crc(false);
+// Giới hạn server báo lúc login (0 = không biết): payload lớn nhất, chunk file lớn nhất
+std::atomic<size_t> server_max_payload(0), server_chunk_max(0);
+// Header v2 gửi id thay cho tên: uid của mình (ACK login "uid=N") và id topic
+// (ACK subscribe "tid=N"). Server không thu hồi id nên giữ tới khi thoát.
+std::atomic<uint32_t> my_uid(0);
+std::string rx_code; // ACK login "rx=<mã>": connection phụ nhận file gắn vào session này (giữ file_ack_mu)
+std::mutex ids_mu;
+std::unordered_map<std::string, uint32_t> topic_ids;
+std::unordered_map<uint32_t, std::string> sub_pending; // messageId SUBSCRIBE -> topic
+
+// Nén payload text / chunk file nếu nhỏ đi đáng kể. Chunk file khó nén (ảnh,
+// file zip...) 4 lần liền thì 32 chunk sau gửi nguyên luôn.
+bool pack_payload(uint32_t type, const std::vector<uint8_t> &payload, std::vector<uint8_t> &out) {
+    if(!server_compress || payload.size() < COMPRESS_MIN || (type != MSG_PUBLISH_TEXT && type != MSG_FILE_DATA))
+        return false;
+    static thread_local int fails = 0, skip = 0;
+    bool file = type == MSG_FILE_DATA;
+    if(file && skip) { skip--; return false; }
+    out.resize(payload.size());
+    size_t n = compress_payload(payload.data(), payload.size(), out.data());
+    if(!n) {
+        if(file && ++fails >= 4) { fails = 0; skip = 32; }
+        return false;
+    }
+    if(file) fails = 0;
+    out.resize(n);
+    return true;
+}
+
+// Packet FLAG_COMPRESSED nhận được: giải nén payload về dạng gốc
+bool unpack_payload(PacketHeader &h, std::vector<uint8_t> &payload) {
+    // CRC32C tính trên payload đúng như trên đường truyền (trước khi giải nén)
+    if((h.flags & FLAG_CRC32C) && crc32c(0, payload.data(), payload.size()) != h.checksum) {
+        std::cout << "[!] Bo qua packet loi checksum CRC32C\n";
+        return false;
+    }
+    if(!(h.flags & FLAG_COMPRESSED)) return true;
+    size_t raw = compressed_raw_size(payload.data(), payload.size());
+    std::vector<uint8_t> out(raw);
+    if(!raw || !decompress_payload(payload.data(), payload.size(), out.data(), raw)) return false;
+    payload.swap(out);
+    h.flags &= ~FLAG_COMPRESSED;
+    h.payloadLength = (uint32_t)raw;
+    return true;
+}
+
+// to: connection phụ của 1 thread (không cần khóa send_mu)
 void send_packet(uint32_t type, const std::string &sender, const std::string &topic, uint8_t flags,
-                 const std::vector<uint8_t> &payload, uint32_t msgId=0)
+                 const std::vector<uint8_t> &raw, uint32_t msgId=0, SOCKET to=INVALID_SOCKET)
 {
+    std::vector<uint8_t> packed;
+    bool z = pack_payload(type, raw, packed);
+    const std::vector<uint8_t> &payload = z ? packed : raw;
+    if(z) flags |= FLAG_COMPRESSED;
+    if(server_max_payload && payload.size() > server_max_payload) {
+        std::cout << "[!] Packet qua lon (toi da " << server_max_payload << " byte), khong gui\n";
+        return;
+    }
+    bool crc = server_crc;
+    if(crc) flags |= FLAG_CRC32C;
+
     PacketHeader h{};
     h.msgType = type;
     h.payloadLength = (uint32_t)payload.size();
@@ -93,13 +208,116 @@ void send_packet(uint32_t type, const std::string &sender, const std::string &to
     strncpy(h.sender, sender.c_str(), MAX_USERNAME_LEN-1);
     strncpy(h.topic, topic.c_str(), MAX_TOPIC_LEN-1);
     if(!payload.empty())
-        h.checksum = checksum(payload.data(), payload.size());
+        h.checksum = crc ? crc32c(0, payload.data(), payload.size()) : checksum(payload.data(), payload.size());
 
-    send_all(&h, sizeof(h));
+    WireIds ids;
+    if(server_v2) {
+        ids.sender = my_uid;
+        std::lock_guard<std::mutex> lk(ids_mu);
+        if(type == MSG_SUBSCRIBE) sub_pending[h.messageId] = topic;
+        bool pub = type == MSG_PUBLISH_TEXT || type == MSG_PUBLISH_FILE || type == MSG_FILE_DATA;
+        auto it = pub && !(flags & FLAG_PRIVATE) ? topic_ids.find(topic) : topic_ids.end();
+        if(it != topic_ids.end()) ids.topic = it->second;
+    }
+    uint8_t hb[WIRE_HEADER_MAX];
+    size_t hn = wire_encode_header(h, server_v2, hb, &ids);
+    if(to != INVALID_SOCKET) {
+        send_all(hb, hn, to);
+        if(!payload.empty()) send_all(payload.data(), payload.size(), to);
+        return;
+    }
+    std::lock_guard<std::mutex> lk(send_mu);
+    send_all(hb, hn);
     if(!payload.empty())
         send_all(payload.data(), payload.size());
 }
 
+// Đọc header v1 hoặc v2: 2 byte đầu cho biết dạng và độ dài header
+bool recv_header(SOCKET from, PacketHeader &h) {
+    uint8_t buf[WIRE_HEADER_MAX];
+    if(!recv_all(buf, 2, from)) return false;
+    size_t hn = buf[0] == WIRE_V2_MAGIC ? buf[1] : sizeof(h);
+    return hn >= 2 && hn <= sizeof(buf) && recv_all(buf + 2, hn - 2, from) &&
+           wire_decode_header(buf, hn, h) == (long)hn;
+}
+
+// Đọc 1 packet từ connection phụ
+bool recv_packet(SOCKET from, PacketHeader &h, std::vector<uint8_t> &payload) {
+    if(!recv_header(from, h)) return false;
+    payload.resize(h.payloadLength);
+    return (!h.payloadLength || recv_all(payload.data(), payload.size(), from)) && unpack_payload(h, payload);
+}
+
+/* ================= USER / TOPIC LISTS ================= */
+// Danh sách lấy từ server: tải từng trang qua /sys/get_users, /sys/get_topics
+// rồi cập nhật theo thay đổi từ topic /sys/dir
+std::mutex lists_mu;
+std::set<std::string> online_users, all_topics;
+uint64_t dir_version = 0;
+std::string my_user;
+const char *DIR_PAGE_LIMIT = "200";
+
+void request_page(const std::string &topic, const std::string &cursor) {
+    std::string req = "limit=" + std::string(DIR_PAGE_LIMIT) + (cursor.empty() ? "" : ";cursor=" + cursor);
+    send_packet(MSG_PUBLISH_TEXT, my_user, topic, FLAG_GROUP, std::vector<uint8_t>(req.begin(), req.end()));
+}
+
+// Tải lại toàn bộ danh sách
+void sync_lists() {
+    { std::lock_guard<std::mutex> lk(lists_mu); online_users.clear(); all_topics.clear(); dir_version = 0; }
+    request_page("/sys/get_users", "");
+    request_page("/sys/get_topics", "");
+}
+
+// Trang trả về: "version=V;total=N;next=<cursor>\n" + mỗi dòng 1 tên
+void on_list_page(const std::string &topic, const std::string &text) {
+    size_t eol = text.find('\n');
+    if(eol == std::string::npos) return;
+    std::string head = text.substr(0, eol), next;
+    size_t p = head.find("next="); if(p != std::string::npos) next = head.substr(p + 5);
+    p = head.find("version=");
+    {
+        std::lock_guard<std::mutex> lk(lists_mu);
+        if(p != std::string::npos) dir_version = std::max<uint64_t>(dir_version, std::stoull(head.substr(p + 8)));
+        auto &dst = (topic == "/sys/user_list") ? online_users : all_topics;
+        for(size_t pos = eol + 1; pos < text.size();) {
+            size_t e = text.find('\n', pos); if(e == std::string::npos) e = text.size();
+            if(e > pos) dst.insert(text.substr(pos, e - pos));
+            pos = e + 1;
+        }
+    }
+    if(!next.empty()) request_page(topic == "/sys/user_list" ? "/sys/get_users" : "/sys/get_topics", next);
+}
+
+// Thay đổi: "V +u name" / "V -u name" / "V +t topic"
+void on_dir_delta(const std::string &text) {
+    size_t sp = text.find(' ');
+    if(sp == std::string::npos || text.size() < sp + 4) return;
+    uint64_t v = std::stoull(text.substr(0, sp));
+    bool add = text[sp + 1] == '+';
+    char kind = text[sp + 2];
+    std::string name = text.substr(sp + 4);
+    bool gap;
+    {
+        std::lock_guard<std::mutex> lk(lists_mu);
+        gap = dir_version != 0 && v > dir_version + 1; // mất thay đổi: tải lại
+        if(!gap) {
+            auto &dst = (kind == 'u') ? online_users : all_topics;
+            if(add) dst.insert(name); else dst.erase(name);
+            dir_version = std::max(dir_version, v);
+        }
+    }
+    if(gap) sync_lists();
+}
+
+void print_list(const char *title, const std::set<std::string> &items, const char *emptyText) {
+    std::lock_guard<std::mutex> lk(lists_mu);
+    std::cout << "\n=== " << title << " ===\n";
+    for(auto &s : items) std::cout << s << "\n";
+    if(items.empty()) std::cout << emptyText << "\n";
+    std::cout << "====================\n";
+}
+
 /* ================= FILE PICKER ================= */
 std::wstring pick_file() {
     OPENFILENAMEW ofn{};
@@ -114,32 +332,273 @@ std::wstring pick_file() {
 }
 
 /* ================= RECEIVE LOOP ================= */
+// File có key: 8 byte đầu mỗi chunk là offset, dữ liệu ghi vào <tên>.part và
+// tiến độ lưu ở <tên>.part.info để lần chạy sau xin server gửi tiếp.
+const uint64_t FILE_INFO_EVERY = 4 * 1024 * 1024; // ghi lại .info sau mỗi 4 MB
 struct IncomingFile {
-    std::ofstream ofs;
+    std::fstream fs;
     std::string filename;
     bool opened = false;
+    std::string key, from, target;      // rỗng key: file kiểu cũ, ghi nối tiếp
+    bool priv = false;
+    uint64_t size = 0, have = 0, saved = 0; // have: số byte liền từ đầu file đã có
+    std::map<uint64_t, uint64_t> extra;     // đoạn đã nhận nằm sau have: offset -> end
+    bool hashed = false, last = false;      // file có hash cả file / đã nhận LAST
+    FileHash hash;                          // hash tính dần theo chunk nhận được
+    std::vector<uint8_t> trailer;           // hash người gửi (payload LAST sau offset)
+    int retries = 0;                        // số lần xin gửi lại vì hash sai
 };
-std::unordered_map<uint32_t, IncomingFile> open_files;
+std::unordered_map<std::string, IncomingFile> open_files;  // "người gửi/key" hoặc "người gửi#messageId"
+std::unordered_map<std::string, std::string> file_of_msg;  // "người gửi#messageId" -> khóa trong open_files
+std::unordered_set<std::string> files_done;                // "người gửi#messageId" của file có key đã lưu xong
+
+void save_file_info(IncomingFile &f) {
+    std::ofstream info(f.filename + ".part.info", std::ios::trunc);
+    info << f.from << '\t' << f.target << '\t' << (f.priv ? 1 : 0) << '\t' << f.key << '\t'
+         << f.size << '\t' << f.have << '\n';
+    f.saved = f.have;
+}
+
+// Đọc .part.info: from, target, priv, key, size, have
+bool load_file_info(const std::string &path, IncomingFile &f) {
+    std::ifstream info(path);
+    std::string priv, size, have;
+    if(!std::getline(info, f.from, '\t') || !std::getline(info, f.target, '\t') || !std::getline(info, priv, '\t') ||
+       !std::getline(info, f.key, '\t') || !std::getline(info, size, '\t') || !std::getline(info, have))
+        return false;
+    f.priv = priv == "1"; f.size = std::stoull(size); f.have = std::stoull(have);
+    return true;
+}
+
+// Mở file có key: còn .part cùng key/kích thước thì ghi tiếp, không thì tạo mới
+void open_keyed_file(const std::string &id, const std::string &from, const PacketHeader &h,
+                     const std::string &fname, const std::string &key, uint64_t size, bool hashed) {
+    IncomingFile f, old;
+    f.filename = "client_upload/" + fname;
+    f.from = from; f.target = h.topic; f.priv = h.flags & FLAG_PRIVATE; f.key = key; f.size = size;
+    f.hashed = hashed;
+    f.hash.reset(size);
+    std::string part = f.filename + ".part";
+    if(load_file_info(part + ".info", old) && old.key == key && old.size == size && std::filesystem::exists(part)) {
+        f.have = old.have;
+        std::cout << "\n[RESUMING FILE] " << fname << " tu byte " << f.have << "\n";
+    } else {
+        std::ofstream(part, std::ios::binary | std::ios::trunc).close();
+        std::cout << "\n[RECEIVING FILE] " << fname << "\n";
+    }
+    f.fs.open(part, std::ios::binary | std::ios::in | std::ios::out);
+    f.opened = f.fs.is_open();
+    save_file_info(f);
+    open_files[id] = std::move(f);
+}
+
+// Ghi nhận đoạn [off, end) đã nhận, gộp vào have khi liền nhau
+void add_range(IncomingFile &f, uint64_t off, uint64_t end) {
+    if(end <= f.have) return;
+    if(off <= f.have) f.have = end;
+    else { uint64_t &e = f.extra[off]; e = std::max(e, end); }
+    for(auto it = f.extra.begin(); it != f.extra.end() && it->first <= f.have; it = f.extra.erase(it))
+        f.have = std::max(f.have, it->second);
+}
+
+// Tính hash đoạn [from, to) của file trên đĩa (from là đầu 1 đoạn hash):
+// phần đã có từ lần chạy trước, hoặc đoạn nhận lộn xộn không tính dần được
+void hash_from_disk(const std::filesystem::path &path, FileHash &fh, uint64_t from, uint64_t to) {
+    std::ifstream in(path, std::ios::binary);
+    std::vector<uint8_t> buf(FILE_HASH_LEAF);
+    in.seekg((std::streamoff)from);
+    while(from < to && in) {
+        size_t want = (size_t)std::min<uint64_t>(FILE_HASH_LEAF, to - from);
+        in.read((char*)buf.data(), want);
+        size_t got = (size_t)in.gcount();
+        if(!got) break;
+        fh.add(from, buf.data(), got);
+        from += got;
+    }
+}
+
+// Đủ dữ liệu + hash người gửi: so hash, sai thì xin server gửi lại từ đoạn sai
+// đầu tiên (hash sai dạng: chỉ gửi lại LAST). Trả về true nếu file đúng (hoặc
+// có đoạn không kiểm tra được).
+bool check_keyed_file(IncomingFile &f) {
+    if(!f.hashed || f.trailer.empty()) return true;
+    uint64_t unknown = UINT64_MAX;
+    uint64_t bad = f.hash.verify(f.trailer.data(), f.trailer.size(), &unknown);
+    if(bad == UINT64_MAX && unknown != UINT64_MAX) {
+        // đoạn nhận trước khi chạy lại / nhận lộn xộn: tính lại từ .part
+        f.fs.flush();
+        for(uint64_t j = unknown / FILE_HASH_LEAF; j < f.hash.leaves.size(); j++)
+            if(!f.hash.done[j])
+                hash_from_disk(f.filename + ".part", f.hash, j * FILE_HASH_LEAF,
+                               std::min<uint64_t>((j + 1) * FILE_HASH_LEAF, f.size));
+        bad = f.hash.verify(f.trailer.data(), f.trailer.size());
+    }
+    if(bad == f.size || bad == UINT64_MAX) {
+        if(bad == UINT64_MAX) std::cout << "[HASH] Khong kiem tra duoc hash " << f.filename << "\n";
+        return true;
+    }
+    // hash người gửi sai dạng: dữ liệu giữ nguyên, chỉ xin lại LAST
+    if(bad == FILE_HASH_BAD_TRAILER) {
+        std::cout << "\n[HASH] Hash cua " << f.filename << " sai dang";
+        bad = f.size;
+    } else
+        std::cout << "\n[HASH] " << f.filename << " sai tu byte " << bad;
+    if(++f.retries > 3) {
+        std::cout << ", giu lai .part\n";
+        return false;
+    }
+    std::cout << ", xin gui lai\n";
+    f.have = bad;
+    f.extra.clear();
+    f.last = false;
+    f.trailer.clear();
+    save_file_info(f);
+    std::string req = "from=" + f.from + ";key=" + f.key + ";offset=" + std::to_string(bad);
+    send_packet(MSG_FILE_RESUME, my_user, "", 0, std::vector<uint8_t>(req.begin(), req.end()));
+    return false;
+}
+
+// Chunk của file có key: ghi đúng offset, đủ kích thước (và hash khớp nếu người
+// gửi có hash) thì đổi .part thành file thật. LAST: sau offset là hash cả file.
+void on_keyed_chunk(const std::string &id, IncomingFile &f, const std::vector<uint8_t> &payload, bool last) {
+    if(payload.size() < 8) return;
+    uint64_t off; memcpy(&off, payload.data(), 8);
+    size_t n = payload.size() - 8;
+    if(last) {
+        f.last = true;
+        f.trailer.assign(payload.begin() + 8, payload.end());
+        n = 0;
+    }
+    if(n && f.opened) {
+        f.fs.seekp((std::streamoff)off);
+        f.fs.write((const char*)payload.data() + 8, n);
+    }
+    if(n && f.hashed) f.hash.add(off, payload.data() + 8, n);
+    add_range(f, off, off + n);
+    if(f.have >= f.size && (!f.hashed || f.last)) {
+        if(!check_keyed_file(f)) return;
+        f.fs.close();
+        std::filesystem::remove(f.filename + ".part.info");
+        std::error_code ec;
+        std::filesystem::rename(f.filename + ".part", f.filename, ec);
+        std::cout << "[FILE SAVED] " << f.filename << "\n";
+        open_files.erase(id);
+        return;
+    }
+    if(f.have - f.saved >= FILE_INFO_EVERY) save_file_info(f);
+}
+
+// Lúc khởi động: xin server gửi tiếp các file nhận dở lần trước
+void resume_incoming_files(const std::string &user) {
+    std::error_code ec;
+    for(auto &e : std::filesystem::directory_iterator("client_upload", ec)) {
+        std::string path = e.path().string();
+        if(path.size() < 10 || path.compare(path.size() - 10, 10, ".part.info") != 0) continue;
+        IncomingFile f;
+        if(!load_file_info(path, f)) continue;
+        if(!f.priv) send_packet(MSG_SUBSCRIBE, user, f.target, 0, {});
+        std::string req = "from=" + f.from + ";key=" + f.key + ";offset=" + std::to_string(f.have);
+        send_packet(MSG_FILE_RESUME, user, "", 0, std::vector<uint8_t>(req.begin(), req.end()));
+    }
+}
+
+// Thông báo file / chunk file, từ connection chính hoặc connection phụ nhận file
+std::mutex files_mu;
+void on_file_packet(const PacketHeader &h, const std::vector<uint8_t> &payload) {
+    std::lock_guard<std::mutex> lk(files_mu);
+    if(h.msgType == MSG_PUBLISH_FILE) {
+        // "tên file" hoặc "tên file\0key=...;size=..." (file gửi theo offset)
+        std::string raw((char*)payload.data(), payload.size());
+        size_t nul = raw.find('\0');
+        std::string fname = raw.substr(0, nul);
+        std::string msgKey = std::string(h.sender) + "#" + std::to_string(h.messageId);
+        std::string key = nul == std::string::npos ? "" : opt_value(raw.substr(nul + 1), "key");
+        if(!key.empty()) {
+            // thông báo tới muộn trên connection phụ khác sau khi file đã lưu xong
+            if(files_done.count(msgKey)) return;
+            std::string id = std::string(h.sender) + "/" + key;
+            file_of_msg[msgKey] = id;
+            if(!open_files.count(id))
+                open_keyed_file(id, h.sender, h, fname, key, std::stoull(opt_value(raw.substr(nul + 1), "size")),
+                                opt_value(raw.substr(nul + 1), "hash") == "xxh64");
+            return;
+        }
+        IncomingFile f; f.filename="client_upload/"+fname; f.fs.open(f.filename,std::ios::binary|std::ios::out|std::ios::trunc); f.opened=true;
+        open_files[msgKey]=std::move(f);
+        file_of_msg[msgKey]=msgKey;
+        std::cout << "\n[RECEIVING FILE] " << fname << "\n";
+        return;
+    }
+
+    if(h.msgType == MSG_FILE_DATA) {
+        std::string msgKey = std::string(h.sender) + "#" + std::to_string(h.messageId);
+        auto m=file_of_msg.find(msgKey);
+        if(m==file_of_msg.end()) return;
+        auto it=open_files.find(m->second);
+        if(it==open_files.end()) { file_of_msg.erase(m); return; }
+        if(!it->second.key.empty()) {
+            on_keyed_chunk(m->second, it->second, payload, h.flags & FLAG_LAST);
+            if(!open_files.count(m->second)) { files_done.insert(msgKey); file_of_msg.erase(m); }
+            return;
+        }
+        if(!payload.empty()) it->second.fs.write((char*)payload.data(), payload.size());
+        if(h.flags & FLAG_LAST) {
+            it->second.fs.close();
+            std::cout << "[FILE SAVED] " << it->second.filename << "\n";
+            open_files.erase(it);
+            file_of_msg.erase(m);
+        }
+    }
+}
+
+// Connection phụ nhận chunk file (MSG_FILE_JOIN "rx=<mã>"): server chia chunk của
+// file có key lên các connection này để chat trên connection chính không phải chờ
+void rx_stripe_loop(SOCKET s, std::string user) {
+    PacketHeader h{};
+    std::vector<uint8_t> payload;
+    char caps[16];
+    snprintf(caps, sizeof(caps), "%x", CLIENT_CAPS);
+    // connection chính có thể chưa có ACK login: chờ mã vài lần
+    std::string code;
+    for(int i = 0; i < 10 && code.empty() && running; i++) {
+        { std::lock_guard<std::mutex> lk(file_ack_mu); code = rx_code; }
+        if(code.empty()) std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    }
+    if(code.empty()) return; // server cũ: nhận trên connection chính
+    std::string req = "rx=" + code + ";caps=" + caps;
+    send_packet(MSG_FILE_JOIN, user, "", 0, std::vector<uint8_t>(req.begin(), req.end()), 0, s);
+    if(!recv_packet(s, h, payload) || h.msgType != MSG_ACK) return;
+    while(running && recv_packet(s, h, payload))
+        if(h.msgType == MSG_PUBLISH_FILE || h.msgType == MSG_FILE_DATA)
+            on_file_packet(h, payload);
+}
 
 void recv_loop() {
 std::filesystem::create_directory("client_upload");
 
     while(running) {
         PacketHeader h{};
-        if(!recv_all(&h, sizeof(h))) break;
+        if(!recv_header(sock, h)) break;
 
         std::vector<uint8_t> payload(h.payloadLength);
         if(h.payloadLength)
             recv_all(payload.data(), payload.size());
+        if(!unpack_payload(h, payload)) continue;
 
         switch(h.msgType) {
             case MSG_PUBLISH_TEXT: {
                 std::string topic = h.topic;
 
-                if(topic=="/sys/user_list") {
-                    std::cout << "\n=== USER ONLINE ===\n";
+                if(topic=="/sys/user_list" || topic=="/sys/topic_list") {
+                    on_list_page(topic, std::string((char*)payload.data(), payload.size()));
+                    break;
+                }
+                if(topic=="/sys/dir") { on_dir_delta(std::string((char*)payload.data(), payload.size())); break; }
+                // danh sách file đã lưu trên server: "name=..;from=..;size=.." mỗi dòng
+                if(topic=="/sys/fetch_file") {
+                    std::cout << "\n=== STORED FILES ===\n";
+                    if(payload.empty()) std::cout << "(No files)\n";
                     std::cout.write((char*)payload.data(), payload.size());
-                    std::cout << "\n===================\n";
                     break;
                 }
 
@@ -173,27 +632,61 @@ std::filesystem::create_directory("client_upload");
                 break;
             }
 
-            case MSG_PUBLISH_FILE: {
-                std::string fname((char*)payload.data(), payload.size());
-                IncomingFile f; f.filename="client_upload/"+fname; f.ofs.open(f.filename,std::ios::binary); f.opened=true;
-                open_files[h.messageId]=std::move(f);
-                std::cout << "\n[RECEIVING FILE] " << fname << "\n";
+            case MSG_PUBLISH_FILE:
+            case MSG_FILE_DATA:
+                on_file_packet(h, payload);
                 break;
-            }
 
-            case MSG_FILE_DATA: {
-                auto it=open_files.find(h.messageId);
-                if(it==open_files.end()) break;
-                if(!payload.empty()) it->second.ofs.write((char*)payload.data(), payload.size());
-                if(h.flags & FLAG_LAST) {
-                    it->second.ofs.close();
-                    std::cout << "[FILE SAVED] " << it->second.filename << "\n";
-                    open_files.erase(it);
+            case MSG_ACK: {
+                std::lock_guard<std::mutex> lk(file_ack_mu);
+                std::string text((char*)payload.data(), payload.size());
+                // ACK login: khả năng server đồng ý và giới hạn của server
+                if(!opt_value(text, "caps").empty()) {
+                    uint32_t caps = (uint32_t)std::stoul(opt_value(text, "caps"), nullptr, 16);
+                    server_compress = (caps & CAP_COMPRESS) != 0;
+                    server_v2 = (caps & CAP_WIRE_V2) != 0;
+                    server_crc = (caps & CAP_CRC32C) != 0;
+                    if(!opt_value(text, "max").empty()) server_max_payload = std::stoull(opt_value(text, "max"));
+                    if(!opt_value(text, "chunk").empty()) server_chunk_max = std::stoull(opt_value(text, "chunk"));
+                    if(!opt_value(text, "uid").empty()) my_uid = (uint32_t)std::stoul(opt_value(text, "uid"));
+                    rx_code = opt_value(text, "rx");
+                    break;
+                }
+                // ACK subscribe: id của topic
+                if(!opt_value(text, "tid").empty()) {
+                    std::lock_guard<std::mutex> lk2(ids_mu);
+                    auto sp = sub_pending.find(h.messageId);
+                    if(sp != sub_pending.end()) {
+                        topic_ids[sp->second] = (uint32_t)std::stoul(opt_value(text, "tid"));
+                        sub_pending.erase(sp);
+                    }
+                    break;
+                }
+                // credit ("acked=N") có thể tới lúc đang chờ ACK hash sau LAST
+                auto cr = file_credit.find(h.messageId);
+                size_t p = text.find("acked=");
+                if(p != std::string::npos) {
+                    if(cr != file_credit.end()) cr->second = std::stoull(text.substr(p + 6));
+                    file_ack_cv.notify_all();
+                    break;
+                }
+                auto it = file_acks.find(h.messageId);
+                if(it != file_acks.end() && it->second.empty()) {
+                    it->second = text.empty() ? "-" : text; // "-": server cũ, không có tùy chọn
+                    file_ack_cv.notify_all();
                 }
                 break;
             }
 
             case MSG_ERROR: {
+                {
+                    std::lock_guard<std::mutex> lk(file_ack_mu);
+                    auto it = file_acks.find(h.messageId);
+                    if(it != file_acks.end() && it->second.empty()) {
+                        it->second = "!" + std::string((char*)payload.data(), payload.size());
+                        file_ack_cv.notify_all();
+                    }
+                }
                 std::cout << "\n[ERROR] ";
                 std::cout.write((char*)payload.data(), payload.size());
                 std::cout << "\n";
@@ -205,59 +698,310 @@ std::filesystem::create_directory("client_upload");
     }
 }
 
-void send_file(const std::string &user, const std::string &target, bool priv) {
-    std::wstring path = pick_file();
-    if(path.empty()) return;
+// Hash từng block của file từ vị trí off (id block trong kho chống trùng của
+// server); tính luôn hash cả file trong cùng lượt đọc vì block gửi bằng hash
+// sẽ không được đọc lại
+std::vector<std::array<uint8_t, FILE_HASH_SIZE>> hash_blocks(HANDLE hFile, uint64_t block, FileHash *fh, uint64_t off) {
+    std::vector<std::array<uint8_t, FILE_HASH_SIZE>> out;
+    std::vector<uint8_t> buf(block);
+    DWORD read = 0;
+    while(ReadFile(hFile, buf.data(), (DWORD)block, &read, NULL) && read > 0) {
+        out.emplace_back();
+        sha256(buf.data(), read, out.back().data());
+        if(fh) fh->add(off, buf.data(), read);
+        off += read;
+    }
+    return out;
+}
+
+// Hỏi server block nào đã có (MSG_FILE_HAVE), trả về chuỗi '0'/'1' ("" nếu lỗi)
+std::string ask_have(const std::string &user, const std::vector<std::array<uint8_t, FILE_HASH_SIZE>> &hashes) {
+    const size_t BATCH = 65536; // giới hạn của server mỗi lần hỏi
+    std::string have;
+    for(size_t i = 0; i < hashes.size(); i += BATCH) {
+        size_t n = std::min(BATCH, hashes.size() - i);
+        std::vector<uint8_t> req(n * FILE_HASH_SIZE);
+        for(size_t k = 0; k < n; k++) memcpy(req.data() + k * FILE_HASH_SIZE, hashes[i + k].data(), FILE_HASH_SIZE);
+        uint32_t id = g_msgId++;
+        { std::lock_guard<std::mutex> lk(file_ack_mu); file_acks[id].clear(); }
+        send_packet(MSG_FILE_HAVE, user, "", 0, req, id);
+        std::unique_lock<std::mutex> lk(file_ack_mu);
+        file_ack_cv.wait_for(lk, std::chrono::seconds(5), [&]{ return !file_acks[id].empty(); });
+        std::string bits = file_acks[id];
+        file_acks.erase(id);
+        if(bits.size() != n) return "";
+        have += bits;
+    }
+    return have;
+}
+
+// Gửi song song: K connection phụ (MSG_FILE_JOIN "transfer=<mã>"), connection k
+// gửi đoạn hash k, k+K, ... (FILE_HASH_LEAF byte, chia thành chunk) từ đoạn chứa
+// pos, tự tính hash từng đoạn vào fh. Credit vẫn tính chung trên connection chính.
+// Trả về số chunk đã gửi, 0 nếu không mở được connection phụ nào.
+uint64_t send_file_striped(const std::wstring &path, const std::string &user, const std::string &target, bool priv,
+                           uint32_t msgId, const std::string &transfer, int stripes,
+                           uint64_t pos, uint64_t size, DWORD BUF, uint64_t window, FileHash &fh)
+{
+    std::vector<SOCKET> socks;
+    std::string req = "transfer=" + transfer;
+    for(int k = 0; k < stripes; k++) {
+        SOCKET s = connect_server();
+        if(s == INVALID_SOCKET) break;
+        PacketHeader h{};
+        std::vector<uint8_t> reply;
+        send_packet(MSG_FILE_JOIN, user, "", 0, std::vector<uint8_t>(req.begin(), req.end()), msgId, s);
+        if(!recv_packet(s, h, reply) || h.msgType != MSG_ACK) { closesocket(s); break; }
+        socks.push_back(s);
+    }
+    if(socks.empty()) return 0;
+
+    uint64_t sent = 0; // khóa bằng file_ack_mu
+    std::atomic<bool> failed(false);
+    std::vector<std::thread> workers;
+    for(size_t k = 0; k < socks.size(); k++) {
+        workers.emplace_back([&, k]{
+            HANDLE hFile = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ,
+                                       NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+            if(hFile == INVALID_HANDLE_VALUE) { failed = true; return; }
+            std::vector<uint8_t> buf(8 + BUF);
+            for(uint64_t j = pos / FILE_HASH_LEAF + k; j * FILE_HASH_LEAF < size && !failed; j += socks.size()) {
+                uint64_t end = std::min<uint64_t>((j + 1) * FILE_HASH_LEAF, size);
+                Xxh64 leaf; xxh64_init(leaf);
+                LARGE_INTEGER li; li.QuadPart = (LONGLONG)(j * FILE_HASH_LEAF);
+                SetFilePointerEx(hFile, li, NULL, FILE_BEGIN);
+                for(uint64_t off = j * FILE_HASH_LEAF; off < end; ) {
+                    {
+                        std::unique_lock<std::mutex> lk(file_ack_mu);
+                        if(window && !file_ack_cv.wait_for(lk, std::chrono::seconds(30),
+                                                           [&]{ return failed || sent - file_credit[msgId] < window; }))
+                            failed = true;
+                        if(failed) break;
+                        sent++;
+                    }
+                    DWORD want = (DWORD)std::min<uint64_t>(BUF, end - off), read = 0;
+                    if(!ReadFile(hFile, buf.data() + 8, want, &read, NULL) || read != want) { failed = true; break; }
+                    xxh64_update(leaf, buf.data() + 8, read);
+                    memcpy(buf.data(), &off, 8);
+                    buf.resize(8 + read);
+                    send_packet(MSG_FILE_DATA, user, target, priv ? FLAG_PRIVATE : FLAG_GROUP, buf, msgId, socks[k]);
+                    buf.resize(8 + BUF);
+                    off += read;
+                }
+                if(failed) break;
+                // mỗi đoạn chỉ 1 thread ghi nên không cần khóa
+                fh.leaves[j] = xxh64_digest(leaf);
+                fh.done[j] = 1;
+            }
+            CloseHandle(hFile);
+            file_ack_cv.notify_all();
+        });
+    }
+    for(auto &t : workers) t.join();
+
+    // LAST đi trên connection chính: đợi server ACK đủ chunk đã gửi trên connection phụ
+    {
+        std::unique_lock<std::mutex> lk(file_ack_mu);
+        if(failed || !file_ack_cv.wait_for(lk, std::chrono::seconds(30), [&]{ return file_credit[msgId] >= sent; }))
+            std::cout << "Gui song song bi loi, gui lai file de tiep tuc\n";
+    }
+    for(SOCKET s : socks) closesocket(s);
+    return sent;
+}
 
+// 1 lượt gửi file. Trả về false nếu server báo hash cả file sai (hoặc offset
+// lệch): gọi lại để gửi tiếp từ offset server giữ.
+bool upload_file(const std::wstring &path, const std::string &user, const std::string &target, bool priv) {
     std::string filename = std::filesystem::path(path).filename().string();
     uint32_t msgId = g_msgId++;
     sent_files[msgId] = target;
 
-    // 1. Gửi tên file
+    // key ổn định: gửi lại cùng file sau khi rớt mạng thì server cho gửi tiếp
+    std::error_code ec;
+    uint64_t size = std::filesystem::file_size(path, ec);
+    uint64_t mtime = (uint64_t)std::filesystem::last_write_time(path, ec).time_since_epoch().count();
+
+    // 1. Gửi tên file + kích thước chunk muốn dùng, đợi server trả kích thước đồng ý
+    size_t chunk = server_chunk_max ? std::min<size_t>(FILE_CHUNK_WANT, server_chunk_max) : FILE_CHUNK_WANT;
+    std::string req = filename + '\0' + "chunk=" + std::to_string(chunk) +
+                      ";window=" + std::to_string(FILE_WINDOW_WANT) +
+                      ";key=" + file_key(filename, size, mtime) + ";size=" + std::to_string(size) + ";dedup=1;hash=xxh64" +
+                      (FILE_STRIPES_WANT ? ";stripes=" + std::to_string(FILE_STRIPES_WANT) : "");
+    { std::lock_guard<std::mutex> lk(file_ack_mu); file_acks[msgId].clear(); }
     send_packet(MSG_PUBLISH_FILE, user, target, priv ? FLAG_PRIVATE : FLAG_GROUP,
-                std::vector<uint8_t>(filename.begin(), filename.end()), msgId);
+                std::vector<uint8_t>(req.begin(), req.end()), msgId);
+
+    DWORD BUF = 1024; // server không trả lời tùy chọn: dùng chunk cũ
+    uint64_t window = 0; // 0: server không cấp credit, gửi liên tục như cũ
+    bool keyed = false;  // server nhận key: chunk kèm offset
+    uint64_t pos = 0;    // offset gửi tiếp (server đã có pos byte đầu)
+    uint64_t block = 0;  // server lưu chống trùng: block server đã có chỉ gửi hash
+    std::string transfer; // server cho gửi song song trên connection phụ
+    int stripes = 0;
+    bool hashed = false;  // server kiểm tra hash cả file: LAST kèm hash
+    {
+        std::unique_lock<std::mutex> lk(file_ack_mu);
+        file_ack_cv.wait_for(lk, std::chrono::seconds(5), [&]{ return !file_acks[msgId].empty(); });
+        std::string agreed = file_acks[msgId];
+        file_acks.erase(msgId);
+        if(agreed.empty()) { std::cout << "Server khong phan hoi\n"; return true; }
+        if(agreed[0] == '!') return true; // server từ chối, lỗi đã in ở recv thread
+        size_t p = agreed.find("chunk=");
+        if(p != std::string::npos) BUF = (DWORD)std::stoul(agreed.substr(p + 6));
+        p = agreed.find("window=");
+        if(p != std::string::npos) { window = std::stoull(agreed.substr(p + 7)); file_credit[msgId] = 0; }
+        keyed = !opt_value(agreed, "key").empty();
+        if(keyed) pos = std::stoull(opt_value(agreed, "offset"));
+        if(!opt_value(agreed, "block").empty()) block = std::stoull(opt_value(agreed, "block"));
+        transfer = opt_value(agreed, "transfer");
+        if(!transfer.empty()) stripes = std::stoi(opt_value(agreed, "stripes"));
+        hashed = keyed && opt_value(agreed, "hash") == "xxh64";
+    }
+
+    if(pos) std::cout << "[RESUME] Server da co " << pos << " byte, gui tiep\n";
 
-    // 2. Gửi dữ liệu file
+    // hash cả file tính trong lúc đọc để gửi; gửi tiếp thì đọc lại phần server
+    // đã có (gửi song song: tới đầu đoạn hash chứa pos, đoạn đó gửi lại từ đầu)
+    FileHash fh;
+    fh.reset(size);
+    bool striped = keyed && stripes > 0 && pos < size;
+    if(hashed && pos)
+        hash_from_disk(path, fh, 0, striped ? pos / FILE_HASH_LEAF * FILE_HASH_LEAF : pos);
+
+    // 2a. Gửi song song (file có key, server đồng ý stripes)
+    if(striped && send_file_striped(path, user, target, priv, msgId, transfer, stripes, pos, size, BUF, window, fh))
+        pos = size;
+
+    // 2. Gửi dữ liệu file (còn lại) trên connection chính
     HANDLE hFile = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ,
                                NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
-    if(hFile == INVALID_HANDLE_VALUE) { std::cout << "Cannot open file\n"; return; }
+    if(hFile == INVALID_HANDLE_VALUE) { std::cout << "Cannot open file\n"; return true; }
+    auto seek = [&](uint64_t off) {
+        LARGE_INTEGER li; li.QuadPart = (LONGLONG)off;
+        SetFilePointerEx(hFile, li, NULL, FILE_BEGIN);
+    };
+    if(pos) seek(pos);
 
-    const DWORD BUF = 1024;
-    std::vector<uint8_t> buf(BUF);
+    // chống trùng: hash các block còn phải gửi, hỏi server block nào đã có
+    uint64_t start = pos;
+    std::vector<std::array<uint8_t, FILE_HASH_SIZE>> hashes;
+    std::string have;
+    if(block) {
+        hashes = hash_blocks(hFile, block, hashed ? &fh : nullptr, pos);
+        have = ask_have(user, hashes);
+        seek(pos);
+        size_t known = std::count(have.begin(), have.end(), '1');
+        if(known) std::cout << "[DEDUP] Server da co " << known << "/" << hashes.size() << " block\n";
+    }
+
+    // file có key: 8 byte đầu mỗi chunk là offset
+    size_t head = keyed ? 8 : 0;
+    std::vector<uint8_t> buf(head + BUF);
     DWORD read = 0;
-    while(ReadFile(hFile, buf.data(), BUF, &read, NULL) && read > 0) {
-        buf.resize(read);
+    uint64_t sent = 0;
+    for(;;) {
+        if(keyed && pos >= size) break;
+        // đợi credit: tối đa window chunk chưa được ACK
+        if(window) {
+            std::unique_lock<std::mutex> lk(file_ack_mu);
+            if(!file_ack_cv.wait_for(lk, std::chrono::seconds(30), [&]{ return sent - file_credit[msgId] < window; })) {
+                std::cout << "Server khong cap credit, dung gui file\n";
+                break;
+            }
+        }
+        // block server đã có: chỉ gửi [offset][hash]
+        size_t bi = block ? (size_t)((pos - start) / block) : 0;
+        if(bi < have.size() && have[bi] == '1') {
+            std::vector<uint8_t> ref(8 + FILE_HASH_SIZE);
+            memcpy(ref.data(), &pos, 8);
+            memcpy(ref.data() + 8, hashes[bi].data(), FILE_HASH_SIZE);
+            send_packet(MSG_FILE_REF, user, target, priv ? FLAG_PRIVATE : FLAG_GROUP, ref, msgId);
+            sent++;
+            pos = std::min<uint64_t>(start + (bi + 1) * block, size);
+            seek(pos);
+            continue;
+        }
+        // chunk không vắt qua 2 block để block sau vẫn có thể gửi bằng hash
+        DWORD want = BUF;
+        if(block) want = (DWORD)std::min<uint64_t>(BUF, start + (bi + 1) * block - pos);
+        if(!ReadFile(hFile, buf.data() + head, want, &read, NULL) || read == 0) break;
+        if(keyed) memcpy(buf.data(), &pos, 8);
+        if(hashed && !block) fh.add(pos, buf.data() + head, read);
+        buf.resize(head + read);
         send_packet(MSG_FILE_DATA, user, target, priv ? FLAG_PRIVATE : FLAG_GROUP, buf, msgId);
-        buf.resize(BUF);
+        sent++;
+        pos += read;
+        buf.resize(head + BUF);
     }
     CloseHandle(hFile);
 
-    // 3. Gửi flag LAST
-    send_packet(MSG_FILE_DATA, user, target, (priv ? FLAG_PRIVATE : FLAG_GROUP) | FLAG_LAST, {}, msgId);
+    // 3. Gửi flag LAST (file có key: kèm offset cuối, + hash cả file)
+    std::vector<uint8_t> tail;
+    if(keyed) tail.assign((uint8_t*)&pos, (uint8_t*)&pos + 8);
+    if(hashed) { std::vector<uint8_t> t = fh.trailer(); tail.insert(tail.end(), t.begin(), t.end()); }
+    if(hashed) { std::lock_guard<std::mutex> lk(file_ack_mu); file_acks[msgId].clear(); }
+    send_packet(MSG_FILE_DATA, user, target, (priv ? FLAG_PRIVATE : FLAG_GROUP) | FLAG_LAST, tail, msgId);
+    std::string verdict; // "hash=ok" / "hash=unverified" / "!lỗi"
+    if(hashed) {
+        std::unique_lock<std::mutex> lk(file_ack_mu);
+        file_ack_cv.wait_for(lk, std::chrono::seconds(30), [&]{
+            std::string &v = file_acks[msgId];
+            if(!v.empty() && v[0] != '!' && v.compare(0, 5, "hash=") != 0) v.clear(); // ACK chunk của server cũ
+            return !v.empty();
+        });
+        verdict = file_acks[msgId];
+        file_acks.erase(msgId);
+    }
+    { std::lock_guard<std::mutex> lk(file_ack_mu); file_credit.erase(msgId); }
+    if(!verdict.empty() && verdict[0] == '!')
+        return verdict.find("offset=") == std::string::npos;
 
     // 4. Gửi thông báo tới người nhận
     std::string notifyMsg = "[FILE SENT] " + filename + "\n";
     send_packet(MSG_PUBLISH_TEXT, user, target, priv ? FLAG_PRIVATE : FLAG_GROUP,
                 std::vector<uint8_t>(notifyMsg.begin(), notifyMsg.end()));
 
-    std::cout << "[FILE SENT] " << filename << "\n";
+    std::cout << "[FILE SENT] " << filename << (verdict == "hash=ok" ? " (hash OK)" : "") << "\n";
+    return true;
+}
+
+void send_file(const std::string &user, const std::string &target, bool priv) {
+    std::wstring path = pick_file();
+    if(path.empty()) return;
+    // server báo hash sai: gửi lại phần từ offset server chỉ ra
+    for(int attempt = 0; attempt < 3 && !upload_file(path, user, target, priv); attempt++)
+        std::cout << "[RESEND] Gui lai phan file bi sai\n";
 }
 
 /* ================= MAIN ================= */
 int main() {
     WSADATA wsa; WSAStartup(MAKEWORD(2,2),&wsa);
 
-    sock=socket(AF_INET,SOCK_STREAM,0);
-    sockaddr_in addr{}; addr.sin_family=AF_INET; addr.sin_port=htons(DEFAULT_PORT);
-    inet_pton(AF_INET,"10.11.192.187",&addr.sin_addr);
-
-    if(connect(sock,(sockaddr*)&addr,sizeof(addr))!=0) { std::cout<<"Connect failed\n"; return 1; }
+    sock=connect_server();
+    if(sock==INVALID_SOCKET) { std::cout<<"Connect failed\n"; return 1; }
 
     std::string user;
     std::cout<<"Username: "; std::getline(std::cin,user);
-    send_packet(MSG_LOGIN,user,"",0,{});
+    char caps[16];
+    snprintf(caps, sizeof(caps), "%x", CLIENT_CAPS);
+    std::string loginOpts = std::string("caps=") + caps; // xin nhận payload nén + header v2 + CRC32C + file có key
+    send_packet(MSG_LOGIN,user,"",0,std::vector<uint8_t>(loginOpts.begin(),loginOpts.end()));
+    my_user = user;
 
     std::thread recvThread(recv_loop);
+    // connection phụ nhận chunk file
+    std::vector<SOCKET> rxSocks;
+    std::vector<std::thread> rxThreads;
+    for(int k=0;k<FILE_RX_STRIPES;k++) {
+        SOCKET s=connect_server();
+        if(s==INVALID_SOCKET) break;
+        rxSocks.push_back(s);
+        rxThreads.emplace_back(rx_stripe_loop,s,user);
+    }
+    auto closeRx=[&]{ for(SOCKET s:rxSocks) closesocket(s); for(auto &t:rxThreads) t.join(); };
+    send_packet(MSG_SUBSCRIBE,user,"/sys/dir",0,{});
+    sync_lists();
+    resume_incoming_files(user);
 
     while(running) {
         if(inGame && myTurn) {
@@ -292,7 +1036,7 @@ int main() {
             }
 
             case 2: {
-                std::cout<<"\n=== MESSENGER MENU ===\n1: Msg\n2: PM\n3: File\n0: Back\nChoose: ";
+                std::cout<<"\n=== MESSENGER MENU ===\n1: Msg\n2: PM\n3: File\n4: Fetch\n0: Back\nChoose: ";
                 std::getline(std::cin,input); int mchoice=-1; try { mchoice=std::stoi(input); } catch(...) { std::cout<<"Invalid\n"; break; }
                 if(mchoice==0) break;
 
@@ -307,6 +1051,14 @@ int main() {
                     std::string target; std::cout<<(fchoice==1?"User: ":"Topic: "); std::getline(std::cin,target);
                     send_file(user,target,fchoice==1);
                 }
+                else if(mchoice==4) {
+                    // xin lại file đã gửi trước khi mình vào topic (tên rỗng: xem danh sách)
+                    std::string topic,name; std::cout<<"Topic (empty = private): "; std::getline(std::cin,topic);
+                    std::cout<<"File name (empty = list): "; std::getline(std::cin,name);
+                    std::string req = topic.empty() ? "private=1" : "topic=" + topic;
+                    if(!name.empty()) req += ";name=" + name;
+                    send_packet(MSG_PUBLISH_TEXT,user,"/sys/fetch_file",0,std::vector<uint8_t>(req.begin(),req.end()));
+                }
                 else std::cout<<"Invalid choice\n";
                 break;
             }
@@ -315,12 +1067,8 @@ int main() {
                 std::cout<<"\n=== LISTS MENU ===\n1: Users\n2: Topics\n0: Back\nChoose: ";
                 std::getline(std::cin,input); int lchoice=-1; try{lchoice=std::stoi(input);}catch(...){std::cout<<"Invalid\n"; break;}
                 if(lchoice==0) break;
-                if(lchoice==1) { std::ifstream ifs("online.txt"); if(!ifs){std::cout<<"Cannot open online.txt\n"; break;}
-                                 std::cout<<"\n=== USER ONLINE ===\n"; bool empty=true; for(std::string line; std::getline(ifs,line);){ std::cout<<line<<"\n"; empty=false; }
-                                 if(empty) std::cout<<"(No users online)\n"; std::cout<<"====================\n"; }
-                else if(lchoice==2) { std::ifstream ifs("topics.txt"); if(!ifs){std::cout<<"Cannot open topics.txt\n"; break;}
-                                     std::cout<<"\n=== TOPICS ===\n"; bool empty=true; for(std::string line; std::getline(ifs,line);){ std::cout<<line<<"\n"; empty=false; }
-                                     if(empty) std::cout<<"(No topics)\n"; std::cout<<"====================\n"; }
+                if(lchoice==1) print_list("USER ONLINE", online_users, "(No users online)");
+                else if(lchoice==2) print_list("TOPICS", all_topics, "(No topics)");
                 else std::cout<<"Invalid choice\n";
                 break;
             }
@@ -330,11 +1078,11 @@ int main() {
                         if(pos<0||pos>8||board[pos]!=' ') { std::cout<<"Invalid position\n"; break; }
                         board[pos]=me; draw_board(); if(win(me)){ std::cout<<"YOU WIN\n"; inGame=false; }
                         myTurn=false; send_packet(MSG_PUBLISH_TEXT,user,"/game/move",FLAG_GROUP,std::vector<uint8_t>((uint8_t*)&pos,(uint8_t*)&pos+sizeof(int))); } break;
-            case 6: send_packet(MSG_LOGOUT,user,"",0,{}); running=false; closesocket(sock); WSACleanup(); recvThread.join(); return 0;
+            case 6: send_packet(MSG_LOGOUT,user,"",0,{}); running=false; closesocket(sock); closeRx(); WSACleanup(); recvThread.join(); return 0;
             default: std::cout<<"Invalid choice\n"; break;
         }
     }
 
-    running=false; closesocket(sock); WSACleanup(); recvThread.join();
+    running=false; closesocket(sock); closeRx(); WSACleanup(); recvThread.join();
     return 0;
 }
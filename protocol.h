@@ -2,17 +2,40 @@
 #define PROTOCOL_H
 
 #include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+#include <map>
 
 #define DEFAULT_PORT 8080
 #define MAX_BUFFER_SIZE 4096
 #define MAX_TOPIC_LEN 32
 #define MAX_USERNAME_LEN 32
 #define PROTOCOL_VERSION 1
+#define PROTOCOL_VERSION_2 2
 
 #define FLAG_PRIVATE 0x01
 #define FLAG_GROUP   0x02
 #define FLAG_FILE    0x04
 #define FLAG_LAST    0x08
+#define FLAG_COMPRESSED 0x10 // payload nén LZ (chỉ khi 2 bên đồng ý lúc login): [u32 kích thước gốc][khối LZ]
+#define FLAG_CRC32C     0x20 // checksum là CRC32C của payload trên dây (không có: XOR từng byte kiểu cũ)
+
+// Khả năng thỏa thuận lúc MSG_LOGIN / MSG_FILE_JOIN: client gửi "caps=<hex>" (OR các bit
+// nó hỗ trợ), server ACK "caps=<hex>" chỉ gồm các bit cả 2 bên cùng có, kèm giới hạn
+// của server "max=<payload lớn nhất>;chunk=<chunk FILE_DATA lớn nhất>". Không gửi caps
+// thì không bật gì: client cũ login không payload vẫn nhận ACK rỗng như trước.
+#define CAP_COMPRESS 0x01 // payload nén LZ (FLAG_COMPRESSED)
+#define CAP_WIRE_V2  0x02 // header v2, kèm uid= / tid= để gửi id thay tên
+#define CAP_CRC32C   0x04 // checksum CRC32C (FLAG_CRC32C)
+#define CAP_BUNDLE   0x08 // gửi nhiều packet trong 1 MSG_BUNDLE
+#define CAP_KEYED_FILES 0x10 // nhận file có key: FILE_DATA [u64 offset][dữ liệu], LAST kèm hash
+
+#define COMPRESS_MIN 64 // payload ngắn hơn không nén
+
+#define FILE_HASH_SIZE 32 // SHA-256 của 1 block trong kho file chống trùng
+#define FILE_HASH_LEAF (1u << 20) // hash cả file: xxHash64 từng đoạn 1 MB của file
+#define FILE_HASH_BAD_TRAILER (UINT64_MAX - 1) // FileHash::verify: trailer sai dạng hoặc root không khớp
 
 enum MessageType {
     MSG_LOGIN = 1,
@@ -23,7 +46,12 @@ enum MessageType {
     MSG_PUBLISH_FILE,
     MSG_FILE_DATA,
     MSG_ERROR,
-    MSG_ACK
+    MSG_ACK,
+    MSG_FILE_RESUME,
+    MSG_FILE_HAVE,
+    MSG_FILE_REF,
+    MSG_FILE_JOIN,  // gắn connection phụ vào 1 lượt gửi file / làm connection nhận file của user
+    MSG_BUNDLE      // nhiều packet con (header + payload) nối tiếp trong 1 payload
 };
 
 #pragma pack(push, 1)
@@ -40,4 +68,589 @@ struct PacketHeader {
 };
 #pragma pack(pop)
 
+// Header v2 (2 bên đồng ý "wire=2" lúc login): độ dài thay đổi, trường rỗng không gửi.
+//   [0x82][hlen][flags][fields][varint msgType][varint payloadLength][varint messageId]
+//   [u8 len + sender | varint id] [u8 len + topic | varint id] [varint timestamp] [u32 checksum]
+// Byte đầu 0x82 = 0x80 | version: header v1 bắt đầu bằng byte thấp của msgType
+// (< 0x80) nên mỗi packet tự cho biết dạng của nó. hlen là độ dài cả header
+// để bên đọc blocking chỉ cần đọc 2 byte rồi đọc nốt phần còn lại.
+// Client gửi lên server có thể thay tên bằng id server đã cấp (uid= trong ACK
+// login, tid= trong ACK subscribe); topic của packet FLAG_PRIVATE là id user.
+#define WIRE_V2_MAGIC (0x80 | PROTOCOL_VERSION_2)
+#define V2_SENDER    0x01
+#define V2_TOPIC     0x02
+#define V2_TIME      0x04
+#define V2_CHECKSUM  0x08
+#define V2_SENDER_ID 0x10
+#define V2_TOPIC_ID  0x20
+#define V2_HEADER_MAX (4 + 3 * 5 + 2 * (1 + MAX_USERNAME_LEN) + 10 + 4)
+#define WIRE_HEADER_MAX (V2_HEADER_MAX > sizeof(PacketHeader) ? V2_HEADER_MAX : sizeof(PacketHeader))
+
+inline size_t varint_put(uint8_t *p, uint64_t v) {
+    size_t n = 0;
+    for (; v >= 0x80; v >>= 7)
+        p[n++] = (uint8_t)(v | 0x80);
+    p[n++] = (uint8_t)v;
+    return n;
+}
+
+inline bool varint_get(const uint8_t *&p, const uint8_t *end, uint64_t &v) {
+    v = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        uint8_t b = *p++;
+        v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) return true;
+    }
+    return false;
+}
+
+// Id server cấp cho sender / topic của header v2 (0 = gửi bằng tên)
+struct WireIds {
+    uint32_t sender = 0;
+    uint32_t topic = 0;
+};
+
+// Ghi header v2 vào out (ít nhất V2_HEADER_MAX byte), trả về số byte. ACK /
+// ERROR không mang timestamp; checksum chỉ gửi khi có payload. ids: thay tên
+// bằng id đã được cấp.
+inline size_t v2_encode_header(const PacketHeader &h, uint8_t *out, const WireIds *ids = nullptr) {
+    uint32_t sid = ids ? ids->sender : 0, tid = ids ? ids->topic : 0;
+    size_t sl = sid ? 0 : strnlen(h.sender, MAX_USERNAME_LEN), tl = tid ? 0 : strnlen(h.topic, MAX_TOPIC_LEN);
+    uint8_t fields = (sl ? V2_SENDER : 0) | (tl ? V2_TOPIC : 0) | (h.payloadLength ? V2_CHECKSUM : 0);
+    if (sid) fields |= V2_SENDER_ID;
+    if (tid) fields |= V2_TOPIC_ID;
+    if (h.timestamp && h.msgType != MSG_ACK && h.msgType != MSG_ERROR) fields |= V2_TIME;
+    size_t n = 4;
+    out[0] = WIRE_V2_MAGIC;
+    out[2] = h.flags;
+    out[3] = fields;
+    n += varint_put(out + n, h.msgType);
+    n += varint_put(out + n, h.payloadLength);
+    n += varint_put(out + n, h.messageId);
+    if (sl) { out[n++] = (uint8_t)sl; memcpy(out + n, h.sender, sl); n += sl; }
+    if (sid) n += varint_put(out + n, sid);
+    if (tl) { out[n++] = (uint8_t)tl; memcpy(out + n, h.topic, tl); n += tl; }
+    if (tid) n += varint_put(out + n, tid);
+    if (fields & V2_TIME) n += varint_put(out + n, h.timestamp);
+    if (fields & V2_CHECKSUM) { memcpy(out + n, &h.checksum, 4); n += 4; }
+    out[1] = (uint8_t)n;
+    return n;
+}
+
+// Header theo dạng wire của người nhận (v2 = false: PacketHeader nguyên)
+inline size_t wire_encode_header(const PacketHeader &h, bool v2, uint8_t *out, const WireIds *ids = nullptr) {
+    if (v2) return v2_encode_header(h, out, ids);
+    memcpy(out, &h, sizeof(h));
+    return sizeof(h);
+}
+
+// Chuỗi [u8 len][byte] của header v2 (dst đã xóa 0). Tên ngắn nên chép từng
+// byte: nhanh hơn gọi memcpy với độ dài thay đổi.
+inline bool v2_get_str(const uint8_t *&q, const uint8_t *end, char *dst, size_t max) {
+    if (q >= end) return false;
+    size_t n = *q++;
+    if (n > max || (size_t)(end - q) < n) return false;
+    for (size_t i = 0; i < n; i++) dst[i] = (char)q[i];
+    q += n;
+    return true;
+}
+
+// Đọc header v1 hoặc v2 ở đầu p. Trả về số byte header, 0 nếu chưa đủ byte,
+// -1 nếu header v2 hỏng. h.version cho biết packet đến ở dạng nào. Header
+// có id (chỉ server nhận) trả id trong ids, tên tương ứng để trống.
+inline long wire_decode_header(const uint8_t *p, size_t n, PacketHeader &h, WireIds *ids = nullptr) {
+    if (ids) *ids = WireIds{};
+    if (n && p[0] != WIRE_V2_MAGIC) {
+        if (n < sizeof(h)) return 0;
+        memcpy(&h, p, sizeof(h)); // header có thể không align
+        return (long)sizeof(h);
+    }
+    if (n < 2) return 0;
+    size_t hlen = p[1];
+    if (hlen < 7 || hlen > V2_HEADER_MAX) return -1;
+    if (n < hlen) return 0;
+    const uint8_t *q = p + 4, *end = p + hlen;
+    uint8_t fields = p[3];
+    uint64_t type, len, id, ts = 0, sid, tid;
+    if ((fields & (V2_SENDER_ID | V2_TOPIC_ID)) && !ids) return -1;
+    if (!varint_get(q, end, type) || !varint_get(q, end, len) || !varint_get(q, end, id) ||
+        len > UINT32_MAX || type > UINT32_MAX || id > UINT32_MAX)
+        return -1;
+    memset(&h, 0, sizeof(h));
+    h.msgType = (uint32_t)type;
+    h.payloadLength = (uint32_t)len;
+    h.messageId = (uint32_t)id;
+    h.version = PROTOCOL_VERSION_2;
+    h.flags = p[2];
+    if ((fields & V2_SENDER) && !v2_get_str(q, end, h.sender, MAX_USERNAME_LEN)) return -1;
+    if (fields & V2_SENDER_ID) {
+        if (!varint_get(q, end, sid) || !sid || sid > UINT32_MAX) return -1;
+        ids->sender = (uint32_t)sid;
+    }
+    if ((fields & V2_TOPIC) && !v2_get_str(q, end, h.topic, MAX_TOPIC_LEN)) return -1;
+    if (fields & V2_TOPIC_ID) {
+        if (!varint_get(q, end, tid) || !tid || tid > UINT32_MAX) return -1;
+        ids->topic = (uint32_t)tid;
+    }
+    if ((fields & V2_TIME) && !varint_get(q, end, ts)) return -1;
+    h.timestamp = ts;
+    if (fields & V2_CHECKSUM) {
+        if (end - q < 4) return -1;
+        memcpy(&h.checksum, q, 4);
+        q += 4;
+    }
+    return q == end ? (long)hlen : -1;
+}
+
+// SHA-256 dùng làm id block khi server lưu file chống trùng (--files dedup):
+// người gửi và server phải tính giống nhau nên để chung ở đây.
+struct Sha256 {
+    uint32_t h[8];
+    uint64_t len;
+    uint8_t buf[64];
+    size_t n;
+};
+
+inline uint32_t sha256_rotr(uint32_t x, int r) { return (x >> r) | (x << (32 - r)); }
+
+inline void sha256_block(uint32_t st[8], const uint8_t *p) {
+    static const uint32_t K[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++)
+        w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 | (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = sha256_rotr(w[i - 15], 7) ^ sha256_rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = sha256_rotr(w[i - 2], 17) ^ sha256_rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t a = st[0], b = st[1], c = st[2], d = st[3], e = st[4], f = st[5], g = st[6], h = st[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (sha256_rotr(e, 6) ^ sha256_rotr(e, 11) ^ sha256_rotr(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+        uint32_t t2 = (sha256_rotr(a, 2) ^ sha256_rotr(a, 13) ^ sha256_rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1; d = c; c = b; b = a; a = t1 + t2;
+    }
+    st[0] += a; st[1] += b; st[2] += c; st[3] += d; st[4] += e; st[5] += f; st[6] += g; st[7] += h;
+}
+
+inline void sha256_init(Sha256 &s) {
+    static const uint32_t H0[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                   0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    memcpy(s.h, H0, sizeof(H0));
+    s.len = 0;
+    s.n = 0;
+}
+
+inline void sha256_update(Sha256 &s, const void *data, size_t len) {
+    const uint8_t *p = (const uint8_t *)data;
+    s.len += len;
+    if (s.n) {
+        size_t k = len < 64 - s.n ? len : 64 - s.n;
+        memcpy(s.buf + s.n, p, k);
+        s.n += k; p += k; len -= k;
+        if (s.n < 64) return;
+        sha256_block(s.h, s.buf);
+        s.n = 0;
+    }
+    for (; len >= 64; p += 64, len -= 64)
+        sha256_block(s.h, p);
+    memcpy(s.buf, p, len);
+    s.n = len;
+}
+
+inline void sha256_final(Sha256 &s, uint8_t out[32]) {
+    uint64_t bits = s.len * 8;
+    uint8_t pad[72] = {0x80};
+    size_t padLen = (s.n < 56 ? 56 : 120) - s.n;
+    for (int i = 0; i < 8; i++)
+        pad[padLen + i] = (uint8_t)(bits >> (56 - 8 * i));
+    sha256_update(s, pad, padLen + 8);
+    for (int i = 0; i < 8; i++) {
+        out[4 * i] = (uint8_t)(s.h[i] >> 24); out[4 * i + 1] = (uint8_t)(s.h[i] >> 16);
+        out[4 * i + 2] = (uint8_t)(s.h[i] >> 8); out[4 * i + 3] = (uint8_t)s.h[i];
+    }
+}
+
+inline void sha256(const void *data, size_t len, uint8_t out[32]) {
+    Sha256 s;
+    sha256_init(s);
+    sha256_update(s, data, len);
+    sha256_final(s, out);
+}
+
+// xxHash64 (streaming) dùng cho hash cả file: nhanh hơn SHA-256 nhiều lần,
+// đủ để phát hiện file hỏng trên đường truyền / đĩa (không chống giả mạo).
+const uint64_t XXH_P1 = 11400714785074694791ULL, XXH_P2 = 14029467366897019727ULL,
+               XXH_P3 = 1609587929392839161ULL, XXH_P4 = 9650029242287828579ULL,
+               XXH_P5 = 2870177450012600261ULL;
+
+struct Xxh64 {
+    uint64_t v[4];
+    uint64_t total;
+    uint64_t seed;
+    uint8_t buf[32];
+    size_t n;
+};
+
+inline uint64_t xxh_rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+inline uint64_t xxh_read64(const uint8_t *p) { uint64_t v; memcpy(&v, p, 8); return v; }
+inline uint64_t xxh_round(uint64_t acc, uint64_t in) { return xxh_rotl(acc + in * XXH_P2, 31) * XXH_P1; }
+inline uint64_t xxh_merge(uint64_t acc, uint64_t v) { return (acc ^ xxh_round(0, v)) * XXH_P1 + XXH_P4; }
+
+inline void xxh64_init(Xxh64 &s, uint64_t seed = 0) {
+    s.v[0] = seed + XXH_P1 + XXH_P2; s.v[1] = seed + XXH_P2; s.v[2] = seed; s.v[3] = seed - XXH_P1;
+    s.total = 0; s.seed = seed; s.n = 0;
+}
+
+inline void xxh64_update(Xxh64 &s, const void *data, size_t len) {
+    const uint8_t *p = (const uint8_t *)data;
+    s.total += len;
+    if (s.n) {
+        size_t k = len < 32 - s.n ? len : 32 - s.n;
+        memcpy(s.buf + s.n, p, k);
+        s.n += k; p += k; len -= k;
+        if (s.n < 32) return;
+        for (int i = 0; i < 4; i++) s.v[i] = xxh_round(s.v[i], xxh_read64(s.buf + 8 * i));
+        s.n = 0;
+    }
+    for (; len >= 32; p += 32, len -= 32)
+        for (int i = 0; i < 4; i++) s.v[i] = xxh_round(s.v[i], xxh_read64(p + 8 * i));
+    memcpy(s.buf, p, len);
+    s.n = len;
+}
+
+inline uint64_t xxh64_digest(const Xxh64 &s) {
+    uint64_t h;
+    if (s.total >= 32) {
+        h = xxh_rotl(s.v[0], 1) + xxh_rotl(s.v[1], 7) + xxh_rotl(s.v[2], 12) + xxh_rotl(s.v[3], 18);
+        for (int i = 0; i < 4; i++) h = xxh_merge(h, s.v[i]);
+    } else
+        h = s.seed + XXH_P5;
+    h += s.total;
+    const uint8_t *p = s.buf, *end = s.buf + s.n;
+    for (; p + 8 <= end; p += 8) h = xxh_rotl(h ^ xxh_round(0, xxh_read64(p)), 27) * XXH_P1 + XXH_P4;
+    if (p + 4 <= end) {
+        uint32_t k; memcpy(&k, p, 4);
+        h = xxh_rotl(h ^ (uint64_t)k * XXH_P1, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+    }
+    for (; p < end; p++) h = xxh_rotl(h ^ *p * XXH_P5, 11) * XXH_P1;
+    h ^= h >> 33; h *= XXH_P2; h ^= h >> 29; h *= XXH_P3; h ^= h >> 32;
+    return h;
+}
+
+inline uint64_t xxh64(const void *data, size_t len, uint64_t seed = 0) {
+    Xxh64 s;
+    xxh64_init(s, seed);
+    xxh64_update(s, data, len);
+    return xxh64_digest(s);
+}
+
+// Hash cả file, tính dần theo chunk: file chia thành đoạn FILE_HASH_LEAF byte,
+// mỗi đoạn 1 xxHash64, hash file = xxHash64(mảng hash đoạn, seed = kích thước).
+// Đoạn khác nhau tính độc lập nên chunk của các đoạn tới lệch thứ tự (gửi song
+// song, gửi lại) vẫn tính được, chỉ cần trong 1 đoạn dữ liệu tới theo thứ tự.
+// LAST của file mang "[u64 hash file][u64 hash từng đoạn...]" sau offset.
+struct FileHash {
+    uint64_t size = 0;
+    std::vector<uint64_t> leaves;                        // hash đoạn đã tính xong
+    std::vector<uint8_t> done;                           // 1: leaves[i] hợp lệ
+    std::map<uint64_t, std::pair<Xxh64, uint64_t>> open; // đoạn đang tính: trạng thái + số byte đã tính
+
+    void reset(uint64_t sz) {
+        size = sz;
+        size_t n = (size_t)((sz + FILE_HASH_LEAF - 1) / FILE_HASH_LEAF);
+        leaves.assign(n, 0);
+        done.assign(n, 0);
+        open.clear();
+    }
+
+    // Dữ liệu [off, off+n). Chunk bắt đầu 1 đoạn thì tính lại đoạn đó từ đầu;
+    // chunk không nối tiếp phần đã tính thì đoạn đó coi như chưa biết.
+    void add(uint64_t off, const uint8_t *d, size_t n) {
+        while (n) {
+            uint64_t j = off / FILE_HASH_LEAF, start = j * FILE_HASH_LEAF;
+            if (j >= leaves.size()) return;
+            uint64_t end = start + FILE_HASH_LEAF < size ? start + FILE_HASH_LEAF : size;
+            size_t k = (size_t)(n < end - off ? n : end - off);
+            auto it = open.find(j);
+            if (off == start) {
+                it = open.emplace(j, std::pair<Xxh64, uint64_t>()).first;
+                xxh64_init(it->second.first);
+                it->second.second = 0;
+                done[j] = 0;
+            }
+            if (it != open.end() && start + it->second.second == off) {
+                xxh64_update(it->second.first, d, k);
+                it->second.second += k;
+                if (off + k == end) {
+                    leaves[j] = xxh64_digest(it->second.first);
+                    done[j] = 1;
+                    open.erase(it);
+                }
+            } else {
+                if (it != open.end()) open.erase(it);
+                done[j] = 0;
+            }
+            off += k; d += k; n -= k;
+        }
+    }
+
+    uint64_t root() const { return xxh64(leaves.data(), leaves.size() * 8, size); }
+
+    // Phần hash sau offset trong payload LAST
+    std::vector<uint8_t> trailer() const {
+        std::vector<uint8_t> t(8 + leaves.size() * 8);
+        uint64_t r = root();
+        memcpy(t.data(), &r, 8);
+        if (!leaves.empty()) memcpy(t.data() + 8, leaves.data(), leaves.size() * 8);
+        return t;
+    }
+
+    // So với trailer của người gửi. Trả về offset đoạn đầu tiên bị sai,
+    // size nếu khớp hết, FILE_HASH_BAD_TRAILER nếu trailer sai dạng, UINT64_MAX
+    // nếu còn đoạn chưa biết (firstUnknown: offset đoạn chưa biết đầu tiên, để
+    // tính lại từ đĩa nếu muốn).
+    uint64_t verify(const uint8_t *t, size_t n, uint64_t *firstUnknown = nullptr) const {
+        if (n != 8 + leaves.size() * 8 || xxh64(t + 8, n - 8, size) != xxh_read64(t)) return FILE_HASH_BAD_TRAILER;
+        uint64_t unknown = UINT64_MAX;
+        for (size_t j = 0; j < leaves.size(); j++) {
+            if (!done[j]) { if (unknown == UINT64_MAX) unknown = (uint64_t)j * FILE_HASH_LEAF; continue; }
+            if (leaves[j] != xxh_read64(t + 8 + 8 * j)) return (uint64_t)j * FILE_HASH_LEAF;
+        }
+        if (firstUnknown) *firstUnknown = unknown;
+        return unknown == UINT64_MAX ? size : UINT64_MAX;
+    }
+};
+
+// Nén LZ cho payload text / chunk file (định dạng khối giống LZ4): mỗi đoạn gồm
+// token (4 bit số literal, 4 bit độ dài match - 4), literal, offset 2 byte của
+// match trong 64 KB trước đó. Đoạn cuối chỉ có literal. Client và server dùng
+// chung nên để ở đây, không cần thư viện ngoài.
+inline size_t lz_put_len(uint8_t *dst, size_t op, size_t len) {
+    for (; len >= 255; len -= 255)
+        dst[op++] = 255;
+    dst[op++] = (uint8_t)len;
+    return op;
+}
+
+// Trả về số byte đã ghi, 0 nếu kết quả không vừa cap byte (dữ liệu khó nén)
+inline size_t lz_compress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap) {
+    const int HASH_BITS = 12;
+    uint32_t table[1 << HASH_BITS] = {0};
+    size_t ip = 0, anchor = 0, op = 0, misses = 0;
+    while (n >= 13 && ip < n - 12) {
+        uint32_t seq, cand;
+        memcpy(&seq, src + ip, 4);
+        uint32_t hsh = (seq * 2654435761u) >> (32 - HASH_BITS);
+        size_t ref = table[hsh];
+        table[hsh] = (uint32_t)ip;
+        memcpy(&cand, src + ref, 4);
+        if (ref >= ip || ip - ref > 65535 || cand != seq) {
+            ip += 1 + (misses++ >> 6); // càng lâu không gặp match càng nhảy xa
+            continue;
+        }
+        size_t mlen = 4;
+        while (ip + mlen < n - 5 && src[ref + mlen] == src[ip + mlen])
+            mlen++;
+        size_t lit = ip - anchor;
+        if (op + lit + lit / 255 + mlen / 255 + 5 > cap)
+            return 0;
+        size_t tok = op++;
+        dst[tok] = (uint8_t)((lit < 15 ? lit : 15) << 4);
+        if (lit >= 15)
+            op = lz_put_len(dst, op, lit - 15);
+        memcpy(dst + op, src + anchor, lit);
+        op += lit;
+        dst[op++] = (uint8_t)(ip - ref);
+        dst[op++] = (uint8_t)((ip - ref) >> 8);
+        size_t m = mlen - 4;
+        dst[tok] |= (uint8_t)(m < 15 ? m : 15);
+        if (m >= 15)
+            op = lz_put_len(dst, op, m - 15);
+        ip += mlen;
+        anchor = ip;
+        misses = 0;
+    }
+    size_t lit = n - anchor;
+    if (op + lit + lit / 255 + 2 > cap)
+        return 0;
+    dst[op++] = (uint8_t)((lit < 15 ? lit : 15) << 4);
+    if (lit >= 15)
+        op = lz_put_len(dst, op, lit - 15);
+    memcpy(dst + op, src + anchor, lit);
+    return op + lit;
+}
+
+// Giải nén đúng raw byte, dữ liệu hỏng (hoặc cố ý sai) trả về false
+inline bool lz_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t raw) {
+    size_t ip = 0, op = 0;
+    while (ip < n) {
+        uint8_t tok = src[ip++];
+        size_t lit = tok >> 4, b = 255;
+        if (lit == 15)
+            while (b == 255) {
+                if (ip >= n) return false;
+                b = src[ip++];
+                lit += b;
+            }
+        if (lit > n - ip || lit > raw - op) return false;
+        memcpy(dst + op, src + ip, lit);
+        ip += lit; op += lit;
+        if (ip == n) break;
+        if (n - ip < 2) return false;
+        size_t off = src[ip] | (size_t)src[ip + 1] << 8;
+        ip += 2;
+        size_t m = tok & 15;
+        b = 255;
+        if (m == 15)
+            while (b == 255) {
+                if (ip >= n) return false;
+                b = src[ip++];
+                m += b;
+            }
+        m += 4;
+        if (off == 0 || off > op || m > raw - op) return false;
+        uint8_t *d = dst + op;
+        const uint8_t *from = d - off;
+        if (off >= m)
+            memcpy(d, from, m);
+        else if (off >= 8) {
+            size_t i = 0;
+            for (; i + 8 <= m; i += 8) memcpy(d + i, from + i, 8);
+            for (; i < m; i++) d[i] = from[i];
+        } else
+            for (size_t i = 0; i < m; i++) d[i] = from[i];
+        op += m;
+    }
+    return op == raw;
+}
+
+// Payload FLAG_COMPRESSED: [u32 kích thước gốc][khối LZ]. dst phải có n byte;
+// trả về 0 nếu nén không nhỏ hơn ít nhất 1/8 (gửi nguyên payload)
+inline size_t compress_payload(const void *src, size_t n, uint8_t *dst) {
+    if (n < COMPRESS_MIN) return 0;
+    uint32_t raw = (uint32_t)n;
+    memcpy(dst, &raw, 4);
+    size_t z = lz_compress((const uint8_t *)src, n, dst + 4, n - n / 8 - 4);
+    return z ? z + 4 : 0;
+}
+
+// Kích thước gốc của payload nén (0 nếu không hợp lệ)
+inline size_t compressed_raw_size(const uint8_t *src, size_t n) {
+    uint32_t raw = 0;
+    if (n >= 4) memcpy(&raw, src, 4);
+    return raw;
+}
+
+inline bool decompress_payload(const uint8_t *src, size_t n, uint8_t *dst, size_t raw) {
+    return n >= 4 && compressed_raw_size(src, n) == raw && lz_decompress(src + 4, n - 4, dst, raw);
+}
+
+// CRC32C (Castagnoli, đa thức đảo 0x82F63B78) làm checksum khi có FLAG_CRC32C.
+// crc32c(0, ...) là CRC của cả đoạn; truyền kết quả trước vào để tính tiếp:
+// crc32c(crc32c(0, a), b) là CRC của a nối b. CPU có lệnh CRC32 (x86 SSE4.2,
+// ARMv8 CRC) thì dùng lệnh đó, không thì dùng bảng slicing-by-8; chọn 1 lần
+// lúc chạy. Cả 2 cách đọc 8 byte 1 lần theo little-endian.
+struct Crc32cTable {
+    uint32_t t[8][256];
+    Crc32cTable() {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) c = (c >> 1) ^ (0x82F63B78u & (0u - (c & 1)));
+            t[0][i] = c;
+        }
+        for (uint32_t i = 0; i < 256; i++)
+            for (int s = 1; s < 8; s++) t[s][i] = (t[s - 1][i] >> 8) ^ t[0][t[s - 1][i] & 0xff];
+    }
+};
+
+inline uint32_t crc32c_sw(uint32_t crc, const void *data, size_t n) {
+    static const Crc32cTable tab;
+    const uint32_t (*t)[256] = tab.t;
+    const uint8_t *p = (const uint8_t *)data;
+    uint32_t c = ~crc;
+    for (; n >= 8; n -= 8, p += 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= c;
+        c = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^ t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^
+            t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^ t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+    }
+    while (n--) c = (c >> 8) ^ t[0][(c ^ *p++) & 0xff];
+    return ~c;
+}
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include <nmmintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define CRC32C_HW_TARGET
+#else
+#define CRC32C_HW_TARGET __attribute__((target("sse4.2")))
+#endif
+CRC32C_HW_TARGET inline uint32_t crc32c_hw(uint32_t crc, const void *data, size_t n) {
+    const uint8_t *p = (const uint8_t *)data;
+    uint64_t c = ~crc;
+    for (; n >= 8; n -= 8, p += 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+    }
+    uint32_t c32 = (uint32_t)c;
+    while (n--) c32 = _mm_crc32_u8(c32, *p++);
+    return ~c32;
+}
+inline bool crc32c_hw_available() {
+#if defined(_MSC_VER) && !defined(__clang__)
+    int r[4];
+    __cpuid(r, 1);
+    return (r[2] >> 20) & 1; // SSE4.2
+#else
+    return __builtin_cpu_supports("sse4.2");
+#endif
+}
+#elif defined(__aarch64__) && defined(__GNUC__)
+#include <arm_acle.h>
+#if defined(__linux__)
+#include <sys/auxv.h>
+#endif
+__attribute__((target("arch=armv8-a+crc"))) inline uint32_t crc32c_hw(uint32_t crc, const void *data, size_t n) {
+    const uint8_t *p = (const uint8_t *)data;
+    uint32_t c = ~crc;
+    for (; n >= 8; n -= 8, p += 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = __crc32cd(c, v);
+    }
+    while (n--) c = __crc32cb(c, *p++);
+    return ~c;
+}
+inline bool crc32c_hw_available() {
+#if defined(__ARM_FEATURE_CRC32) || defined(__APPLE__)
+    return true;
+#elif defined(__linux__)
+    return (getauxval(AT_HWCAP) & (1 << 7)) != 0; // HWCAP_CRC32
+#else
+    return false;
+#endif
+}
+#else
+inline uint32_t crc32c_hw(uint32_t crc, const void *data, size_t n) { return crc32c_sw(crc, data, n); }
+inline bool crc32c_hw_available() { return false; }
+#endif
+
+inline uint32_t crc32c(uint32_t crc, const void *data, size_t n) {
+    static const bool hw = crc32c_hw_available();
+    return hw ? crc32c_hw(crc, data, n) : crc32c_sw(crc, data, n);
+}
+
 #endif
@@ -5,6 +5,7 @@
 // - Publish text/message
 // - Publish file (chunked)
 // - Forward game moves giữa 2 client
+// - Chạy nhiều event loop song song (--threads N)
 // =================================================
 
 #include "protocol.h"
@@ -15,38 +16,273 @@
 #include <unordered_set>
 #include <vector>
 #include <string>
+#include <string_view>
 #include <fstream>
+#include <cstdio>
 #include <ctime>
 #include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <chrono>
+#include <memory>
+#include <atomic>
+#include <deque>
+#include <map>
+#include <algorithm>
+#include <filesystem>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
 #pragma comment(lib, "ws2_32.lib")
 
 // ---------------- CONFIG ----------------
 #define TCP_PORT "tcp://0.0.0.0:8080"
 #define WS_PORT "http://0.0.0.0:8000"
+#define TCP_PORT_NUM 8080
+#define WS_PORT_NUM 8000
+#define MAX_PAYLOAD_SIZE (MG_MAX_RECV_SIZE - sizeof(PacketHeader))
 
 const std::string ONLINE_FILE = "online.txt";          // danh sách user online
 const std::string TOPICS_FILE = "topics.txt";          // danh sách topic
 const std::string USER_TOPIC_FILE = "user_topics.txt"; // mapping username:topic
+const std::string JOURNAL_FILE = "state.journal";      // journal thay đổi trạng thái
+const size_t JOURNAL_MIN_COMPACT = 4096;               // số record tối thiểu trước khi nén
+const int PERSIST_FLUSH_MS = 5;                        // cửa sổ gom thao tác ghi đĩa
+const size_t PERSIST_PENDING_LIMIT = 64 * 1024 * 1024; // byte chunk file chờ ghi đĩa quá số này thì giữ ACK / ngừng đọc
+const char *const DIR_TOPIC = "/sys/dir";              // topic nhận thay đổi danh sách
+const size_t DIR_PAGE_DEFAULT = 100;                   // số tên mỗi trang mặc định
+const size_t DIR_PAGE_MAX = 1000;                      // số tên mỗi trang tối đa
+const uint32_t FILE_WINDOW_DEFAULT = 16;               // cửa sổ credit mặc định (chunk)
+const uint32_t FILE_WINDOW_MAX = 256;                  // cửa sổ credit tối đa (chunk)
+const size_t FILE_WINDOW_BYTES = 16 * 1024 * 1024;     // cửa sổ credit tối đa (byte)
+const size_t FILE_PENDING_LIMIT = 8 * 1024 * 1024;     // người nhận chờ quá số byte này thì giữ ACK
+const uint32_t FILE_STRIPES_MAX = 8;                   // số connection phụ tối đa của 1 lượt gửi file
+const int FILE_CREDIT_TIMER_MS = 20;                   // chu kỳ kiểm tra lại file bị giữ ACK
+const size_t FILE_OFFSET_SIZE = 8;                     // offset đầu payload FILE_DATA của file có key
+const int FILE_MANIFEST_TTL = 3600;                    // giữ manifest file dở/xong thêm bao nhiêu giây
+const size_t FILE_BACKFILL_CHUNK = 256 * 1024;         // chunk gửi lại từ upload/ cho người nhận
+const char *const STORE_DIR = "upload/.store";         // kho block của --files dedup
+const size_t STORE_BLOCK = 256 * 1024;                 // kích thước block trong kho
+const size_t STORE_HAVE_MAX = 65536;                   // số hash tối đa mỗi MSG_FILE_HAVE
+const char *const FETCH_TOPIC = "/sys/fetch_file";     // xin lại file đã lưu
+const size_t FETCH_CHUNK = 256 * 1024;                 // chunk FILE_DATA khi gửi file đã lưu
+const size_t FETCH_STEP_BYTES = 4 * 1024 * 1024;       // mỗi lượt fetch gửi tối đa rồi nhường connection khác
+const size_t FETCH_LIST_MAX = 256;                     // số file đã lưu nhớ cho mỗi topic / user
+const size_t SENDQ_DIRECT_MAX = 64 * 1024;             // c->send lớn hơn thì packet mới đi qua hàng đợi
+const int SENDQ_RESUME_MS = 20;                        // chu kỳ kiểm tra mở lại publisher bị tạm dừng
+
+// Xử lý khi hàng đợi gửi của 1 connection vượt --sendq-max
+enum SendqPolicy
+{
+    SQ_DROP,       // bỏ các message text cũ nhất của topic
+    SQ_PAUSE,      // ngừng đọc từ publisher đang gửi tới connection nghẽn
+    SQ_SPILL,      // ghi phần vượt ra file tạm, đọc lại khi hàng đợi vơi
+    SQ_DISCONNECT, // ngắt connection nghẽn
+};
+
+// Cấu hình lấy từ command line
+struct Config
+{
+    int threads = 1;          // số event loop (shard)
+    bool fanout_copy = false; // --fanout copy: encode riêng cho từng người nhận
+    int log_level = -1;       // --log-level N: mức log của mongoose (0 = tắt), -1 = mặc định
+    bool file_relay = false;  // --files relay: chỉ chuyển tiếp file, không lưu vào upload/
+    bool file_dedup = false;  // --files dedup: lưu file theo block, mỗi block 1 bản
+    size_t chunk_max = 512 * 1024; // --chunk-max N: chunk FILE_DATA lớn nhất server chấp nhận
+    size_t sendq_max = 64 * 1024 * 1024; // --sendq-max N: byte chờ gửi tối đa mỗi connection (0 = không giới hạn)
+    SendqPolicy sendq_policy = SQ_DROP;  // --sendq-policy drop|pause|spill|disconnect
+    bool compress = true;                // --compress off: không nén payload cho client xin "compress=lz"
+    bool wire_v2 = true;                 // --wire v1: luôn gửi header v1
+};
 
 // ---------------- CLIENT STRUCT ----------------
 struct Client
 {
-    std::string username;                   // username
-    std::unordered_set<std::string> topics; // topic đã subscribe
-    bool is_ws = false;                     // true nếu client kết nối WS
+    std::string username;                // username
+    uint32_t uid = 0;                    // id của username trong g_user_ids
+    std::unordered_set<uint32_t> topics; // id các topic đã subscribe
+    std::string transfer;                // connection phụ gửi dữ liệu cho lượt gửi file này
+    std::string rx_code;                 // mã để connection phụ nhận file gắn vào connection (chính) này
+    mg_connection *rx_main = nullptr;    // connection phụ nhận chunk file thay cho connection chính này
 };
 
 // ---------------- FILE STRUCT ----------------
 struct IncomingFile
 {
-    std::ofstream ofs;  // file đang ghi
+    uint64_t file_id = 0; // id file bên thread ghi đĩa
+    bool relay = false;   // chỉ chuyển tiếp, không lưu vào upload/
+    size_t chunk = 0;     // kích thước chunk đã thỏa thuận (0 = không thỏa thuận)
+    mg_connection *src = nullptr; // connection người gửi
+    uint32_t window = 0;          // số chunk được gửi trước khi có ACK (0 = ACK từng chunk)
+    uint64_t received = 0;        // số chunk FILE_DATA đã nhận
+    uint64_t acked = 0;           // số chunk đã ACK cộng dồn
+    bool stalled = false;         // đang giữ ACK vì người nhận nghẽn
+    uint32_t msg_id = 0;          // messageId người gửi dùng cho lượt gửi này
+    std::string manifest;         // key trong g_manifests (rỗng = file không có key, chunk không có offset)
+    uint64_t offset = 0;          // byte tiếp theo server chờ nhận
+    bool dedup = false;           // lưu qua kho chống trùng, người gửi dùng được MSG_FILE_REF cho block server đã có
+    uint64_t bytes = 0;           // số byte dữ liệu đã nhận
+    uint32_t stripes = 0;         // số connection phụ người gửi dùng (0 = gửi trên connection chính)
+    std::string transfer;         // mã để connection phụ MSG_FILE_JOIN vào lượt gửi này
+    bool plain = false;           // người nhận không có CAP_KEYED_FILES nhận được (chunk theo thứ tự từ byte 0)
+    std::map<uint64_t, uint64_t> got; // gửi song song: đoạn đã nhận nằm sau offset (offset -> end)
+    std::shared_ptr<std::atomic<uint64_t>> stored; // số byte đã nằm trong upload/
     std::string sender; // người gửi
     std::string target; // username hoặc topic
+    uint32_t target_id = 0; // id của target trong g_user_ids / g_topic_ids
     bool is_private = false;
     std::string filename; // tên file gốc
 };
 
+// File gửi kèm "key=...;size=...": giữ lại sau khi người gửi rớt mạng để
+// người gửi nối lại từ offset server đã có và người nhận xin gửi lại phần thiếu
+struct FileManifest
+{
+    std::string key; // key ổn định do người gửi chọn
+    std::string sender;
+    std::string target;
+    bool is_private = false;
+    std::string filename;
+    uint64_t size = 0;       // kích thước cả file
+    uint64_t received = 0;   // số byte đầu file server đã nhận
+    std::shared_ptr<std::atomic<uint64_t>> stored; // số byte đã nằm trong upload/ (thread ghi đĩa cập nhật)
+    bool relay = false;
+    bool complete = false;
+    bool active = false;     // đang có connection gửi
+    uint32_t msg_id = 0;     // messageId của lượt gửi gần nhất
+    time_t touched = 0;      // lần cuối có thay đổi
+    bool hashed = false;     // người gửi xin "hash=xxh64": LAST mang hash cả file
+    FileHash hash;           // hash tính dần theo chunk đã nhận
+    std::string hash_trailer; // hash của người gửi (đã kiểm tra), gửi kèm LAST khi gửi lại file
+    bool dedup = false;      // lưu dạng danh sách block "<tên>.chunks" (chọn ở lần gửi đầu)
+};
+
+// Gửi lại phần đã lưu của 1 file cho người nhận (MSG_FILE_RESUME), chạy trên
+// shard của người nhận. Phần sau end người nhận nhận trực tiếp từ người gửi.
+struct Backfill
+{
+    mg_connection *c = nullptr;
+    unsigned long id = 0;
+    std::string manifest;
+    FILE *fp = nullptr; // file trong upload/ (dedup: danh sách block)
+    uint64_t off = 0; // byte tiếp theo cần gửi
+    uint64_t end = 0;
+
+    // dedup: block đang đọc trong kho
+    bool chunked = false;
+    std::string blk_hex;
+    uint64_t blk_off = 0, blk_len = 0;
+    std::vector<uint8_t> blk;
+};
+
+// 1 chunk FILE_DATA khi gửi file đã lưu, nằm gọn trong 1 file trên đĩa
+struct FetchChunk
+{
+    uint32_t seg = 0; // file chứa chunk (file thường: 0, dedup: block trong kho)
+    uint64_t off = 0; // vị trí trong file đó
+    uint64_t pos = 0; // vị trí trong file gốc (offset gửi kèm chunk)
+    uint32_t len = 0;
+};
+
+// Bảng chunk của 1 file đã lưu, các lượt fetch cùng file dùng chung
+struct OpenedFile
+{
+    std::vector<std::string> segs; // đường dẫn file thật trên đĩa
+    std::vector<FetchChunk> chunks;
+    std::unique_ptr<std::atomic<uint64_t>[]> sums; // (checksum XOR dữ liệu << 1) | 1 khi đã tính
+    std::unique_ptr<std::atomic<uint64_t>[]> crcs; // (CRC32C của offset + dữ liệu << 1) | 1 khi đã tính
+};
+
+// File đã gửi xong và lưu trong upload/, người vào sau xin lại qua /sys/fetch_file
+struct StoredUpload
+{
+    uint64_t file_id = 0; // lượt gửi cuối (phân biệt các lần ghi đè cùng tên)
+    std::string filename;
+    std::string key;      // key của người gửi (rỗng: file không có key)
+    std::string sender;
+    std::string target;
+    bool is_private = false;
+    uint64_t size = 0;
+    std::shared_ptr<std::atomic<uint64_t>> stored; // byte đã ghi xuống đĩa
+    std::shared_ptr<OpenedFile> opened;             // tạo khi có người xin đầu tiên (g_opened_mu)
+    std::string hash_trailer;                       // hash cả file, gửi kèm LAST
+    bool dedup = false;                             // lưu dạng danh sách block "<tên>.chunks"
+};
+
+// 1 lượt gửi file đã lưu cho người xin, chạy trên shard của người xin.
+// Dữ liệu đi thẳng từ page cache ra socket (sendfile), mỗi chunk gồm
+// header (WS + PacketHeader + offset) rồi tới dữ liệu.
+struct Fetch
+{
+    mg_connection *c = nullptr;
+    unsigned long id = 0;
+    std::shared_ptr<OpenedFile> file;
+    PacketHeader h{};             // header FILE_DATA (người gửi/đích của file gốc)
+    size_t next = 0;              // chunk tiếp theo
+    uint64_t size = 0;
+    std::string hash_trailer;     // hash cả file gửi kèm LAST (rỗng: file không có hash)
+    FILE *fp = nullptr;           // file chứa chunk hiện tại
+    uint32_t fp_seg = UINT32_MAX;
+
+    // chunk đang gửi dở
+    bool busy = false;
+    uint8_t head[10 + WIRE_HEADER_MAX + 8];
+    size_t head_len = 0, head_off = 0;
+    uint64_t body_off = 0, body_left = 0;
+};
+
+// ---------------- NAME TABLE ----------------
+// Username / topic được cấp id 32 bit liên tục (bắt đầu từ 1, không thu hồi)
+// để các index và đường publish chỉ so sánh số. Cấp id dưới g_mu độc quyền,
+// tra cứu dưới shared lock; tra bằng string_view nên không cấp phát.
+struct NameTable
+{
+    std::deque<std::string> names{std::string()};         // id -> tên (id 0 = không có), deque giữ nguyên địa chỉ
+    std::unordered_map<std::string_view, uint32_t> ids; // tên -> id, key trỏ vào names
+
+    NameTable(std::initializer_list<const char *> fixed = {})
+    {
+        for (const char *n : fixed)
+            intern(n);
+    }
+
+    // id của tên, 0 nếu chưa được cấp
+    uint32_t find(std::string_view name) const
+    {
+        auto it = ids.find(name);
+        return it == ids.end() ? 0 : it->second;
+    }
+
+    // id của tên, cấp id mới nếu chưa có
+    uint32_t intern(std::string_view name)
+    {
+        auto it = ids.find(name);
+        if (it != ids.end())
+            return it->second;
+        names.emplace_back(name);
+        uint32_t id = (uint32_t)names.size() - 1;
+        ids.emplace(names.back(), id);
+        return id;
+    }
+
+    const std::string &name(uint32_t id) const { return id < names.size() ? names[id] : names[0]; }
+    uint32_t size() const { return (uint32_t)names.size(); }
+};
+
+// Topic hệ thống có id cố định (thứ tự trong g_topic_ids)
+enum SysTopicId : uint32_t
+{
+    TID_GET_USERS = 1,
+    TID_GET_TOPICS,
+    TID_STATS,
+    TID_QUEUES,
+    TID_FETCH,
+    TID_DIR,
+    TID_GAME_JOIN,
+    TID_GAME_MOVE
+};
+
 // ---------------- GAME STRUCT ----------------
 struct GameRoom
 {
@@ -55,423 +291,3777 @@ struct GameRoom
     bool started = false;        // trạng thái game
 };
 
+// ---------------- FRAME STRUCT ----------------
+// Packet đã encode ở dạng wire (header + payload), bất biến sau khi tạo nên
+// nhiều connection (kể cả ở shard khác) có thể giữ chung bằng shared_ptr.
+using Frame = std::vector<uint8_t>;
+using FrameRef = std::shared_ptr<const Frame>;
+
+// Trạng thái gửi của 1 connection, con trỏ lưu trong c->data.
+// out/out_off/dirty chỉ thread của shard sở hữu connection được dùng.
+struct ConnState
+{
+    bool is_ws = false;       // true nếu client kết nối WS (ghi dưới g_mu)
+    std::deque<FrameRef> out; // frame chờ ghi ra socket, theo thứ tự
+    size_t out_off = 0;       // số byte của out.front() đã ghi
+    bool dirty = false;       // đã nằm trong danh sách flush của shard
+    size_t out_bytes = 0;     // tổng kích thước các frame trong out
+    FILE *spill = nullptr;    // file tạm chứa frame bị đẩy ra đĩa (--sendq-policy spill)
+    uint64_t spill_rd = 0;    // vị trí đọc trong spill
+    uint64_t spill_wr = 0;    // vị trí ghi trong spill
+    mg_connection *paused_by = nullptr; // connection nghẽn khiến connection này bị ngừng đọc
+    bool streaming = false;             // đang gửi dở 1 chunk của /sys/fetch_file, frame khác phải đợi
+    int fetches = 0;                    // số lượt fetch đang gửi (giữ EPOLLOUT)
+    int parked = -1;                    // fd dup đăng ký epoll thay c->fd lúc ngừng đọc (sendq_epoll_read)
+    bool compress = false;              // client nhận được payload FLAG_COMPRESSED (ghi dưới g_mu)
+    bool crc = false;                   // checksum gửi đi là CRC32C (login "crc=32c", ghi dưới g_mu)
+    bool v2 = false;                    // gửi header v2 (login "wire=2", ghi dưới g_mu)
+    uint32_t caps = 0;                  // bit CAP_* đã thỏa thuận lúc login (ghi dưới g_mu)
+    uint32_t z_fail[2] = {0, 0};        // số payload (text, chunk file) liền nhau từ connection này nén không được
+    uint32_t z_skip[2] = {0, 0};        // số payload tiếp theo cùng loại gửi nguyên, không thử nén
+    std::atomic<size_t> pending{0};     // byte chờ gửi (c->send + out + spill), shard khác đọc được
+    std::atomic<size_t> peak{0};        // pending lớn nhất từng có
+    std::atomic<uint64_t> actions{0};   // số lần áp dụng policy lên connection này
+};
+
+// ---------------- SHARD STRUCT ----------------
+// Frame chờ gửi sang connection thuộc shard khác
+struct Handoff
+{
+    mg_connection *c = nullptr; // connection đích
+    unsigned long id = 0;       // id để kiểm tra connection còn sống
+    FrameRef frame;
+};
+
+// Mỗi shard là 1 thread với mg_mgr riêng. Connection chỉ được đọc/ghi
+// bởi thread của shard sở hữu nó; shard khác muốn gửi thì đẩy vào inbox.
+struct Shard
+{
+    int index = 0;
+    mg_mgr mgr{};
+    unsigned long doorbell_id = 0;                         // listener nhận mg_wakeup
+    std::unordered_map<unsigned long, mg_connection *> live; // id -> connection (chỉ thread shard dùng)
+    std::vector<unsigned long> dirty;                       // id các connection có frame chờ flush
+    std::vector<unsigned long> paused;                      // id các connection đang ngừng đọc
+    std::vector<Backfill> backfills;                        // file đang gửi lại cho người nhận
+    std::vector<Fetch> fetches;                             // file đã lưu đang gửi cho người xin
+    std::mutex mu;                                          // bảo vệ inbox
+    std::vector<Handoff> inbox;
+};
+
+// Bộ đếm, đọc qua topic /sys/stats
+struct Stats
+{
+    std::atomic<uint64_t> frames_encoded{0}; // số frame dùng chung đã encode
+    std::atomic<uint64_t> checksum_bytes{0}; // số byte đã tính checksum
+    std::atomic<uint64_t> crc_errors{0};     // packet FLAG_CRC32C bị từ chối vì CRC sai
+    std::atomic<uint64_t> bytes_copied{0};   // số byte memcpy vào c->send
+    std::atomic<uint64_t> bytes_direct{0};   // số byte ghi thẳng từ frame ra socket
+    std::atomic<uint64_t> writev_calls{0};   // số lần gọi writev
+    std::atomic<uint64_t> packets_in{0};     // số frame nhận được (MSG_BUNDLE tính 1)
+
+    std::atomic<uint64_t> batch_frames{0};      // số MSG_BUNDLE đã nhận
+    std::atomic<uint64_t> batch_messages{0};    // số packet con trong các MSG_BUNDLE
+    std::atomic<uint64_t> batch_acks_merged{0}; // ACK của packet con gộp vào ACK của lô
+
+    std::atomic<uint64_t> persist_queue_depth{0};  // số op đang chờ ghi đĩa
+    std::atomic<uint64_t> persist_queue_bytes{0};  // byte chunk file đang chờ ghi đĩa
+    std::atomic<uint64_t> persist_pauses{0};       // số lần ngừng đọc người gửi không có window vì đĩa chậm
+    std::atomic<uint64_t> persist_ops{0};          // số op đã xử lý
+    std::atomic<uint64_t> persist_coalesced{0};    // số op bị gộp bỏ
+    std::atomic<uint64_t> persist_batches{0};      // số lô đã ghi
+    std::atomic<uint64_t> persist_flush_us{0};     // tổng thời gian ghi các lô
+    std::atomic<uint64_t> persist_flush_us_max{0}; // lô chậm nhất
+    std::atomic<uint64_t> persist_errors{0};       // lỗi mở/ghi file
+
+    std::atomic<uint64_t> dir_rebuilds{0}; // số lần dựng lại snapshot danh sách
+    std::atomic<uint64_t> dir_deltas{0};   // số thay đổi đã đẩy qua /sys/dir
+
+    std::atomic<uint64_t> file_bytes_relayed{0};  // byte file chỉ chuyển tiếp
+    std::atomic<uint64_t> file_bytes_archived{0}; // byte file đưa sang thread ghi đĩa
+    std::atomic<uint64_t> file_acks{0};           // số ACK cộng dồn đã gửi
+    std::atomic<uint64_t> file_credit_stalls{0};  // số lần giữ ACK vì người nhận nghẽn
+    std::atomic<uint64_t> file_resumes{0};        // số lần người gửi nối lại file dở
+    std::atomic<uint64_t> file_backfill_bytes{0}; // byte gửi lại cho người nhận từ upload/
+    std::atomic<uint64_t> file_ref_bytes{0};      // byte người gửi không phải gửi lại (MSG_FILE_REF)
+
+    std::atomic<uint64_t> file_hash_ok{0};         // file có hash khớp lúc LAST
+    std::atomic<uint64_t> file_hash_bad{0};        // file hash sai, người gửi phải gửi lại từ đoạn sai
+    std::atomic<uint64_t> file_hash_unverified{0}; // file có hash nhưng server không tính đủ (chunk lệch thứ tự, server khởi động lại)
+
+    std::atomic<uint64_t> file_stripe_joins{0};  // số connection phụ đã MSG_FILE_JOIN (gửi + nhận)
+    std::atomic<uint64_t> file_striped{0};       // số lượt gửi file song song nhiều connection
+
+    std::atomic<uint64_t> compress_in_bytes{0};  // byte payload gốc đã nén
+    std::atomic<uint64_t> compress_out_bytes{0}; // byte sau khi nén
+    std::atomic<uint64_t> compress_skipped{0};   // payload gửi nguyên vì khó nén
+    std::atomic<uint64_t> compress_reused{0};    // payload người gửi đã nén, chuyển tiếp không nén lại
+    std::atomic<uint64_t> compress_us{0};        // thời gian nén
+    std::atomic<uint64_t> decompress_bytes{0};   // byte gốc giải nén từ packet nhận được
+    std::atomic<uint64_t> decompress_us{0};      // thời gian giải nén
+
+    std::atomic<uint64_t> fetches{0};          // số lượt /sys/fetch_file
+    std::atomic<uint64_t> fetch_bytes{0};      // byte file đã gửi (Linux: sendfile từ page cache)
+    std::atomic<uint64_t> fetch_read_bytes{0}; // byte đọc vào bộ nhớ (checksum 1 lần mỗi file, không có sendfile)
+
+    std::atomic<uint64_t> store_blocks{0};        // số block trong kho
+    std::atomic<uint64_t> store_bytes{0};         // byte thật trên đĩa của kho
+    std::atomic<uint64_t> store_logical_bytes{0}; // byte các file đã lưu (tính cả phần trùng)
+    std::atomic<uint64_t> store_dup_blocks{0};    // số block trùng không phải ghi
+
+    std::atomic<uint64_t> sendq_drops{0};        // số frame text bị bỏ
+    std::atomic<uint64_t> sendq_drop_bytes{0};   // số byte bị bỏ
+    std::atomic<uint64_t> sendq_pauses{0};       // số lần ngừng đọc publisher
+    std::atomic<uint64_t> sendq_spills{0};       // số frame ghi ra đĩa
+    std::atomic<uint64_t> sendq_spill_bytes{0};  // số byte ghi ra đĩa
+    std::atomic<uint64_t> sendq_disconnects{0};  // số connection bị ngắt vì nghẽn
+};
+
+// ---------------- JOURNAL STRUCT ----------------
+enum JournalOp : uint8_t
+{
+    J_USER_ON = 1, // user online
+    J_USER_OFF,    // user offline, kèm xóa mọi user:topic của user
+    J_TOPIC_ADD,   // topic mới
+    J_SUB_ADD,     // thêm user:topic
+    J_SUB_DEL      // xóa user:topic
+};
+
+// Journal chỉ ghi thêm, chỉ thread ghi đĩa được đụng tới
+struct StateJournal
+{
+    FILE *fp = nullptr;
+    size_t records = 0;
+};
+
+// Bản chụp trạng thái để ghi file .txt và nén journal ở thread nền
+struct StateSnapshot
+{
+    std::vector<std::string> users;
+    std::vector<std::string> topics;
+    std::vector<std::pair<std::string, std::string>> subs; // user, topic
+};
+
+// ---------------- PERSIST STRUCT ----------------
+enum PersistKind : uint8_t
+{
+    P_JOURNAL,    // 1 record journal
+    P_FILE_OPEN,  // mở file upload
+    P_FILE_WRITE, // ghi 1 chunk
+    P_FILE_REF,   // ghi 1 block đã có trong kho (dedup)
+    P_FILE_CLOSE  // đóng file upload
+};
+
+// 1 thao tác ghi đĩa, nằm trong hàng đợi MPSC gửi cho thread ghi đĩa
+struct PersistOp
+{
+    PersistOp *next = nullptr;
+    PersistKind kind = P_JOURNAL;
+    JournalOp jop = J_USER_ON;
+    std::string a, b;          // user/topic, đường dẫn file hoặc hash block
+    uint64_t file_id = 0;      // file upload
+    uint64_t offset = 0;       // mở file: ghi tiếp từ offset (file dở); block: độ dài; ghi: vị trí (UINT64_MAX = nối tiếp)
+    std::shared_ptr<std::atomic<uint64_t>> stored; // mở file: nơi báo số byte đã ghi
+    std::vector<uint8_t> data; // dữ liệu chunk
+    bool dedup = false;        // mở file: lưu dạng danh sách block "<tên>.chunks" (lượt gửi dùng kho chống trùng)
+    bool dead = false;         // bị gộp, không cần ghi
+
+    // báo lỗi mở file về người gửi
+    Shard *shard = nullptr;
+    mg_connection *c = nullptr;
+    unsigned long conn_id = 0;
+    uint32_t msg_id = 0;
+    bool is_ws = false;
+    bool v2 = false;
+    bool crc = false;
+};
+
+// File upload đang mở ở thread ghi đĩa
+struct UploadFile
+{
+    FILE *fp = nullptr; // nullptr: mở lỗi, bỏ qua các lần ghi sau
+    uint64_t pos = 0;   // số byte đầu file đã ghi
+    std::shared_ptr<std::atomic<uint64_t>> stored;
+    bool dirty = false; // có ghi trong lô này, cần fflush
+    bool dedup = false;         // fp là danh sách block "<tên>.chunks"
+    std::vector<uint8_t> block; // dedup: phần chưa đủ 1 block
+    std::map<uint64_t, uint64_t> got; // ghi theo offset (gửi song song): đoạn đã ghi sau pos
+};
+
+// ---------------- DIRECTORY STRUCT ----------------
+enum DirList
+{
+    DIR_USERS,
+    DIR_TOPICS
+};
+
+// Danh sách đã sắp xếp, dùng chung giữa các lần đọc cho tới khi danh sách đổi
+struct DirSnapshot
+{
+    uint64_t version = 0;           // g_dir_version lúc dựng
+    std::vector<std::string> items; // đã sắp xếp
+    std::string joined;             // "a\nb\n..." cho /sys/get_users kiểu cũ
+};
+
 // ---------------- GLOBALS ----------------
-static std::unordered_set<std::string> onlineUsers;           // danh sách user online
 static std::unordered_map<mg_connection *, Client> g_clients; // map connection -> client
-static std::unordered_map<uint32_t, IncomingFile> g_files;    // messageId -> file transfer
+static NameTable g_user_ids;                                                  // username <-> id
+static NameTable g_topic_ids{"/sys/get_users", "/sys/get_topics", "/sys/stats", "/sys/queues",
+                             FETCH_TOPIC, DIR_TOPIC, "/game/join", "/game/move"}; // topic <-> id (xem SysTopicId)
+static std::vector<std::vector<mg_connection *>> g_sessions;   // id user -> các connection đang login
+static std::vector<std::vector<mg_connection *>> g_topic_subs; // id topic -> subscriber
+static std::unordered_set<std::string> g_topics;                                       // mọi topic đã từng có
+static std::unordered_map<std::string, std::unordered_set<std::string>> g_user_topics; // user -> topic đã subscribe
+static std::atomic<uint64_t> g_state_version{0};                                       // tăng mỗi khi trạng thái đổi
+static StateJournal g_journal;                                                         // chỉ thread ghi đĩa dùng
+static std::atomic<PersistOp *> g_persist_head{nullptr};                               // hàng đợi MPSC
+static std::atomic<uint64_t> g_next_file_id{1};
+static uint64_t g_dir_version = 0;                                 // tăng mỗi khi danh sách user/topic đổi
+static uint64_t g_dir_changed[2] = {0, 0};                         // version lần đổi gần nhất của từng danh sách
+static std::shared_ptr<const DirSnapshot> g_dir_cache[2];          // snapshot đã cache
+static std::mutex g_dir_mu;                                        // bảo vệ g_dir_cache khi đang giữ g_mu shared
+static std::unordered_map<std::string, IncomingFile> g_files; // "người gửi#messageId" -> file transfer
+static std::unordered_map<std::string, FileManifest> g_manifests; // "người gửi/key" -> manifest
+static std::atomic<int> g_files_stalled{0};                   // số file đang bị giữ ACK
+static std::atomic<int> g_backfills{0};                       // số file đang gửi lại cho người nhận
+static std::atomic<int> g_sendq_paused{0};                    // số connection đang ngừng đọc
+static std::unordered_map<std::string, std::string> g_transfers;               // mã lượt gửi -> khóa trong g_files
+static std::unordered_map<std::string, mg_connection *> g_rx_codes;            // mã connection phụ -> connection chính
+static std::unordered_map<mg_connection *, std::vector<mg_connection *>> g_rx_data; // connection chính -> connection phụ nhận chunk file
+static std::unordered_map<std::string, std::vector<StoredUpload>> g_uploads; // topic hoặc "@user" -> file đã lưu
+static std::unordered_map<std::string, uint64_t> g_upload_owner;             // tên file -> lượt gửi đang ghi upload/<tên>
+static std::mutex g_opened_mu;                                // bảo vệ StoredUpload::opened (fetch chạy dưới shared lock)
+static std::atomic<int> g_fetches{0};                         // số lượt fetch đang gửi
+static std::unordered_set<std::string> g_store;               // hash (hex) các block đã có trong kho
+static std::mutex g_store_mu;                                 // bảo vệ g_store (thread ghi đĩa thêm vào)
 static GameRoom g_game;                                       // game 1 vs 1
-static std::mutex g_mu;                                       // mutex bảo vệ các map
+static std::shared_mutex g_mu;                                // bảo vệ các map (publish chỉ cần shared lock)
+static Config g_cfg;
+static Stats g_stats;
+static std::vector<std::unique_ptr<Shard>> g_shards;
+static thread_local Shard *t_shard = nullptr; // shard của thread hiện tại
+static thread_local mg_connection *t_src = nullptr; // connection có packet đang được xử lý
+
+// Packet đang xử lý tới dạng nén: payload đã giải nén + bản nén gốc, fanout
+// của đúng payload này gửi lại bản nén cho người nhận nén mà không nén lại
+struct WirePayload
+{
+    const uint8_t *raw = nullptr;
+    size_t raw_len = 0;
+    const uint8_t *z = nullptr;
+    size_t z_len = 0;
+};
+static thread_local WirePayload t_wire;
+static thread_local WireIds t_ids; // id sender / topic của packet v2 đang xử lý (0 = gửi bằng tên)
+static thread_local uint32_t *t_batch_acks = nullptr; // đang xử lý MSG_BUNDLE: số ACK rỗng đã gộp
+static thread_local std::vector<uint8_t> t_ref;       // MSG_FILE_REF đang xử lý: [offset][block] đọc từ kho trước khi lấy g_mu
 
 // ---------------- UTILS ----------------
 
-// Tính checksum XOR của payload
+// Tách payload dạng "key=value;key=value"
+std::unordered_map<std::string, std::string> parse_kv(const std::string &s)
+{
+    std::unordered_map<std::string, std::string> kv;
+    size_t pos = 0;
+    while (pos < s.size())
+    {
+        size_t end = s.find(';', pos);
+        if (end == std::string::npos)
+            end = s.size();
+        size_t eq = s.find('=', pos);
+        if (eq != std::string::npos && eq < end)
+            kv[s.substr(pos, eq - pos)] = s.substr(eq + 1, end - eq - 1);
+        pos = end + 1;
+    }
+    return kv;
+}
+
+// Tính checksum XOR của payload (client cũ)
 uint32_t calc_checksum(const uint8_t *data, size_t n)
 {
+    g_stats.checksum_bytes.fetch_add(n, std::memory_order_relaxed);
     uint32_t c = 0;
     for (size_t i = 0; i < n; i++)
         c ^= data[i];
     return c;
 }
 
-// Gửi packet theo protocol
-void send_packet(mg_connection *c, PacketHeader &h, const void *payload)
+// Tính CRC32C của payload (crc: giá trị của phần trước, để tính tiếp)
+uint32_t calc_crc32c(const uint8_t *data, size_t n, uint32_t crc = 0)
+{
+    g_stats.checksum_bytes.fetch_add(n, std::memory_order_relaxed);
+    return crc32c(crc, data, n);
+}
+
+// Checksum theo kiểu người nhận chọn lúc login: CRC32C (kèm FLAG_CRC32C) hoặc XOR
+void set_checksum(PacketHeader &h, const void *payload, bool crc)
+{
+    h.flags = crc ? (h.flags | FLAG_CRC32C) : (h.flags & ~FLAG_CRC32C);
+    if (!payload || !h.payloadLength)
+        h.checksum = 0;
+    else
+        h.checksum = crc ? calc_crc32c((const uint8_t *)payload, h.payloadLength)
+                         : calc_checksum((const uint8_t *)payload, h.payloadLength);
+}
+
+// fseek 64-bit (file upload / spill có thể lớn hơn 2 GB)
+int file_seek(FILE *fp, uint64_t off)
+{
+#ifdef _WIN32
+    return _fseeki64(fp, (__int64)off, SEEK_SET);
+#else
+    return fseeko(fp, (off_t)off, SEEK_SET);
+#endif
+}
+
+// Ghi nhận đoạn [off, end) đã có: prefix là số byte liền từ đầu, extra là
+// các đoạn rời phía sau (offset -> end), gộp vào prefix khi liền nhau
+void range_add(uint64_t &prefix, std::map<uint64_t, uint64_t> &extra, uint64_t off, uint64_t end)
 {
-    // tính checksum
-    h.checksum = (payload && h.payloadLength) ? calc_checksum((const uint8_t *)payload, h.payloadLength) : 0;
+    if (end <= prefix)
+        return;
+    if (off <= prefix)
+        prefix = end;
+    else
+    {
+        uint64_t &e = extra[off];
+        e = std::max(e, end);
+    }
+    for (auto it = extra.begin(); it != extra.end() && it->first <= prefix; it = extra.erase(it))
+        prefix = std::max(prefix, it->second);
+}
+
+// Shard sở hữu connection
+Shard *shard_of(mg_connection *c)
+{
+    return (Shard *)c->mgr->userdata;
+}
 
-    if (g_clients[c].is_ws)
+ConnState *conn_state(mg_connection *c)
+{
+    ConnState *st;
+    memcpy(&st, c->data, sizeof(st));
+    return st;
+}
+
+// Ghi header WebSocket (FIN + binary, server không mask), trả về số byte
+size_t ws_frame_header(uint8_t *buf, size_t len)
+{
+    buf[0] = 0x80 | WEBSOCKET_OP_BINARY;
+    if (len < 126)
     {
-        // WebSocket: gửi PacketHeader + payload tách riêng
-        mg_ws_send(c, &h, sizeof(h), WEBSOCKET_OP_BINARY);
-        if (payload && h.payloadLength)
-            mg_ws_send(c, payload, h.payloadLength, WEBSOCKET_OP_BINARY);
+        buf[1] = (uint8_t)len;
+        return 2;
     }
-    else
+    if (len < 65536)
     {
-        // TCP: gửi liên tiếp
-        mg_send(c, &h, sizeof(h));
-        if (payload && h.payloadLength)
-            mg_send(c, payload, h.payloadLength);
+        buf[1] = 126;
+        buf[2] = (uint8_t)(len >> 8);
+        buf[3] = (uint8_t)len;
+        return 4;
     }
+    buf[1] = 127;
+    for (int i = 0; i < 8; i++)
+        buf[2 + i] = (uint8_t)((uint64_t)len >> (56 - 8 * i));
+    return 10;
 }
 
-// Gửi ACK theo messageId
-void send_ack(mg_connection *c, uint32_t msgId)
+// Encode packet thành frame wire cho TCP hoặc WS, header v1 hoặc v2 (h.checksum phải tính sẵn)
+FrameRef encode_frame(const PacketHeader &h, const void *payload, bool is_ws, bool v2)
 {
-    PacketHeader h{};
-    h.msgType = MSG_ACK;
-    h.messageId = msgId;
-    h.timestamp = time(nullptr);
-    h.version = PROTOCOL_VERSION;
-    send_packet(c, h, nullptr);
+    size_t plen = payload ? h.payloadLength : 0;
+    uint8_t hb[WIRE_HEADER_MAX];
+    size_t hn = wire_encode_header(h, v2, hb);
+    auto f = std::make_shared<Frame>();
+    f->reserve(hn + plen + 10);
+    if (is_ws)
+    {
+        // WebSocket: header + payload nằm chung 1 frame
+        uint8_t wsh[10];
+        f->insert(f->end(), wsh, wsh + ws_frame_header(wsh, hn + plen));
+    }
+    f->insert(f->end(), hb, hb + hn);
+    if (plen)
+        f->insert(f->end(), (const uint8_t *)payload, (const uint8_t *)payload + plen);
+    g_stats.frames_encoded.fetch_add(1, std::memory_order_relaxed);
+    return f;
 }
 
-// Gửi lỗi kèm msg
-void send_error(mg_connection *c, uint32_t msgId, const char *msg)
+// Đẩy frame sang inbox của shard khác, đánh thức shard nếu inbox đang rỗng
+void shard_handoff(Shard *s, mg_connection *c, unsigned long id, FrameRef frame)
 {
-    PacketHeader h{};
-    h.msgType = MSG_ERROR;
-    h.payloadLength = strlen(msg);
-    h.messageId = msgId;
-    h.timestamp = time(nullptr);
-    h.version = PROTOCOL_VERSION;
-    send_packet(c, h, msg);
+    bool wake;
+    {
+        std::lock_guard<std::mutex> lk(s->mu);
+        wake = s->inbox.empty();
+        s->inbox.push_back(Handoff{c, id, std::move(frame)});
+    }
+    if (wake)
+        mg_wakeup(&s->mgr, s->doorbell_id, "", 0);
 }
 
-// Kiểm tra user online
-bool user_online(const std::string &username)
+// ---------------- SEND QUEUE ----------------
+// Dữ liệu ra của 1 connection gồm c->send (mongoose) rồi tới ConnState::out.
+// Chỉ được ghi thêm vào c->send khi out rỗng để giữ đúng thứ tự.
+
+#if MG_ARCH == MG_ARCH_WIN32
+typedef WSABUF IoVec;
+static void iov_set(IoVec &v, const uint8_t *p, size_t n)
+{
+    v.buf = (char *)p;
+    v.len = (ULONG)n;
+}
+static long sock_writev(mg_connection *c, IoVec *v, size_t n)
+{
+    DWORD sent = 0;
+    if (WSASend((SOCKET)(size_t)c->fd, v, (DWORD)n, &sent, 0, NULL, NULL) != 0)
+        return WSAGetLastError() == WSAEWOULDBLOCK ? 0 : -1;
+    return (long)sent;
+}
+#else
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+typedef struct iovec IoVec;
+static void iov_set(IoVec &v, const uint8_t *p, size_t n)
+{
+    v.iov_base = (void *)p;
+    v.iov_len = n;
+}
+static long sock_writev(mg_connection *c, IoVec *v, size_t n)
 {
-    return onlineUsers.count(username) > 0;
+    msghdr msg{};
+    msg.msg_iov = v;
+    msg.msg_iovlen = n;
+    ssize_t r = sendmsg((int)(size_t)c->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (r < 0)
+        return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+    return (long)r;
 }
+#endif
 
-// Kiểm tra topic có subscriber
-bool topic_has_subscribers(const std::string &topic)
+// Cập nhật số byte chờ gửi để shard khác đọc
+static void conn_update_pending(mg_connection *c)
 {
-    for (auto &[_, cli] : g_clients)
-        if (cli.topics.count(topic))
-            return true;
-    return false;
+    ConnState *st = conn_state(c);
+    size_t n = c->send.len + st->out_bytes - st->out_off + (size_t)(st->spill_wr - st->spill_rd);
+    st->pending.store(n, std::memory_order_relaxed);
+    if (n > st->peak.load(std::memory_order_relaxed))
+        st->peak.store(n, std::memory_order_relaxed);
 }
 
-// Gửi text game/private/topic
-void send_game_text(mg_connection *c, const std::string &topic, const std::string &text)
+// ---------------- BACKPRESSURE ----------------
+// Mỗi connection được giữ tối đa --sendq-max byte chờ gửi. Vượt giới hạn thì
+// áp dụng --sendq-policy:
+// - drop: bỏ các message text cũ nhất của topic (ACK/ERROR/file/game/sys giữ lại)
+// - pause: ngừng đọc từ publisher đang gửi tới, timer của shard mở lại khi
+//   người nhận còn dưới nửa giới hạn
+// - spill: frame mới ghi nối vào file tạm, đọc lại khi hàng đợi vơi
+// - disconnect: ngắt connection nghẽn
+// Với drop/pause, nếu chỉ còn frame quan trọng mà vẫn vượt 2 lần giới hạn
+// thì connection cũng bị ngắt.
+
+// Frame có phải message text thường (bỏ được) không
+static bool frame_droppable(const ConnState *st, const Frame &f)
 {
-    PacketHeader h{};
-    h.msgType = MSG_PUBLISH_TEXT;
-    h.payloadLength = (uint32_t)text.size();
-    h.timestamp = time(nullptr);
-    h.version = PROTOCOL_VERSION;
-    strncpy(h.topic, topic.c_str(), MAX_TOPIC_LEN - 1);
-    send_packet(c, h, text.data());
+    size_t off = 0;
+    if (st->is_ws && f.size() > 1)
+        off = (f[1] & 0x7f) == 127 ? 10 : (f[1] & 0x7f) == 126 ? 4 : 2;
+    PacketHeader h;
+    if (f.size() <= off || wire_decode_header(f.data() + off, f.size() - off, h) <= 0)
+        return false;
+    return h.msgType == MSG_PUBLISH_TEXT && !(h.flags & (FLAG_PRIVATE | FLAG_FILE)) &&
+           strncmp(h.topic, "/sys/", 5) != 0 && strncmp(h.topic, "/game/", 6) != 0;
 }
 
-// Gửi private message
-void send_private(const std::string &user, PacketHeader &h, const void *payload)
+// Byte chờ gửi trong bộ nhớ (c->send + out)
+static size_t sendq_queued(mg_connection *c, const ConnState *st)
 {
-    for (auto &[c, cli] : g_clients)
-        if (cli.username == user)
-            send_packet(c, h, payload);
+    return c->send.len + st->out_bytes - st->out_off;
 }
 
-// Broadcast tới tất cả subscriber của topic (ngoại trừ sender)
-void broadcast_topic(const std::string &topic, PacketHeader &h, const void *payload, mg_connection *src)
+// Ngắt connection nghẽn, frame gửi tới sau đó bị bỏ
+static void sendq_disconnect(mg_connection *c, ConnState *st)
 {
-    for (auto &[c, cli] : g_clients)
+    if (c->is_closing)
+        return;
+    c->is_closing = 1;
+    st->actions.fetch_add(1, std::memory_order_relaxed);
+    g_stats.sendq_disconnects.fetch_add(1, std::memory_order_relaxed);
+    std::cout << "Ngat connection " << c->id << ": hang doi gui " << sendq_queued(c, st) << " byte\n";
+}
+
+// Bỏ các frame text cũ nhất cho tới khi về dưới giới hạn. Frame đầu đang
+// ghi dở thì giữ lại để không cắt ngang packet. Chỉ duyệt tới frame cuối
+// cùng bị bỏ, các frame giữ lại được dồn về sau rồi xóa khoảng trống ở đầu
+// để mỗi lần vượt giới hạn không phải dịch cả hàng đợi.
+static void sendq_drop_oldest(mg_connection *c, ConnState *st)
+{
+    size_t excess = sendq_queued(c, st) - g_cfg.sendq_max, freed = 0;
+    auto first = st->out.begin() + (st->out_off ? 1 : 0);
+    auto stop = first;
+    for (; stop != st->out.end() && freed < excess; ++stop)
     {
-        if (c == src)
+        if (!frame_droppable(st, **stop))
             continue;
-        if (cli.topics.count(topic))
-            send_packet(c, h, payload);
+        freed += (*stop)->size();
+        st->out_bytes -= (*stop)->size();
+        g_stats.sendq_drops.fetch_add(1, std::memory_order_relaxed);
+        g_stats.sendq_drop_bytes.fetch_add((*stop)->size(), std::memory_order_relaxed);
+        stop->reset();
+    }
+    if (!freed)
+        return;
+    auto keep = stop;
+    for (auto it = stop; it != first;)
+    {
+        --it;
+        if (*it && --keep != it)
+            *keep = std::move(*it);
     }
+    st->out.erase(first, keep);
+    st->actions.fetch_add(1, std::memory_order_relaxed);
 }
 
-// ---------------- GAME HANDLER ----------------
-
-// Server KHÔNG giữ board, chỉ forward /game/* cho đúng người
-void handle_game(mg_connection *c, PacketHeader &h, const uint8_t *payload)
+// Ghi frame nối vào file tạm của connection: [u32 độ dài][frame]
+static bool sendq_spill(mg_connection *c, ConnState *st, const Frame &f)
 {
-    std::string topic = h.topic;
+    if (!st->spill && !(st->spill = tmpfile()))
+        return false;
+    uint32_t n = (uint32_t)f.size();
+    file_seek(st->spill, st->spill_wr);
+    if (fwrite(&n, sizeof(n), 1, st->spill) != 1 || fwrite(f.data(), 1, n, st->spill) != n)
+    {
+        sendq_disconnect(c, st);
+        return false;
+    }
+    st->spill_wr += sizeof(n) + n;
+    st->actions.fetch_add(1, std::memory_order_relaxed);
+    g_stats.sendq_spills.fetch_add(1, std::memory_order_relaxed);
+    g_stats.sendq_spill_bytes.fetch_add(n, std::memory_order_relaxed);
+    return true;
+}
 
-    // ==== JOIN ====
-    if (topic == "/game/join")
+// Đọc lại frame từ file tạm vào out tới khi đủ nửa giới hạn; đọc hết thì
+// đóng file (tmpfile tự xóa).
+static void sendq_unspill(mg_connection *c, ConnState *st)
+{
+    file_seek(st->spill, st->spill_rd);
+    while (st->spill_rd < st->spill_wr && st->out_bytes < g_cfg.sendq_max / 2)
     {
-        if (g_game.started)
+        uint32_t n;
+        auto f = std::make_shared<Frame>();
+        if (fread(&n, sizeof(n), 1, st->spill) == 1)
+            f->resize(n);
+        if (f->empty() || fread(f->data(), 1, n, st->spill) != n)
         {
-            send_game_text(c, "/game/reject", "room_full");
+            sendq_disconnect(c, st);
             return;
         }
+        st->spill_rd += sizeof(n) + n;
+        st->out_bytes += n;
+        st->out.push_back(std::move(f));
+    }
+    if (st->spill_rd == st->spill_wr)
+    {
+        fclose(st->spill);
+        st->spill = nullptr;
+        st->spill_rd = st->spill_wr = 0;
+    }
+}
 
-        if (!g_game.p1)
+// Giải phóng file tạm khi connection đóng
+static void sendq_release(ConnState *st)
+{
+    if (st->spill)
+        fclose(st->spill);
+    st->spill = nullptr;
+}
+
+// Ngừng đọc src cho tới khi sendq_resume_timer thấy dst đã vơi (dst = nullptr:
+// chờ hàng đợi ghi đĩa vơi, persist_pause_src)
+static void sendq_pause(mg_connection *src, mg_connection *dst)
+{
+    src->is_full = 1; // mongoose ngừng đọc socket
+    conn_state(src)->paused_by = dst;
+    t_shard->paused.push_back(src->id);
+    g_sendq_paused.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Publisher đang gửi tới connection nghẽn: ngừng đọc từ publisher đó
+static void sendq_pause_src(mg_connection *dst)
+{
+    mg_connection *src = t_src;
+    if (!src || src == dst || src->is_full)
+        return;
+    if (conn_state(dst)->pending.load(std::memory_order_relaxed) <= g_cfg.sendq_max)
+        return;
+    sendq_pause(src, dst);
+    conn_state(dst)->actions.fetch_add(1, std::memory_order_relaxed);
+    g_stats.sendq_pauses.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Ghi các frame đang chờ ra socket bằng writev, không copy qua c->send.
+// Nếu socket đầy, phần còn lại của frame đầu được chuyển vào c->send để
+// mongoose chờ socket writable; MG_EV_WRITE sẽ gọi lại hàm này.
+void flush_conn(mg_connection *c)
+{
+    ConnState *st = conn_state(c);
+    const size_t MAX_IOV = 64;
+    IoVec iov[MAX_IOV];
+
+    for (;;)
+    {
+        if (st->spill && st->out_bytes < g_cfg.sendq_max / 2)
+            sendq_unspill(c, st);
+        if (st->out.empty() || c->send.len != 0 || c->is_closing || st->streaming)
+            break;
+
+        size_t n = 0, total = 0;
+        for (auto it = st->out.begin(); it != st->out.end() && n < MAX_IOV; ++it, ++n)
         {
-            g_game.p1 = c;
-            send_game_text(c, "/game/wait", "waiting_player");
-            return;
+            size_t off = (n == 0) ? st->out_off : 0;
+            iov_set(iov[n], (*it)->data() + off, (*it)->size() - off);
+            total += (*it)->size() - off;
         }
 
-        if (!g_game.p2 && c != g_game.p1)
+        long w = sock_writev(c, iov, n);
+        g_stats.writev_calls.fetch_add(1, std::memory_order_relaxed);
+        if (w < 0)
         {
-            g_game.p2 = c;
-            g_game.started = true;
-            send_game_text(g_game.p1, "/game/start", "X");
-            send_game_text(g_game.p2, "/game/start", "O");
+            mg_error(c, "writev failed");
             return;
         }
-        return;
+        g_stats.bytes_direct.fetch_add((uint64_t)w, std::memory_order_relaxed);
+
+        size_t left = (size_t)w;
+        while (left > 0)
+        {
+            size_t rest = st->out.front()->size() - st->out_off;
+            if (left < rest)
+            {
+                st->out_off += left;
+                break;
+            }
+            left -= rest;
+            st->out_bytes -= st->out.front()->size();
+            st->out.pop_front();
+            st->out_off = 0;
+        }
+
+        if ((size_t)w < total)
+        {
+            // socket đầy: chỉ copy phần dở của frame đầu
+            const FrameRef &f = st->out.front();
+            size_t rest = f->size() - st->out_off;
+            mg_send(c, f->data() + st->out_off, rest);
+            g_stats.bytes_copied.fetch_add(rest, std::memory_order_relaxed);
+            st->out_bytes -= f->size();
+            st->out.pop_front();
+            st->out_off = 0;
+        }
     }
+    conn_update_pending(c);
+}
 
-    // ==== MOVE ====
-    if (topic == "/game/move")
+// Xếp frame vào hàng đợi của connection (connection thuộc shard hiện tại)
+void queue_frame(mg_connection *c, FrameRef frame)
+{
+    ConnState *st = conn_state(c);
+    if (c->is_closing)
+        return; // đã bị ngắt, bỏ frame
+    size_t limit = g_cfg.sendq_max;
+    if (st->spill || (limit && g_cfg.sendq_policy == SQ_SPILL && sendq_queued(c, st) + frame->size() > limit))
     {
-        if (!g_game.started)
+        // đã có frame trên đĩa thì frame mới cũng phải xếp sau
+        if (!sendq_spill(c, st, *frame))
             return;
+    }
+    else
+    {
+        st->out_bytes += frame->size();
+        st->out.push_back(std::move(frame));
+        if (limit && sendq_queued(c, st) > limit)
+        {
+            if (g_cfg.sendq_policy == SQ_DISCONNECT)
+                sendq_disconnect(c, st);
+            else if (g_cfg.sendq_policy == SQ_DROP)
+                sendq_drop_oldest(c, st);
+            if (g_cfg.sendq_policy != SQ_SPILL && sendq_queued(c, st) > 2 * limit)
+                sendq_disconnect(c, st);
+        }
+    }
+    conn_update_pending(c);
+    if (!st->dirty)
+    {
+        st->dirty = true;
+        t_shard->dirty.push_back(c->id);
+    }
+}
 
-        mg_connection *other = (c == g_game.p1) ? g_game.p2 : (c == g_game.p2) ? g_game.p1
-                                                                               : nullptr;
-        if (!other)
-            return;
+// Gửi frame dùng chung tới connection, kể cả connection ở shard khác
+void send_frame(mg_connection *c, FrameRef frame)
+{
+    Shard *s = shard_of(c);
+    if (s != t_shard)
+        shard_handoff(s, c, c->id, std::move(frame));
+    else
+        queue_frame(c, std::move(frame));
+    if (g_cfg.sendq_max && g_cfg.sendq_policy == SQ_PAUSE)
+        sendq_pause_src(c);
+}
 
-        // Forward move
-        send_packet(other, h, payload);
+// Gửi packet theo protocol
+void send_packet(mg_connection *c, PacketHeader &h, const void *payload)
+{
+    Shard *s = shard_of(c);
+    ConnState *st = conn_state(c);
+    set_checksum(h, payload, st->crc);
+
+    // connection thuộc shard khác, còn frame chờ hoặc c->send đã lớn: đi qua
+    // hàng đợi để áp dụng giới hạn gửi
+    if (s != t_shard || !st->out.empty() || st->spill || st->streaming || c->send.len >= SENDQ_DIRECT_MAX)
+    {
+        send_frame(c, encode_frame(h, payload, st->is_ws, st->v2));
+        return;
+    }
+
+    // ghi header + payload thẳng vào c->send
+    size_t before = c->send.len;
+    uint8_t hb[WIRE_HEADER_MAX];
+    mg_send(c, hb, wire_encode_header(h, st->v2, hb));
+    if (payload && h.payloadLength)
+        mg_send(c, payload, h.payloadLength);
+
+    // WebSocket: bọc cả packet thành 1 frame binary ngay trong c->send
+    if (st->is_ws)
+        mg_ws_wrap(c, c->send.len - before, WEBSOCKET_OP_BINARY);
+    g_stats.bytes_copied.fetch_add(c->send.len - before, std::memory_order_relaxed);
+    conn_update_pending(c);
+}
+
+// ---------------- COMPRESSION ----------------
+// Client gửi LOGIN với payload "compress=lz" thì server ACK "compress=lz" và
+// từ đó PUBLISH_TEXT / FILE_DATA tới client này có thể mang FLAG_COMPRESSED.
+// Mỗi publish chỉ nén 1 lần cho mọi người nhận nén; người gửi đã nén sẵn thì
+// dùng lại bản nén của người gửi. Payload nén không nhỏ đi ít nhất 1/8 thì
+// gửi nguyên; connection gửi Z_FAIL_MAX payload khó nén liền nhau (file đã
+// nén, ảnh...) thì Z_SKIP payload sau không thử nén nữa.
+const uint32_t Z_FAIL_MAX = 4;
+const uint32_t Z_SKIP = 32;
+
+static bool compressible_type(const PacketHeader &h)
+{
+    return h.msgType == MSG_PUBLISH_TEXT || h.msgType == MSG_FILE_DATA;
+}
+
+// Giải nén packet FLAG_COMPRESSED nhận được vào buffer của thread, sửa h và
+// payload thành dạng gốc. false nếu payload hỏng.
+static bool wire_decompress(PacketHeader &h, const uint8_t *&payload)
+{
+    static thread_local std::vector<uint8_t> buf;
+    size_t raw = compressed_raw_size(payload, h.payloadLength);
+    if (!payload || raw == 0 || raw > MAX_PAYLOAD_SIZE)
+        return false;
+    auto t0 = std::chrono::steady_clock::now();
+    buf.resize(raw);
+    if (!decompress_payload(payload, h.payloadLength, buf.data(), raw))
+        return false;
+    t_wire = WirePayload{buf.data(), raw, payload, h.payloadLength};
+    h.flags &= ~FLAG_COMPRESSED;
+    h.payloadLength = (uint32_t)raw;
+    payload = buf.data();
+    g_stats.decompress_bytes.fetch_add(raw, std::memory_order_relaxed);
+    g_stats.decompress_us.fetch_add(
+        std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - t0).count(),
+        std::memory_order_relaxed);
+    return true;
+}
+
+// Frame của 1 publish, encode lười theo dạng wire của người nhận
+// ([ws][v2][crc], bản gốc và bản nén)
+struct FanoutFrames
+{
+    const PacketHeader &h;
+    const void *payload;
+    PacketHeader hs[2]; // h kèm checksum XOR / CRC32C
+    bool hs_ok[2] = {false, false};
+    FrameRef raw[2][2][2];
+
+    // bản nén, chỉ tạo khi có người nhận nén (zstate: 0 chưa thử, 1 có, -1 gửi nguyên)
+    int zstate = 0;
+    PacketHeader hz{};
+    PacketHeader hzs[2];
+    bool hzs_ok[2] = {false, false};
+    std::vector<uint8_t> zbuf;
+    const uint8_t *z = nullptr;
+    FrameRef zf[2][2][2];
+
+    FanoutFrames(const PacketHeader &hdr, const void *pl) : h(hdr), payload(pl) {}
+
+    // checksum mỗi kiểu chỉ tính 1 lần cho mọi người nhận
+    static const PacketHeader &summed(const PacketHeader &base, const void *pl, bool crc, PacketHeader *hs, bool *ok)
+    {
+        if (!ok[crc])
+        {
+            hs[crc] = base;
+            set_checksum(hs[crc], pl, crc);
+            ok[crc] = true;
+        }
+        return hs[crc];
+    }
+
+    bool compress()
+    {
+        if (!g_cfg.compress || !payload || h.payloadLength < COMPRESS_MIN || !compressible_type(h))
+            return false;
+        hz = h;
+        hz.flags |= FLAG_COMPRESSED;
+        // người gửi đã nén đúng payload này (và bản nén nhỏ hơn)
+        if (t_wire.raw == payload && t_wire.raw_len == h.payloadLength && t_wire.z_len < t_wire.raw_len)
+        {
+            z = t_wire.z;
+            hz.payloadLength = (uint32_t)t_wire.z_len;
+            g_stats.compress_reused.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+        ConnState *src = t_src ? conn_state(t_src) : nullptr;
+        int kind = h.msgType == MSG_FILE_DATA;
+        if (src && src->z_skip[kind])
+        {
+            src->z_skip[kind]--;
+            g_stats.compress_skipped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        auto t0 = std::chrono::steady_clock::now();
+        zbuf.resize(h.payloadLength);
+        size_t n = compress_payload(payload, h.payloadLength, zbuf.data());
+        g_stats.compress_us.fetch_add(
+            std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - t0).count(),
+            std::memory_order_relaxed);
+        if (!n)
+        {
+            if (src && ++src->z_fail[kind] >= Z_FAIL_MAX)
+            {
+                src->z_fail[kind] = 0;
+                src->z_skip[kind] = Z_SKIP;
+            }
+            g_stats.compress_skipped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        if (src)
+            src->z_fail[kind] = 0;
+        g_stats.compress_in_bytes.fetch_add(h.payloadLength, std::memory_order_relaxed);
+        g_stats.compress_out_bytes.fetch_add(n, std::memory_order_relaxed);
+        z = zbuf.data();
+        hz.payloadLength = (uint32_t)n;
+        return true;
+    }
+
+    const FrameRef &get(bool is_ws, bool v2, bool want_z = false, bool crc = false)
+    {
+        if (want_z && zstate == 0)
+            zstate = compress() ? 1 : -1;
+        if (want_z && zstate == 1)
+        {
+            FrameRef &f = zf[is_ws][v2][crc];
+            if (!f)
+                f = encode_frame(summed(hz, z, crc, hzs, hzs_ok), z, is_ws, v2);
+            return f;
+        }
+        FrameRef &f = raw[is_ws][v2][crc];
+        if (!f)
+            f = encode_frame(summed(h, payload, crc, hs, hs_ok), payload, is_ws, v2);
+        return f;
+    }
+};
+
+// Gửi 1 packet tới nhiều connection (trừ skip): encode 1 lần, dùng chung frame
+void send_fanout(const std::vector<mg_connection *> &conns, PacketHeader &h, const void *payload, mg_connection *skip)
+{
+    if (g_cfg.fanout_copy)
+    {
+        // chế độ cũ: encode + copy riêng cho từng người nhận (để so sánh)
+        for (mg_connection *c : conns)
+            if (c != skip)
+                send_packet(c, h, payload);
+        return;
+    }
+    FanoutFrames frames(h, payload);
+    for (mg_connection *c : conns)
+        if (c != skip)
+        {
+            ConnState *st = conn_state(c);
+            send_frame(c, frames.get(st->is_ws, st->v2, st->compress, st->crc));
+        }
+}
+
+// Gửi ACK theo messageId
+// Gửi ACK, info (nếu có) là các tùy chọn server đã chấp nhận dạng "key=value;..."
+void send_ack(mg_connection *c, uint32_t msgId, const std::string &info = "")
+{
+    // packet con của MSG_BUNDLE: ACK rỗng gộp vào 1 ACK cho cả lô
+    if (t_batch_acks && c == t_src && info.empty())
+    {
+        (*t_batch_acks)++;
+        return;
+    }
+    PacketHeader h{};
+    h.msgType = MSG_ACK;
+    h.payloadLength = (uint32_t)info.size();
+    h.messageId = msgId;
+    h.timestamp = time(nullptr);
+    h.version = PROTOCOL_VERSION;
+    send_packet(c, h, info.empty() ? nullptr : info.data());
+}
+
+// Packet FLAG_CRC32C: kiểm tra CRC của payload trên dây (trước khi giải nén).
+// Packet không có cờ (XOR kiểu cũ) không kiểm tra.
+static bool crc_ok(const PacketHeader &h, const uint8_t *payload)
+{
+    if (!(h.flags & FLAG_CRC32C))
+        return true;
+    uint32_t crc = h.payloadLength ? calc_crc32c(payload, h.payloadLength) : 0;
+    if (crc == h.checksum)
+        return true;
+    g_stats.crc_errors.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+// Gửi lỗi kèm msg
+void send_error(mg_connection *c, uint32_t msgId, const char *msg)
+{
+    PacketHeader h{};
+    h.msgType = MSG_ERROR;
+    h.payloadLength = strlen(msg);
+    h.messageId = msgId;
+    h.timestamp = time(nullptr);
+    h.version = PROTOCOL_VERSION;
+    send_packet(c, h, msg);
+}
+
+// Tùy chọn wire của connection lúc LOGIN / MSG_FILE_JOIN. Dạng gọn "caps=<hex>" (bit
+// CAP_*) được ACK "caps=<bit đồng ý>;max=<payload lớn nhất>;chunk=<chunk lớn nhất>".
+// Dạng cũ từng khóa "compress=lz", "wire=2", "crc=32c" được ACK lại đúng các khóa
+// đồng ý. Packet login là v2 cũng tính là xin header v2. ACK đi theo dạng vừa chọn;
+// connection v2 nhận thêm "uid=<id>" để gửi sender bằng id.
+static void login_options(mg_connection *c, const PacketHeader &h, const uint8_t *payload, Client *cli = nullptr)
+{
+    auto kv = parse_kv(h.payloadLength ? std::string((const char *)payload, h.payloadLength) : std::string());
+    bool compact = kv.count("caps") > 0;
+    uint32_t want = compact ? (uint32_t)strtoul(kv["caps"].c_str(), nullptr, 16)
+                            : (kv["compress"] == "lz" ? CAP_COMPRESS : 0) | (kv["wire"] == "2" ? CAP_WIRE_V2 : 0) |
+                                  (kv["crc"] == "32c" ? CAP_CRC32C : 0);
+    if (h.version == PROTOCOL_VERSION_2)
+        want |= CAP_WIRE_V2;
+    uint32_t have = CAP_CRC32C | CAP_BUNDLE | CAP_KEYED_FILES | (g_cfg.compress ? CAP_COMPRESS : 0) | (g_cfg.wire_v2 ? CAP_WIRE_V2 : 0);
+
+    ConnState *st = conn_state(c);
+    st->caps = want & have;
+    st->compress = st->caps & CAP_COMPRESS;
+    st->v2 = st->caps & CAP_WIRE_V2;
+    st->crc = st->caps & CAP_CRC32C;
+    std::string ack;
+    if (compact)
+    {
+        char buf[96];
+        snprintf(buf, sizeof(buf), "caps=%x;max=%zu;chunk=%zu", (unsigned)st->caps, (size_t)MAX_PAYLOAD_SIZE,
+                 g_cfg.chunk_max);
+        ack = buf;
+    }
+    else
+    {
+        ack = st->compress ? "compress=lz" : "";
+        if (st->v2)
+            ack += (ack.empty() ? "" : ";") + std::string("wire=2");
+        if (st->crc)
+            ack += (ack.empty() ? "" : ";") + std::string("crc=32c");
+    }
+    if (st->v2 && cli)
+        ack += ";uid=" + std::to_string(cli->uid);
+    // connection chính: mã để client mở connection phụ nhận file cho session này
+    if (compact && cli)
+    {
+        if (cli->rx_code.empty())
+        {
+            char id[17];
+            uint64_t r;
+            mg_random(&r, sizeof(r));
+            snprintf(id, sizeof(id), "%016llx", (unsigned long long)r);
+            cli->rx_code = id;
+            g_rx_codes[cli->rx_code] = c;
+        }
+        ack += ";rx=" + cli->rx_code;
+    }
+    send_ack(c, h.messageId, ack);
+}
+
+// Connection của user (is_private) hoặc subscriber của topic theo id, nullptr nếu không có
+static const std::vector<mg_connection *> *conns_of(bool is_private, uint32_t id)
+{
+    auto &v = is_private ? g_sessions : g_topic_subs;
+    return id < v.size() && !v[id].empty() ? &v[id] : nullptr;
+}
+
+// Kiểm tra user online
+bool user_online(std::string_view username)
+{
+    return conns_of(true, g_user_ids.find(username)) != nullptr;
+}
+
+// Kiểm tra topic có subscriber
+bool topic_has_subscribers(std::string_view topic)
+{
+    return conns_of(false, g_topic_ids.find(topic)) != nullptr;
+}
+
+// User đang online (thread ghi đĩa và danh sách /sys/get_users)
+static void online_users(std::vector<std::string> &out)
+{
+    for (uint32_t id = 1; id < g_sessions.size(); id++)
+        if (!g_sessions[id].empty())
+            out.push_back(g_user_ids.name(id));
+}
+
+// ---------------- CHUNK STORE ----------------
+// --files dedup: file có key gửi kèm "dedup=1" (không relay, không stripes)
+// được cắt thành block STORE_BLOCK byte, mỗi block chỉ lưu 1 lần ở
+// upload/.store/<2 ký tự đầu>/<sha256 hex>. Trong upload/ chỉ còn danh sách
+// block "<tên>.chunks", mỗi dòng "<hash> <độ dài>". Người gửi hỏi trước
+// MSG_FILE_HAVE (danh sách hash) để biết block nào server đã có, block đó gửi
+// MSG_FILE_REF ([offset][hash]) thay cho dữ liệu; server đọc block từ kho để
+// chuyển cho người nhận. Thread ghi đĩa tự bỏ qua block đã có. Lượt gửi khác
+// (chunk tới lộn xộn khi gửi song song, client không xin) lưu file thường.
+
+std::string hex_of(const uint8_t *d, size_t n)
+{
+    static const char digits[] = "0123456789abcdef";
+    std::string out(n * 2, '0');
+    for (size_t i = 0; i < n; i++)
+    {
+        out[2 * i] = digits[d[i] >> 4];
+        out[2 * i + 1] = digits[d[i] & 15];
+    }
+    return out;
+}
+
+static std::string store_path(const std::string &hex)
+{
+    return std::string(STORE_DIR) + "/" + hex.substr(0, 2) + "/" + hex;
+}
+
+bool store_has(const std::string &hex)
+{
+    std::lock_guard<std::mutex> lk(g_store_mu);
+    return g_store.count(hex) > 0;
+}
+
+// Đọc 1 block trong kho, nối vào cuối out
+bool store_read(const std::string &hex, std::vector<uint8_t> &out)
+{
+    if (hex.size() != 2 * FILE_HASH_SIZE || !store_has(hex))
+        return false;
+    FILE *fp = fopen(store_path(hex).c_str(), "rb");
+    if (!fp)
+        return false;
+    size_t base = out.size();
+    out.resize(base + STORE_BLOCK);
+    size_t n = fread(out.data() + base, 1, STORE_BLOCK, fp);
+    fclose(fp);
+    out.resize(base + n);
+    return n > 0;
+}
+
+// Thread ghi đĩa: lưu block nếu kho chưa có, trả về hash hex ("" nếu lỗi).
+// Block ghi ra file tạm rồi đổi tên nên ai thấy hash trong g_store cũng đọc
+// được block đầy đủ.
+std::string store_put(const uint8_t *d, size_t n)
+{
+    uint8_t digest[FILE_HASH_SIZE];
+    sha256(d, n, digest);
+    std::string hex = hex_of(digest, FILE_HASH_SIZE);
+    g_stats.store_logical_bytes.fetch_add(n, std::memory_order_relaxed);
+    if (store_has(hex))
+    {
+        g_stats.store_dup_blocks.fetch_add(1, std::memory_order_relaxed);
+        return hex;
+    }
+
+    std::string path = store_path(hex), tmp = path + ".tmp";
+    FILE *fp = fopen(tmp.c_str(), "wb");
+    if (!fp)
+    {
+        std::error_code ec;
+        std::filesystem::create_directories(std::filesystem::path(path).parent_path(), ec);
+        fp = fopen(tmp.c_str(), "wb");
+    }
+    bool ok = fp && fwrite(d, 1, n, fp) == n;
+    if (fp)
+        ok = fclose(fp) == 0 && ok;
+    if (!ok || std::rename(tmp.c_str(), path.c_str()) != 0)
+    {
+        std::remove(tmp.c_str());
+        g_stats.persist_errors.fetch_add(1, std::memory_order_relaxed);
+        return "";
+    }
+    {
+        std::lock_guard<std::mutex> lk(g_store_mu);
+        g_store.insert(hex);
+    }
+    g_stats.store_blocks.fetch_add(1, std::memory_order_relaxed);
+    g_stats.store_bytes.fetch_add(n, std::memory_order_relaxed);
+    return hex;
+}
+
+// Lúc khởi động: nạp các block đã có trong kho và tổng kích thước các file
+// đã lưu để tỉ lệ chống trùng tính cả dữ liệu của lần chạy trước
+void store_load()
+{
+    std::error_code ec;
+    for (auto &e : std::filesystem::recursive_directory_iterator(STORE_DIR, ec))
+    {
+        std::string name = e.path().filename().string();
+        if (!e.is_regular_file(ec) || name.size() != 2 * FILE_HASH_SIZE)
+            continue;
+        g_store.insert(name);
+        g_stats.store_blocks++;
+        g_stats.store_bytes += e.file_size(ec);
+    }
+    for (auto &e : std::filesystem::directory_iterator("upload", ec))
+    {
+        if (e.path().extension() != ".chunks")
+            continue;
+        std::ifstream list(e.path());
+        std::string hex;
+        uint64_t len;
+        while (list >> hex >> len)
+            g_stats.store_logical_bytes += len;
+    }
+}
+
+// ---------------- PERSISTENCE ----------------
+// Trạng thái (user online, topic, user:topic) nằm trong bộ nhớ. Mọi thao tác
+// file (journal, các file .txt, file upload) chạy trên 1 thread riêng:
+// event loop chỉ đẩy PersistOp vào hàng đợi lock-free MPSC rồi đi tiếp.
+// Worker gom op trong mỗi cửa sổ PERSIST_FLUSH_MS, bỏ các cặp op triệt tiêu
+// nhau (subscribe rồi unsubscribe, online rồi offline) và ghi 1 lần.
+
+// Đẩy op vào hàng đợi (stack Treiber, worker lấy cả stack rồi đảo lại)
+void persist_push(PersistOp *op)
+{
+    op->next = g_persist_head.load(std::memory_order_relaxed);
+    while (!g_persist_head.compare_exchange_weak(op->next, op, std::memory_order_release, std::memory_order_relaxed))
+    {
+    }
+    g_stats.persist_queue_depth.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Lấy toàn bộ op đang chờ theo đúng thứ tự đã push
+PersistOp *persist_take_all()
+{
+    PersistOp *op = g_persist_head.exchange(nullptr, std::memory_order_acquire), *prev = nullptr;
+    while (op)
+    {
+        PersistOp *next = op->next;
+        op->next = prev;
+        prev = op;
+        op = next;
+    }
+    return prev;
+}
+
+// Ghi nhận thay đổi trạng thái (gọi khi đang giữ g_mu)
+void journal_append(JournalOp op, const std::string &user, const std::string &topic = "")
+{
+    PersistOp *p = new PersistOp;
+    p->kind = P_JOURNAL;
+    p->jop = op;
+    p->a = user;
+    p->b = topic;
+    persist_push(p);
+    g_state_version.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Mở file upload (offset > 0: ghi tiếp file dở); lỗi được báo lại cho người
+// gửi qua inbox của shard. stored (nếu có) nhận số byte đã ghi xuống file.
+void persist_file_open(uint64_t fileId, const std::string &path, mg_connection *c, uint32_t msgId,
+                       uint64_t offset = 0, std::shared_ptr<std::atomic<uint64_t>> stored = nullptr,
+                       bool dedup = false)
+{
+    PersistOp *p = new PersistOp;
+    p->kind = P_FILE_OPEN;
+    p->file_id = fileId;
+    p->a = path;
+    p->offset = offset;
+    p->stored = std::move(stored);
+    p->dedup = dedup;
+    p->shard = shard_of(c);
+    p->c = c;
+    p->conn_id = c->id;
+    p->msg_id = msgId;
+    p->is_ws = conn_state(c)->is_ws;
+    p->v2 = conn_state(c)->v2;
+    p->crc = conn_state(c)->crc;
+    persist_push(p);
+}
+
+// offset = UINT64_MAX: ghi nối tiếp; khác: ghi đúng vị trí (chunk gửi song song tới không theo thứ tự)
+void persist_file_write(uint64_t fileId, const uint8_t *data, size_t n, uint64_t offset = UINT64_MAX)
+{
+    PersistOp *p = new PersistOp;
+    p->kind = P_FILE_WRITE;
+    p->file_id = fileId;
+    p->offset = offset;
+    p->data.assign(data, data + n);
+    g_stats.persist_queue_bytes.fetch_add(n, std::memory_order_relaxed);
+    persist_push(p);
+}
+
+// Đĩa chậm hơn người gửi: chunk chờ ghi vượt limit byte
+static bool persist_backlogged(size_t limit = PERSIST_PENDING_LIMIT)
+{
+    return g_stats.persist_queue_bytes.load(std::memory_order_relaxed) > limit;
+}
+
+// Người gửi file không có window (client cũ) không chờ credit: khi đĩa chậm
+// thì ngừng đọc connection đang gửi, sendq_resume_timer mở lại khi hàng đợi
+// ghi đĩa vơi dưới nửa giới hạn
+static void persist_pause_src(mg_connection *c)
+{
+    if (c->is_full || !persist_backlogged())
+        return;
+    sendq_pause(c, nullptr);
+    g_stats.persist_pauses.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Block người gửi không gửi lại (MSG_FILE_REF): chỉ thêm hash vào danh sách
+void persist_file_ref(uint64_t fileId, const std::string &hex, size_t n)
+{
+    PersistOp *p = new PersistOp;
+    p->kind = P_FILE_REF;
+    p->file_id = fileId;
+    p->a = hex;
+    p->offset = n;
+    persist_push(p);
+}
+
+void persist_file_close(uint64_t fileId)
+{
+    PersistOp *p = new PersistOp;
+    p->kind = P_FILE_CLOSE;
+    p->file_id = fileId;
+    persist_push(p);
+}
+
+// Record: [op][độ dài user][độ dài topic][user][topic]
+static void journal_encode(std::string &out, JournalOp op, const std::string &user, const std::string &topic)
+{
+    uint8_t ul = (uint8_t)std::min<size_t>(user.size(), 255);
+    uint8_t tl = (uint8_t)std::min<size_t>(topic.size(), 255);
+    out.push_back((char)op);
+    out.push_back((char)ul);
+    out.push_back((char)tl);
+    out.append(user, 0, ul);
+    out.append(topic, 0, tl);
+}
+
+bool journal_open(const std::string &path)
+{
+    g_journal.fp = fopen(path.c_str(), "wb"); // reset giống các file .txt
+    g_journal.records = 0;
+    return g_journal.fp != nullptr;
+}
+
+// Ghi journal mới từ snapshot rồi thay file cũ
+bool journal_compact(const StateSnapshot &snap)
+{
+    std::string data;
+    size_t n = 0;
+    for (auto &u : snap.users)
+        journal_encode(data, J_USER_ON, u, ""), n++;
+    for (auto &t : snap.topics)
+        journal_encode(data, J_TOPIC_ADD, "", t), n++;
+    for (auto &[u, t] : snap.subs)
+        journal_encode(data, J_SUB_ADD, u, t), n++;
+
+    std::string tmp = JOURNAL_FILE + ".tmp";
+    FILE *fp = fopen(tmp.c_str(), "wb");
+    if (!fp)
+        return false;
+    bool ok = fwrite(data.data(), 1, data.size(), fp) == data.size();
+    fclose(fp);
+    if (!ok)
+        return false;
+
+    fclose(g_journal.fp);
+    std::remove(JOURNAL_FILE.c_str()); // Windows không rename đè được
+    ok = std::rename(tmp.c_str(), JOURNAL_FILE.c_str()) == 0;
+    g_journal.fp = fopen(JOURNAL_FILE.c_str(), "ab");
+    if (ok)
+        g_journal.records = n;
+    return ok && g_journal.fp;
+}
+
+// Ghi file text qua file tạm để người đọc không thấy file dở dang
+static void write_text_file(const std::string &path, const std::vector<std::string> &lines)
+{
+    std::string tmp = path + ".tmp";
+    {
+        std::ofstream ofs(tmp, std::ios::trunc);
+        for (auto &l : lines)
+            ofs << l << "\n";
+    }
+    std::remove(path.c_str());
+    std::rename(tmp.c_str(), path.c_str());
+}
+
+// Đánh dấu bỏ các op journal triệt tiêu nhau trong cùng 1 lô
+static void persist_coalesce(std::vector<PersistOp *> &ops)
+{
+    std::unordered_map<std::string, PersistOp *> subPending;          // "user\0topic" -> SUB_ADD/SUB_DEL chưa ghi
+    std::unordered_map<std::string, std::vector<std::string>> userSubs; // user -> các key trong subPending
+    std::unordered_map<std::string, PersistOp *> userOn;              // user -> USER_ON chưa ghi
+    uint64_t dropped = 0;
+    auto drop = [&](PersistOp *p) {
+        p->dead = true;
+        dropped++;
+    };
+
+    for (PersistOp *p : ops)
+    {
+        if (p->kind != P_JOURNAL)
+            continue;
+        if (p->jop == J_SUB_ADD || p->jop == J_SUB_DEL)
+        {
+            // SUB_ADD chỉ ghi khi cặp chưa có, SUB_DEL khi đã có: 2 op ngược nhau triệt tiêu
+            std::string key = p->a + '\0' + p->b;
+            auto it = subPending.find(key);
+            if (it != subPending.end())
+            {
+                drop(it->second);
+                drop(p);
+                subPending.erase(it);
+            }
+            else
+            {
+                subPending[key] = p;
+                userSubs[p->a].push_back(key);
+            }
+        }
+        else if (p->jop == J_USER_ON)
+            userOn[p->a] = p;
+        else if (p->jop == J_USER_OFF)
+        {
+            // USER_OFF xóa mọi user:topic nên các op sub trước đó của user là thừa
+            auto us = userSubs.find(p->a);
+            if (us != userSubs.end())
+            {
+                for (auto &key : us->second)
+                {
+                    auto it = subPending.find(key);
+                    if (it != subPending.end())
+                    {
+                        drop(it->second);
+                        subPending.erase(it);
+                    }
+                }
+                userSubs.erase(us);
+            }
+            // online rồi offline trong cùng lô: không cần ghi gì
+            auto on = userOn.find(p->a);
+            if (on != userOn.end())
+            {
+                drop(on->second);
+                drop(p);
+                userOn.erase(on);
+            }
+        }
+    }
+    g_stats.persist_coalesced.fetch_add(dropped, std::memory_order_relaxed);
+}
+
+// Báo lỗi mở file cho người gửi (connection có thể đã đóng: shard tự kiểm tra)
+static void persist_report_error(PersistOp *p, const char *msg)
+{
+    PacketHeader h{};
+    h.msgType = MSG_ERROR;
+    h.payloadLength = strlen(msg);
+    h.messageId = p->msg_id;
+    h.timestamp = time(nullptr);
+    h.version = PROTOCOL_VERSION;
+    set_checksum(h, msg, p->crc);
+    shard_handoff(p->shard, p->c, p->conn_id, encode_frame(h, msg, p->is_ws, p->v2));
+}
+
+// dedup: ghi 1 block vào kho và thêm vào danh sách block của file
+static void upload_block(UploadFile &u, const uint8_t *d, size_t n)
+{
+    std::string hex = store_put(d, n);
+    if (hex.empty() || fprintf(u.fp, "%s %zu\n", hex.c_str(), n) < 0)
+        g_stats.persist_errors.fetch_add(1, std::memory_order_relaxed);
+    u.pos += n;
+    u.dirty = true;
+}
+
+// dedup: tổng độ dài các block trong danh sách "<tên>.chunks" (UINT64_MAX: không mở được)
+static uint64_t chunks_size(const std::string &path)
+{
+    std::ifstream list(path);
+    if (!list)
+        return UINT64_MAX;
+    std::string hex;
+    uint64_t len, total = 0;
+    while (list >> hex >> len)
+        total += len;
+    return total;
+}
+
+// dedup: gom dữ liệu thành block đủ STORE_BLOCK byte (phần dư đợi chunk sau)
+static void upload_append(UploadFile &u, const uint8_t *d, size_t n)
+{
+    if (!u.block.empty())
+    {
+        size_t k = std::min(n, STORE_BLOCK - u.block.size());
+        u.block.insert(u.block.end(), d, d + k);
+        d += k;
+        n -= k;
+        if (u.block.size() < STORE_BLOCK)
+            return;
+        upload_block(u, u.block.data(), u.block.size());
+        u.block.clear();
+    }
+    for (; n >= STORE_BLOCK; d += STORE_BLOCK, n -= STORE_BLOCK)
+        upload_block(u, d, STORE_BLOCK);
+    u.block.assign(d, d + n);
+}
+
+// Thực hiện 1 lô op, trả về số op đã xử lý
+static size_t persist_apply(PersistOp *batch, std::unordered_map<uint64_t, UploadFile> &files)
+{
+    std::vector<PersistOp *> ops;
+    for (PersistOp *p = batch; p; p = p->next)
+        ops.push_back(p);
+    persist_coalesce(ops);
+
+    std::string rec;
+    for (PersistOp *p : ops)
+    {
+        if (p->dead)
+            continue;
+        switch (p->kind)
+        {
+        case P_JOURNAL:
+            journal_encode(rec, p->jop, p->a, p->b);
+            g_journal.records++;
+            break;
+        case P_FILE_OPEN:
+        {
+            // file dở: mở không xóa nội dung rồi ghi tiếp từ offset
+            // (dedup: danh sách block phải dài đúng offset byte, ghi nối vào cuối).
+            // File mới cùng tên: xóa tên cũ (cả 2 cách lưu) thay vì cắt file,
+            // fetch đang gửi bản cũ vẫn đọc từ fd đã mở cho tới khi xong.
+            UploadFile &u = files[p->file_id];
+            u.dedup = p->dedup;
+            if (!p->offset)
+            {
+                remove(p->a.c_str());
+                remove((p->a + ".chunks").c_str());
+            }
+            const char *err = "Cannot create file on server";
+            if (u.dedup && p->offset && chunks_size(p->a + ".chunks") != p->offset)
+                err = "Block list does not match resume offset";
+            else if (u.dedup)
+                u.fp = fopen((p->a + ".chunks").c_str(), p->offset ? "ab" : "wb");
+            else
+                u.fp = fopen(p->a.c_str(), p->offset ? "r+b" : "wb");
+            if (u.fp && p->offset && !u.dedup && file_seek(u.fp, p->offset) != 0)
+            {
+                fclose(u.fp);
+                u.fp = nullptr;
+            }
+            if (!u.fp)
+            {
+                g_stats.persist_errors.fetch_add(1, std::memory_order_relaxed);
+                persist_report_error(p, err);
+            }
+            u.pos = p->offset;
+            u.stored = std::move(p->stored);
+            break;
+        }
+        case P_FILE_WRITE:
+        {
+            auto it = files.find(p->file_id);
+            if (it == files.end() || !it->second.fp)
+                break;
+            UploadFile &u = it->second;
+            if (u.dedup)
+            {
+                upload_append(u, p->data.data(), p->data.size());
+                break;
+            }
+            // ghi theo offset: pos (phần báo cho người gửi lại) chỉ tính đoạn liền từ đầu file
+            bool at = p->offset != UINT64_MAX;
+            if ((at && file_seek(u.fp, p->offset) != 0) ||
+                fwrite(p->data.data(), 1, p->data.size(), u.fp) != p->data.size())
+                g_stats.persist_errors.fetch_add(1, std::memory_order_relaxed);
+            if (at)
+                range_add(u.pos, u.got, p->offset, p->offset + p->data.size());
+            else
+                u.pos += p->data.size();
+            u.dirty = true;
+            break;
+        }
+        case P_FILE_REF:
+        {
+            auto it = files.find(p->file_id);
+            if (it == files.end() || !it->second.fp)
+                break;
+            UploadFile &u = it->second;
+            if (!u.block.empty())
+            {
+                // block không thẳng hàng với phần đang gom: đọc lại dữ liệu
+                std::vector<uint8_t> data;
+                if (store_read(p->a, data))
+                    upload_append(u, data.data(), data.size());
+                else
+                    g_stats.persist_errors.fetch_add(1, std::memory_order_relaxed);
+                break;
+            }
+            fprintf(u.fp, "%s %zu\n", p->a.c_str(), (size_t)p->offset);
+            g_stats.store_logical_bytes.fetch_add(p->offset, std::memory_order_relaxed);
+            g_stats.store_dup_blocks.fetch_add(1, std::memory_order_relaxed);
+            u.pos += p->offset;
+            u.dirty = true;
+            break;
+        }
+        case P_FILE_CLOSE:
+        {
+            auto it = files.find(p->file_id);
+            if (it != files.end())
+            {
+                if (it->second.fp && !it->second.block.empty())
+                    upload_block(it->second, it->second.block.data(), it->second.block.size());
+                if (it->second.fp)
+                    fclose(it->second.fp);
+                if (it->second.stored && it->second.fp)
+                    it->second.stored->store(it->second.pos, std::memory_order_release);
+                files.erase(it);
+            }
+            break;
+        }
+        }
+    }
+    // journal: 1 lần ghi cho cả lô
+    if (!rec.empty() && g_journal.fp)
+    {
+        fwrite(rec.data(), 1, rec.size(), g_journal.fp);
+        fflush(g_journal.fp);
+    }
+
+    // file upload có key: flush rồi báo số byte đã nằm trên đĩa để gửi lại
+    // cho người nhận xin tiếp tục
+    for (auto &[id, u] : files)
+    {
+        if (!u.dirty || !u.stored)
+            continue;
+        fflush(u.fp);
+        u.stored->store(u.pos, std::memory_order_release);
+        u.dirty = false;
+    }
+
+    for (PersistOp *p : ops)
+    {
+        if (p->kind == P_FILE_WRITE)
+            g_stats.persist_queue_bytes.fetch_sub(p->data.size(), std::memory_order_relaxed);
+        delete p;
+    }
+    return ops.size();
+}
+
+// Thread ghi đĩa: xử lý hàng đợi, cập nhật online.txt / topics.txt /
+// user_topics.txt khoảng mỗi giây và nén journal khi cần
+void persist_loop()
+{
+    using Clock = std::chrono::steady_clock;
+    std::unordered_map<uint64_t, UploadFile> files; // file_id -> file upload đang ghi
+    uint64_t lastVersion = 0;
+    auto lastViews = Clock::now();
+
+    for (;;)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(PERSIST_FLUSH_MS));
+
+        uint64_t v = g_state_version.load(std::memory_order_relaxed);
+        bool viewsDue = v != lastVersion && Clock::now() - lastViews >= std::chrono::seconds(1);
+        StateSnapshot snap;
+        PersistOp *batch;
+        if (viewsDue)
+        {
+            // chụp state và lấy hàng đợi trong cùng 1 lock: mọi op trong lô
+            // đã có trong snapshot, op đến sau sẽ ghi vào journal mới
+            std::shared_lock<std::shared_mutex> lk(g_mu);
+            online_users(snap.users);
+            snap.topics.assign(g_topics.begin(), g_topics.end());
+            for (auto &[u, ts] : g_user_topics)
+                for (auto &t : ts)
+                    snap.subs.emplace_back(u, t);
+            batch = persist_take_all();
+        }
+        else
+            batch = persist_take_all();
+
+        if (batch)
+        {
+            auto t0 = Clock::now();
+            size_t n = persist_apply(batch, files);
+            uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - t0).count();
+            g_stats.persist_queue_depth.fetch_sub(n, std::memory_order_relaxed);
+            g_stats.persist_ops.fetch_add(n, std::memory_order_relaxed);
+            g_stats.persist_batches.fetch_add(1, std::memory_order_relaxed);
+            g_stats.persist_flush_us.fetch_add(us, std::memory_order_relaxed);
+            if (us > g_stats.persist_flush_us_max.load(std::memory_order_relaxed))
+                g_stats.persist_flush_us_max.store(us, std::memory_order_relaxed);
+        }
+
+        if (viewsDue)
+        {
+            lastVersion = v;
+            lastViews = Clock::now();
+            std::vector<std::string> subLines;
+            for (auto &[u, t] : snap.subs)
+                subLines.push_back(u + ":" + t);
+            write_text_file(ONLINE_FILE, snap.users);
+            write_text_file(TOPICS_FILE, snap.topics);
+            write_text_file(USER_TOPIC_FILE, subLines);
+
+            size_t live = snap.users.size() + snap.topics.size() + snap.subs.size();
+            if (g_journal.records > std::max(JOURNAL_MIN_COMPACT, 2 * live) && !journal_compact(snap))
+                std::cout << "Journal compaction failed\n";
+        }
+    }
+}
+
+// ---------------- DIRECTORY ----------------
+// Danh sách user online / topic cho client, không cần đọc file của server:
+// - /sys/get_users, /sys/get_topics: payload "cursor=<tên cuối trang trước>;limit=<n>"
+//   trả về trang "version=V;total=N;next=<cursor>\n" + mỗi dòng 1 tên (next rỗng = hết).
+//   Payload rỗng ở /sys/get_users giữ kiểu cũ: toàn bộ danh sách, không có dòng đầu.
+// - Subscribe /sys/dir để nhận thay đổi dạng "V +u alice" / "V -u alice" / "V +t topic".
+// Snapshot đã sắp xếp được cache, chỉ dựng lại khi danh sách đổi.
+// Các hàm đọc chạy với g_mu shared, dir_publish với g_mu độc quyền.
+
+// Topic hệ thống không nằm trong danh sách topic
+bool is_sys_topic(const std::string &topic)
+{
+    return topic.compare(0, 5, "/sys/") == 0;
+}
+
+// Ghi nhận thay đổi và đẩy cho các subscriber của /sys/dir
+void dir_publish(DirList list, bool added, const std::string &name)
+{
+    g_dir_version++;
+    g_dir_changed[list] = g_dir_version;
+
+    auto subs = conns_of(false, TID_DIR);
+    if (!subs)
+        return;
+    std::string msg = std::to_string(g_dir_version) + (added ? " +" : " -") + (list == DIR_USERS ? "u " : "t ") + name;
+    PacketHeader ph{};
+    ph.msgType = MSG_PUBLISH_TEXT;
+    ph.payloadLength = (uint32_t)msg.size();
+    ph.timestamp = time(nullptr);
+    ph.version = PROTOCOL_VERSION;
+    strncpy(ph.topic, DIR_TOPIC, MAX_TOPIC_LEN - 1);
+    send_fanout(*subs, ph, msg.data(), nullptr);
+    g_stats.dir_deltas.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Snapshot đã sắp xếp của danh sách, dựng lại nếu danh sách đã đổi
+std::shared_ptr<const DirSnapshot> dir_snapshot(DirList list)
+{
+    std::lock_guard<std::mutex> lk(g_dir_mu);
+    auto &cache = g_dir_cache[list];
+    if (cache && cache->version >= g_dir_changed[list])
+        return cache;
+
+    auto snap = std::make_shared<DirSnapshot>();
+    snap->version = g_dir_version;
+    if (list == DIR_USERS)
+        online_users(snap->items);
+    else
+        snap->items.assign(g_topics.begin(), g_topics.end());
+    std::sort(snap->items.begin(), snap->items.end());
+    for (auto &s : snap->items)
+        snap->joined += s + "\n";
+    g_stats.dir_rebuilds.fetch_add(1, std::memory_order_relaxed);
+    cache = snap;
+    return cache;
+}
+
+// Trả 1 trang danh sách theo cursor + limit
+std::string dir_page(DirList list, const std::string &request)
+{
+    auto snap = dir_snapshot(list);
+    auto opts = parse_kv(request);
+    size_t limit = DIR_PAGE_DEFAULT;
+    if (opts.count("limit"))
+        limit = std::min<size_t>(std::max(1L, atol(opts["limit"].c_str())), DIR_PAGE_MAX);
+
+    auto &items = snap->items;
+    auto first = opts.count("cursor") ? std::upper_bound(items.begin(), items.end(), opts["cursor"]) : items.begin();
+    auto last = first + std::min<size_t>(limit, items.end() - first);
+    std::string next = last != items.end() && last != first ? *(last - 1) : "";
+
+    std::string out = "version=" + std::to_string(g_dir_version) + ";total=" + std::to_string(items.size()) +
+                      ";next=" + next + "\n";
+    for (auto it = first; it != last; ++it)
+        out += *it + "\n";
+    return out;
+}
+
+// ---------------- SESSION REGISTRY ----------------
+// g_sessions là nguồn duy nhất cho trạng thái online: mỗi user có thể
+// login từ nhiều connection, user offline khi session cuối cùng đóng.
+
+// Thêm session, trả về true nếu đây là session đầu tiên của user
+bool session_add(uint32_t uid, mg_connection *c)
+{
+    if (uid >= g_sessions.size())
+        g_sessions.resize(uid + 1);
+    auto &conns = g_sessions[uid];
+    if (std::find(conns.begin(), conns.end(), c) == conns.end())
+        conns.push_back(c);
+    return conns.size() == 1;
+}
+
+// Xóa session, trả về true nếu user không còn session nào
+bool session_remove(uint32_t uid, mg_connection *c)
+{
+    if (uid >= g_sessions.size() || g_sessions[uid].empty())
+        return false;
+    auto &conns = g_sessions[uid];
+    auto pos = std::find(conns.begin(), conns.end(), c);
+    if (pos != conns.end())
+    {
+        *pos = conns.back();
+        conns.pop_back();
+    }
+    return conns.empty();
+}
+
+// Kết thúc session của connection (logout hoặc close)
+void session_end(mg_connection *c, Client &cli)
+{
+    if (cli.username.empty())
+        return;
+    // user offline khi đã rời hết mọi session
+    if (session_remove(cli.uid, c))
+    {
+        g_user_topics.erase(cli.username);
+        journal_append(J_USER_OFF, cli.username);
+        dir_publish(DIR_USERS, false, cli.username);
+    }
+    cli.username.clear();
+    cli.uid = 0;
+}
+
+// ---------------- TOPIC INDEX ----------------
+// g_topic_subs là index ngược của Client::topics (theo id topic), để fanout
+// chỉ tốn O(số subscriber của topic) thay vì duyệt toàn bộ g_clients.
+
+// Subscribe connection vào topic (cập nhật cả Client::topics lẫn index)
+void topic_subscribe(mg_connection *c, Client &cli, uint32_t tid)
+{
+    if (tid >= g_topic_subs.size())
+        g_topic_subs.resize(tid + 1);
+    if (cli.topics.insert(tid).second)
+        g_topic_subs[tid].push_back(c);
+}
+
+// Bỏ connection khỏi danh sách subscriber của topic
+void topic_index_remove(uint32_t tid, mg_connection *c)
+{
+    if (tid >= g_topic_subs.size())
+        return;
+    auto &subs = g_topic_subs[tid];
+    auto pos = std::find(subs.begin(), subs.end(), c);
+    if (pos != subs.end())
+    {
+        *pos = subs.back(); // thứ tự subscriber không quan trọng
+        subs.pop_back();
+    }
+}
+
+// Unsubscribe connection khỏi topic
+void topic_unsubscribe(mg_connection *c, Client &cli, uint32_t tid)
+{
+    if (cli.topics.erase(tid))
+        topic_index_remove(tid, c);
+}
+
+// Xóa connection khỏi mọi topic (logout / close)
+void topic_unsubscribe_all(mg_connection *c, Client &cli)
+{
+    for (auto &t : cli.topics)
+        topic_index_remove(t, c);
+    cli.topics.clear();
+}
+
+// Gửi text game/private/topic
+void send_game_text(mg_connection *c, const std::string &topic, const std::string &text)
+{
+    PacketHeader h{};
+    h.msgType = MSG_PUBLISH_TEXT;
+    h.payloadLength = (uint32_t)text.size();
+    h.timestamp = time(nullptr);
+    h.version = PROTOCOL_VERSION;
+    strncpy(h.topic, topic.c_str(), MAX_TOPIC_LEN - 1);
+    send_packet(c, h, text.data());
+}
+
+// Gửi private message
+void send_private(uint32_t uid, PacketHeader &h, const void *payload)
+{
+    if (auto conns = conns_of(true, uid))
+        send_fanout(*conns, h, payload, nullptr);
+}
+
+// Broadcast tới tất cả subscriber của topic (ngoại trừ sender)
+void broadcast_topic(uint32_t tid, PacketHeader &h, const void *payload, mg_connection *src)
+{
+    if (auto subs = conns_of(false, tid))
+        send_fanout(*subs, h, payload, src);
+}
+
+// Bộ đếm dạng "key=value" mỗi dòng
+std::string stats_text()
+{
+    std::string out;
+    auto add = [&](const char *k, uint64_t v) { out += std::string(k) + "=" + std::to_string(v) + "\n"; };
+    add("frames_encoded", g_stats.frames_encoded);
+    add("checksum_bytes", g_stats.checksum_bytes);
+    add("crc_errors", g_stats.crc_errors);
+    add("bytes_copied", g_stats.bytes_copied);
+    add("bytes_direct", g_stats.bytes_direct);
+    add("writev_calls", g_stats.writev_calls);
+    add("packets_in", g_stats.packets_in);
+    add("batch_frames", g_stats.batch_frames);
+    add("batch_messages", g_stats.batch_messages);
+    add("batch_acks_merged", g_stats.batch_acks_merged);
+    add("persist_queue_depth", g_stats.persist_queue_depth);
+    add("persist_queue_bytes", g_stats.persist_queue_bytes);
+    add("persist_pauses", g_stats.persist_pauses);
+    add("persist_ops", g_stats.persist_ops);
+    add("persist_coalesced", g_stats.persist_coalesced);
+    add("persist_batches", g_stats.persist_batches);
+    add("persist_flush_us", g_stats.persist_flush_us);
+    add("persist_flush_us_max", g_stats.persist_flush_us_max);
+    add("persist_errors", g_stats.persist_errors);
+    add("dir_rebuilds", g_stats.dir_rebuilds);
+    add("dir_deltas", g_stats.dir_deltas);
+    add("file_bytes_relayed", g_stats.file_bytes_relayed);
+    add("file_bytes_archived", g_stats.file_bytes_archived);
+    add("file_acks", g_stats.file_acks);
+    add("file_credit_stalls", g_stats.file_credit_stalls);
+    add("file_resumes", g_stats.file_resumes);
+    add("file_backfill_bytes", g_stats.file_backfill_bytes);
+    add("file_ref_bytes", g_stats.file_ref_bytes);
+    add("file_hash_ok", g_stats.file_hash_ok);
+    add("file_hash_bad", g_stats.file_hash_bad);
+    add("file_hash_unverified", g_stats.file_hash_unverified);
+    add("file_stripe_joins", g_stats.file_stripe_joins);
+    add("file_striped", g_stats.file_striped);
+    add("compress_in_bytes", g_stats.compress_in_bytes);
+    add("compress_out_bytes", g_stats.compress_out_bytes);
+    add("compress_skipped", g_stats.compress_skipped);
+    add("compress_reused", g_stats.compress_reused);
+    add("compress_us", g_stats.compress_us);
+    add("decompress_bytes", g_stats.decompress_bytes);
+    add("decompress_us", g_stats.decompress_us);
+    add("fetches", g_stats.fetches);
+    add("fetch_bytes", g_stats.fetch_bytes);
+    add("fetch_read_bytes", g_stats.fetch_read_bytes);
+    add("store_blocks", g_stats.store_blocks);
+    add("store_bytes", g_stats.store_bytes);
+    add("store_logical_bytes", g_stats.store_logical_bytes);
+    add("store_dup_blocks", g_stats.store_dup_blocks);
+    if (g_stats.store_bytes)
+    {
+        char ratio[32];
+        snprintf(ratio, sizeof(ratio), "%.2f", (double)g_stats.store_logical_bytes / g_stats.store_bytes);
+        out += std::string("store_dedup_ratio=") + ratio + "\n";
+    }
+    add("sendq_drops", g_stats.sendq_drops);
+    add("sendq_drop_bytes", g_stats.sendq_drop_bytes);
+    add("sendq_pauses", g_stats.sendq_pauses);
+    add("sendq_paused", (uint64_t)g_sendq_paused.load());
+    add("sendq_spills", g_stats.sendq_spills);
+    add("sendq_spill_bytes", g_stats.sendq_spill_bytes);
+    add("sendq_disconnects", g_stats.sendq_disconnects);
+    add("cpu_us", (uint64_t)((double)clock() * 1e6 / CLOCKS_PER_SEC));
+    return out;
+}
+
+// Hàng đợi gửi của từng connection, nhiều byte chờ nhất trước. Payload
+// "limit=<n>" giới hạn số dòng. Mỗi dòng:
+// "conn=<shard>:<id> user=<tên> pending=<byte> peak=<byte> actions=<n> caps=<hex>"
+std::string queues_text(const std::string &request)
+{
+    auto kv = parse_kv(request);
+    size_t limit = kv.count("limit") ? (size_t)atol(kv["limit"].c_str()) : DIR_PAGE_DEFAULT;
+    limit = std::min(std::max<size_t>(limit, 1), DIR_PAGE_MAX);
+
+    std::vector<std::pair<size_t, mg_connection *>> rows;
+    rows.reserve(g_clients.size());
+    for (auto &[c, cli] : g_clients)
+        rows.push_back({conn_state(c)->pending.load(std::memory_order_relaxed), c});
+    size_t n = std::min(limit, rows.size());
+    std::partial_sort(rows.begin(), rows.begin() + n, rows.end(),
+                      [](const auto &a, const auto &b) { return a.first > b.first; });
+
+    std::string out;
+    for (size_t i = 0; i < n; i++)
+    {
+        mg_connection *c = rows[i].second;
+        ConnState *st = conn_state(c);
+        out += "conn=" + std::to_string(shard_of(c)->index) + ":" + std::to_string(c->id) +
+               " user=" + g_clients.at(c).username +
+               " pending=" + std::to_string(rows[i].first) +
+               " peak=" + std::to_string(st->peak.load(std::memory_order_relaxed)) +
+               " actions=" + std::to_string(st->actions.load(std::memory_order_relaxed));
+        char caps[16];
+        snprintf(caps, sizeof(caps), " caps=%x\n", (unsigned)st->caps);
+        out += caps;
+    }
+    return out;
+}
+
+// ---------------- FILE CREDIT ----------------
+// Người gửi xin "window=N" khi mở file: được gửi tối đa W chunk chưa ACK.
+// Server không ACK từng chunk mà gửi ACK cộng dồn "acked=<số chunk>" sau
+// mỗi nửa cửa sổ. Khi người nhận còn quá nhiều byte chưa gửi được (hoặc file
+// lưu trên server mà đĩa ghi không kịp), server giữ ACK lại (người gửi tự
+// dừng) và timer của shard kiểm tra lại sau.
+
+// Số byte chờ gửi lớn nhất trong các người nhận của file
+size_t file_recipients_pending(const IncomingFile &f)
+{
+    const std::vector<mg_connection *> *conns = conns_of(f.is_private, f.target_id);
+    size_t most = 0;
+    if (conns)
+        for (mg_connection *c : *conns)
+            if (c != f.src)
+                most = std::max(most, conn_state(c)->pending.load(std::memory_order_relaxed));
+    // chunk đi qua connection phụ của người nhận
+    if (conns && !g_rx_data.empty())
+        for (mg_connection *c : *conns)
+        {
+            auto rx = g_rx_data.find(c);
+            if (rx != g_rx_data.end())
+                for (mg_connection *d : rx->second)
+                    most = std::max(most, conn_state(d)->pending.load(std::memory_order_relaxed));
+        }
+    return most;
+}
+
+// Gửi ACK cộng dồn khi đủ nửa cửa sổ (hoặc force ở chunk cuối)
+void file_credit(uint32_t msgId, IncomingFile &f, bool force)
+{
+    if (f.received == f.acked)
+        return;
+    if (!force)
+    {
+        if (f.received - f.acked < std::max<uint32_t>(1, f.window / 2))
+            return;
+        if (file_recipients_pending(f) > FILE_PENDING_LIMIT || (!f.relay && persist_backlogged()))
+        {
+            if (!f.stalled)
+            {
+                f.stalled = true;
+                g_files_stalled.fetch_add(1, std::memory_order_relaxed);
+                g_stats.file_credit_stalls.fetch_add(1, std::memory_order_relaxed);
+            }
+            return;
+        }
+    }
+    if (f.stalled)
+    {
+        f.stalled = false;
+        g_files_stalled.fetch_sub(1, std::memory_order_relaxed);
+    }
+    f.acked = f.received;
+    send_ack(f.src, msgId, "acked=" + std::to_string(f.acked));
+    g_stats.file_acks.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Timer của shard: thử cấp lại credit cho các file đang bị giữ
+void file_credit_timer(void *arg)
+{
+    Shard *s = (Shard *)arg;
+    if (g_files_stalled.load(std::memory_order_relaxed) == 0)
+        return;
+    std::unique_lock<std::shared_mutex> lk(g_mu);
+    for (auto &[key, f] : g_files)
+        if (f.stalled && shard_of(f.src) == s)
+            file_credit(f.msg_id, f, false);
+}
+
+// Bỏ 1 lượt gửi đang mở: đóng file upload, file có key thì giữ manifest
+// để người gửi nối lại sau
+static std::unordered_map<std::string, IncomingFile>::iterator file_detach(std::unordered_map<std::string, IncomingFile>::iterator it)
+{
+    if (it->second.stalled)
+        g_files_stalled.fetch_sub(1, std::memory_order_relaxed);
+    if (!it->second.relay)
+        persist_file_close(it->second.file_id);
+    g_transfers.erase(it->second.transfer);
+    auto m = g_manifests.find(it->second.manifest);
+    if (m != g_manifests.end())
+    {
+        m->second.active = false;
+        m->second.touched = time(nullptr);
+    }
+    return g_files.erase(it);
+}
+
+// Connection đóng: bỏ các file nó đang gửi dở
+void file_drop_sender(mg_connection *c)
+{
+    for (auto it = g_files.begin(); it != g_files.end();)
+        it = it->second.src == c ? file_detach(it) : std::next(it);
+}
+
+// ---------------- FILE STRIPES ----------------
+// File có key gửi được song song trên nhiều connection:
+// - người gửi xin "stripes=K" khi mở file, ACK trả "stripes=K';transfer=<mã>".
+//   Người gửi mở K' connection TCP phụ, mỗi connection gửi MSG_FILE_JOIN
+//   "transfer=<mã>" rồi gửi FILE_DATA (cùng messageId) cho các đoạn rời nhau.
+//   Server nhận chunk theo offset bất kỳ, ghi đúng chỗ và ACK credit trên
+//   connection chính. LAST gửi trên connection chính sau khi đủ ACK.
+// - ACK login (payload "caps=...") có "rx=<mã>" riêng cho connection đó.
+//   Người nhận mở connection phụ bằng MSG_FILE_JOIN "rx=<mã>": chunk của file
+//   có key gửi tới session đó chia đều lên các connection này. Session khác
+//   của cùng user (không có connection phụ) vẫn nhận trên connection chính.
+// Chat trên connection chính không phải xếp sau dữ liệu file.
+
+// Connection nhận packet của file gửi tới target, mỗi session 1 lần. idx: số
+// thứ tự chunk (chọn connection phụ idx % K của session), SIZE_MAX: thông báo
+// file, gửi trên mọi connection phụ (không gửi connection chính) để connection
+// nào cũng biết file trước chunk của nó. Session không có CAP_KEYED_FILES vào
+// plain: nhận dạng file không key trên connection chính.
+static void file_targets(bool is_private, uint32_t target, mg_connection *skip, size_t idx,
+                         std::vector<mg_connection *> &out, std::vector<mg_connection *> &plain)
+{
+    auto conns = conns_of(is_private, target);
+    if (!conns)
+        return;
+    for (mg_connection *c : *conns)
+    {
+        if (c == skip)
+            continue;
+        if (!(conn_state(c)->caps & CAP_KEYED_FILES))
+        {
+            plain.push_back(c);
+            continue;
+        }
+        auto rx = g_rx_data.find(c);
+        if (rx == g_rx_data.end())
+            out.push_back(c);
+        else if (idx == SIZE_MAX)
+            out.insert(out.end(), rx->second.begin(), rx->second.end());
+        else
+            out.push_back(rx->second[idx % rx->second.size()]);
+    }
+}
+
+// Mọi người nhận hiện tại đều có CAP_KEYED_FILES (nhận được chunk theo offset bất kỳ)
+static bool file_targets_keyed(bool is_private, uint32_t target, mg_connection *skip)
+{
+    if (auto conns = conns_of(is_private, target))
+        for (mg_connection *c : *conns)
+            if (c != skip && !(conn_state(c)->caps & CAP_KEYED_FILES))
+                return false;
+    return true;
+}
+
+// Gửi packet của file có key tới người nhận (idx như file_targets). Người nhận
+// không có CAP_KEYED_FILES nhận plain (plain_len byte: thông báo chỉ có tên,
+// chunk bỏ offset, LAST rỗng), plain null thì không nhận gì.
+static void file_forward(bool is_private, uint32_t target, PacketHeader &h, const void *payload,
+                         mg_connection *skip, size_t idx, const void *plain, uint32_t plain_len)
+{
+    std::vector<mg_connection *> conns, legacy;
+    file_targets(is_private, target, skip, idx, conns, legacy);
+    send_fanout(conns, h, payload, nullptr);
+    if (!plain || legacy.empty())
+        return;
+    PacketHeader ph = h;
+    ph.payloadLength = plain_len;
+    send_fanout(legacy, ph, plain, nullptr);
+}
+
+// MSG_FILE_JOIN: "transfer=<mã>" (connection phụ của người gửi) hoặc "rx=<mã>"
+// (connection phụ nhận file của session có mã trong ACK login)
+void file_join_request(mg_connection *c, Client &cli, PacketHeader &h, const uint8_t *payload)
+{
+    auto kv = parse_kv(std::string((const char *)payload, h.payloadLength));
+    if (!cli.username.empty() || !cli.transfer.empty() || cli.rx_main)
+    {
+        send_error(c, h.messageId, "Connection da dung cho viec khac");
+        return;
+    }
+    if (kv.count("transfer"))
+    {
+        if (!g_transfers.count(kv["transfer"]))
+        {
+            send_error(c, h.messageId, "Khong tim thay luot gui file");
+            return;
+        }
+        cli.transfer = kv["transfer"];
+    }
+    else if (kv.count("rx"))
+    {
+        auto main = g_rx_codes.find(kv["rx"]);
+        if (main == g_rx_codes.end())
+        {
+            send_error(c, h.messageId, "Session khong ton tai hoac da dong");
+            return;
+        }
+        cli.rx_main = main->second;
+        g_rx_data[cli.rx_main].push_back(c);
+    }
+    else
+    {
+        send_error(c, h.messageId, "Thieu transfer hoac rx");
+        return;
+    }
+    g_stats.file_stripe_joins.fetch_add(1, std::memory_order_relaxed);
+    login_options(c, h, payload);
+}
+
+// Connection đóng / logout / login tên khác: connection phụ nhận file rời
+// session của nó, connection chính thì bỏ mã và các connection phụ (chúng
+// không nhận gì nữa)
+void file_rx_drop(mg_connection *c, Client &cli)
+{
+    auto it = g_rx_data.find(cli.rx_main);
+    if (it != g_rx_data.end())
+    {
+        auto &v = it->second;
+        v.erase(std::remove(v.begin(), v.end(), c), v.end());
+        if (v.empty())
+            g_rx_data.erase(it);
+    }
+    cli.rx_main = nullptr;
+    if (cli.rx_code.empty())
+        return;
+    g_rx_codes.erase(cli.rx_code);
+    cli.rx_code.clear();
+    it = g_rx_data.find(c);
+    if (it == g_rx_data.end())
+        return;
+    for (mg_connection *d : it->second)
+    {
+        auto cl = g_clients.find(d);
+        if (cl != g_clients.end())
+            cl->second.rx_main = nullptr;
+    }
+    g_rx_data.erase(it);
+}
+
+// ---------------- FILE RESUME ----------------
+// File gửi kèm "key=<key ổn định>;size=<byte>" dùng chunk có offset: 8 byte
+// đầu payload FILE_DATA là vị trí của chunk trong file. Server giữ manifest
+// (đã nhận bao nhiêu byte, đã lưu bao nhiêu) theo người gửi + key:
+// - người gửi rớt mạng rồi gửi lại MSG_PUBLISH_FILE cùng key/size: ACK trả
+//   "offset=<byte server đã có>", người gửi đọc file tiếp từ đó
+// - người nhận gửi MSG_FILE_RESUME "from=<người gửi>;key=<key>;offset=<byte
+//   đã có>": server gửi lại phần đã lưu trong upload/ rồi người nhận nhận
+//   tiếp trực tiếp từ người gửi. Chunk nào cũng có offset nên người nhận ghi
+//   đúng chỗ dù chunk gửi lại và chunk mới xen kẽ nhau.
+// Manifest không có thay đổi sau FILE_MANIFEST_TTL giây thì bị bỏ.
+
+// Người gửi của file: username đã login, chưa login thì lấy từ header
+std::string file_owner(const Client &cli, const PacketHeader &h)
+{
+    return cli.username.empty() ? std::string(h.sender) : cli.username;
+}
+
+// Bỏ các manifest hết hạn (không còn người gửi)
+void manifest_sweep(time_t now)
+{
+    for (auto it = g_manifests.begin(); it != g_manifests.end();)
+    {
+        if (!it->second.active && now - it->second.touched > FILE_MANIFEST_TTL)
+            it = g_manifests.erase(it);
+        else
+            ++it;
+    }
+}
+
+// Header dùng để gửi packet của file tới người nhận
+static PacketHeader manifest_header(const FileManifest &m, uint32_t type)
+{
+    PacketHeader h{};
+    h.msgType = type;
+    h.messageId = m.msg_id;
+    h.timestamp = time(nullptr);
+    h.version = PROTOCOL_VERSION;
+    h.flags = m.is_private ? FLAG_PRIVATE : FLAG_GROUP;
+    strncpy(h.sender, m.sender.c_str(), MAX_USERNAME_LEN - 1);
+    strncpy(h.topic, m.target.c_str(), MAX_TOPIC_LEN - 1);
+    return h;
+}
+
+// Thông báo file cho người nhận: "tên file\0key=...;size=...[;hash=xxh64]"
+static std::string manifest_notice(const FileManifest &m)
+{
+    return m.filename + '\0' + "key=" + m.key + ";size=" + std::to_string(m.size) + (m.hashed ? ";hash=xxh64" : "");
+}
+
+// LAST của file có hash: so hash cả file của người gửi (t, n byte sau offset)
+// với hash server tính dần. Sai thì bỏ lượt gửi, lùi manifest về đoạn sai đầu
+// tiên (kho chống trùng: về 0 vì danh sách block chỉ ghi nối) và báo lỗi kèm
+// offset để người gửi gửi lại phần đó; người nhận không nhận LAST. Trả về true
+// nếu đã bỏ lượt gửi; khớp thì verdict là ACK gửi người gửi sau LAST.
+static bool file_hash_check(std::unordered_map<std::string, IncomingFile>::iterator it, FileManifest &m,
+                            const uint8_t *t, size_t n, std::string &verdict)
+{
+    if (!m.hashed || !n)
+        return false;
+    IncomingFile &f = it->second;
+    uint64_t bad = m.hash.verify(t, n);
+    if (bad == m.size || bad == UINT64_MAX)
+    {
+        (bad == m.size ? g_stats.file_hash_ok : g_stats.file_hash_unverified).fetch_add(1, std::memory_order_relaxed);
+        m.hash_trailer.assign((const char *)t, n);
+        verdict = bad == m.size ? "hash=ok" : "hash=unverified";
+        return false;
+    }
+    g_stats.file_hash_bad.fetch_add(1, std::memory_order_relaxed);
+    // trailer hỏng: dữ liệu không bị nghi, người gửi gửi lại từ offset server
+    // đang có (đủ file thì chỉ còn LAST kèm hash tính lại)
+    bool trailer = bad == FILE_HASH_BAD_TRAILER;
+    if (trailer)
+        bad = m.received;
+    else if (f.dedup)
+        bad = 0;
+    m.received = std::min(m.received, bad);
+    m.complete = false;
+    m.active = false;
+    std::string msg = std::string(trailer ? "Hash file sai dang" : "Hash file khong khop") +
+                      ", gui lai tu offset=" + std::to_string(m.received);
+    send_error(f.src, f.msg_id, msg.c_str());
+    if (!f.relay)
+        persist_file_close(f.file_id);
+    g_transfers.erase(f.transfer);
+    g_files.erase(it);
+    return true;
+}
+
+// Đọc n byte từ b.off của file đã lưu (file thường hoặc các block trong kho)
+static bool backfill_read(Backfill &b, uint8_t *dst, size_t n)
+{
+    if (!b.chunked)
+        return fread(dst, 1, n, b.fp) == n;
+    uint64_t off = b.off;
+    while (n)
+    {
+        // block hiện tại không chứa off: đọc dòng tiếp theo của danh sách
+        while (off >= b.blk_off + b.blk_len)
+        {
+            char hex[80];
+            unsigned long long len;
+            clearerr(b.fp); // thread ghi đĩa có thể vừa ghi thêm
+            if (fscanf(b.fp, "%79s %llu", hex, &len) != 2)
+                return false;
+            b.blk_off += b.blk_len;
+            b.blk_len = len;
+            b.blk_hex = hex;
+            b.blk.clear();
+        }
+        if (b.blk.empty() && !store_read(b.blk_hex, b.blk))
+            return false;
+        size_t k = (size_t)std::min<uint64_t>(n, b.blk_off + b.blk.size() - off);
+        memcpy(dst, b.blk.data() + (off - b.blk_off), k);
+        dst += k;
+        off += k;
+        n -= k;
+    }
+    return true;
+}
+
+// Gửi tiếp 1 phần file cho người nhận, trả về true khi xong (hoặc phải dừng)
+static bool file_backfill_step(Shard &s, Backfill &b)
+{
+    auto it = s.live.find(b.id);
+    if (it == s.live.end() || it->second != b.c)
+        return true; // người nhận đã đóng
+    PacketHeader h;
+    uint64_t avail, size;
+    bool complete;
+    std::string trailer;
+    {
+        std::shared_lock<std::shared_mutex> lk(g_mu);
+        auto m = g_manifests.find(b.manifest);
+        if (m == g_manifests.end() || !m->second.stored)
+            return true;
+        h = manifest_header(m->second, MSG_FILE_DATA);
+        avail = std::min(b.end, m->second.stored->load(std::memory_order_acquire));
+        size = m->second.size;
+        complete = m->second.complete;
+        trailer = m->second.hash_trailer;
+    }
+
+    std::vector<uint8_t> buf;
+    while (b.off < avail && conn_state(b.c)->pending.load(std::memory_order_relaxed) < FILE_PENDING_LIMIT)
+    {
+        size_t n = (size_t)std::min<uint64_t>(FILE_BACKFILL_CHUNK, avail - b.off);
+        buf.resize(FILE_OFFSET_SIZE + n);
+        memcpy(buf.data(), &b.off, FILE_OFFSET_SIZE);
+        if (!backfill_read(b, buf.data() + FILE_OFFSET_SIZE, n))
+        {
+            send_error(b.c, h.messageId, "Loi doc file tren server");
+            return true;
+        }
+        h.payloadLength = (uint32_t)buf.size();
+        send_packet(b.c, h, buf.data());
+        b.off += n;
+        g_stats.file_backfill_bytes.fetch_add(n, std::memory_order_relaxed);
+    }
+    if (b.off < b.end)
+        return false;
+
+    // file đã xong: báo LAST (offset = kích thước file, kèm hash cả file nếu có)
+    if (complete)
+    {
+        buf.resize(FILE_OFFSET_SIZE);
+        memcpy(buf.data(), &size, FILE_OFFSET_SIZE);
+        buf.insert(buf.end(), trailer.begin(), trailer.end());
+        h.flags |= FLAG_LAST;
+        h.payloadLength = (uint32_t)buf.size();
+        send_packet(b.c, h, buf.data());
+    }
+    return true;
+}
+
+// Timer của shard: gửi tiếp các file đang gửi lại, mỗi lượt tới khi người
+// nhận còn FILE_PENDING_LIMIT byte chưa gửi
+void file_backfill_timer(void *arg)
+{
+    Shard *s = (Shard *)arg;
+    for (size_t i = 0; i < s->backfills.size();)
+    {
+        if (!file_backfill_step(*s, s->backfills[i]))
+        {
+            i++;
+            continue;
+        }
+        if (s->backfills[i].fp)
+            fclose(s->backfills[i].fp);
+        s->backfills[i] = std::move(s->backfills.back());
+        s->backfills.pop_back();
+        g_backfills.fetch_sub(1, std::memory_order_relaxed);
+    }
+}
+
+// Người nhận file gửi tới target: chính user đó (private) hoặc đã subscribe topic
+static bool file_allowed(const Client &cli, bool is_private, const std::string &target)
+{
+    if (is_private)
+        return target == cli.username;
+    auto ut = g_user_topics.find(cli.username);
+    return cli.topics.count(g_topic_ids.find(target)) || (ut != g_user_topics.end() && ut->second.count(target));
+}
+
+// MSG_FILE_RESUME: người nhận xin phần file còn thiếu từ offset
+void file_resume_request(mg_connection *c, Client &cli, PacketHeader &h, const uint8_t *payload)
+{
+    auto kv = parse_kv(std::string((const char *)payload, h.payloadLength));
+    auto it = g_manifests.find(kv["from"] + "/" + kv["key"]);
+    if (it == g_manifests.end())
+    {
+        send_error(c, h.messageId, "Khong tim thay file de tiep tuc");
+        return;
+    }
+    FileManifest &m = it->second;
+    if (!file_allowed(cli, m.is_private, m.target))
+    {
+        send_error(c, h.messageId, "Khong co quyen nhan file nay");
+        return;
+    }
+    if (m.relay)
+    {
+        send_error(c, h.messageId, "File chi duoc chuyen tiep, server khong luu de gui lai");
+        return;
+    }
+
+    Backfill b;
+    b.c = c;
+    b.id = c->id;
+    b.manifest = it->first;
+    b.off = std::min<uint64_t>(strtoull(kv["offset"].c_str(), nullptr, 10), m.size);
+    b.end = m.complete ? m.size : m.received;
+    b.chunked = m.dedup;
+    b.fp = fopen(("upload/" + m.filename + (b.chunked ? ".chunks" : "")).c_str(), "rb");
+    if (!b.fp || (!b.chunked && file_seek(b.fp, b.off) != 0))
+    {
+        if (b.fp)
+            fclose(b.fp);
+        send_error(c, h.messageId, "Khong mo duoc file tren server");
+        return;
+    }
+
+    // thông báo lại file để người nhận gắn messageId hiện tại với key
+    std::string notice = manifest_notice(m);
+    PacketHeader ph = manifest_header(m, MSG_PUBLISH_FILE);
+    ph.payloadLength = (uint32_t)notice.size();
+    send_packet(c, ph, notice.data());
+    send_ack(c, h.messageId, "offset=" + std::to_string(b.off) + ";end=" + std::to_string(b.end) +
+                                 ";size=" + std::to_string(m.size));
+    m.touched = time(nullptr);
+
+    t_shard->backfills.push_back(std::move(b));
+    g_backfills.fetch_add(1, std::memory_order_relaxed);
+}
+
+// MSG_FILE_HAVE: payload là các hash block (FILE_HASH_SIZE byte mỗi hash),
+// ACK trả chuỗi '0'/'1' theo thứ tự: block nào server đã có trong kho
+void file_have_request(mg_connection *c, PacketHeader &h, const uint8_t *payload)
+{
+    if (!g_cfg.file_dedup)
+    {
+        send_error(c, h.messageId, "Server khong bat kho chong trung (--files dedup)");
+        return;
+    }
+    size_t n = h.payloadLength / FILE_HASH_SIZE;
+    if (h.payloadLength % FILE_HASH_SIZE || n > STORE_HAVE_MAX)
+    {
+        send_error(c, h.messageId, "Danh sach hash khong hop le");
+        return;
+    }
+    std::string bits(n, '0');
+    {
+        std::lock_guard<std::mutex> lk(g_store_mu);
+        for (size_t i = 0; i < n; i++)
+            if (g_store.count(hex_of(payload + i * FILE_HASH_SIZE, FILE_HASH_SIZE)))
+                bits[i] = '1';
+    }
+    send_ack(c, h.messageId, bits);
+}
+
+// ---------------- FILE FETCH ----------------
+// File gửi xong (không relay) được ghi nhớ theo topic / người nhận. Người
+// vào sau gửi PUBLISH_TEXT tới /sys/fetch_file:
+// - "topic=<t>" hoặc "private=1": danh sách "name=..;from=..;size=.." mỗi dòng
+// - thêm ";name=<file>[;offset=N]": server thông báo file như lúc gửi
+//   (PUBLISH_FILE "tên\0key=..;size=..") rồi gửi FILE_DATA có offset từ
+//   ranh giới chunk <= N, kết thúc bằng LAST. messageId là của yêu cầu.
+// Shard của người xin gửi dữ liệu bằng sendfile nên các lượt xin cùng 1
+// file chỉ đọc chung page cache; dữ liệu chỉ được đọc vào bộ nhớ 1 lần để
+// tính checksum của từng chunk.
+
+// Ghi nhớ file vừa gửi xong (gọi khi giữ unique lock, lúc nhận LAST)
+static void upload_remember(const IncomingFile &f)
+{
+    StoredUpload u;
+    u.file_id = f.file_id;
+    u.filename = f.filename;
+    u.sender = f.sender;
+    u.target = f.target;
+    u.is_private = f.is_private;
+    u.size = f.manifest.empty() ? f.bytes : f.offset;
+    u.stored = f.stored;
+    auto m = g_manifests.find(f.manifest);
+    if (m != g_manifests.end())
+    {
+        if (!m->second.complete)
+            return; // LAST trước khi đủ size
+        u.key = m->second.key;
+        u.hash_trailer = m->second.hash_trailer;
+    }
+    u.dedup = f.dedup;
+
+    auto &list = g_uploads[f.is_private ? "@" + f.target : f.target];
+    list.erase(std::remove_if(list.begin(), list.end(),
+                              [&](const StoredUpload &o) { return o.filename == u.filename; }),
+               list.end());
+    if (list.size() >= FETCH_LIST_MAX)
+        list.erase(list.begin());
+    list.push_back(std::move(u));
+}
+
+// Lập bảng chunk của file đã lưu: file thường cắt theo FETCH_CHUNK,
+// dedup thì mỗi block trong kho là 1 chunk
+static std::shared_ptr<OpenedFile> fetch_open(const StoredUpload &u)
+{
+    auto of = std::make_shared<OpenedFile>();
+    std::string path = "upload/" + u.filename;
+    uint64_t pos = 0;
+    if (!u.dedup)
+    {
+        of->segs.push_back(path);
+        for (; pos < u.size; pos += FETCH_CHUNK)
+            of->chunks.push_back({0, pos, pos, (uint32_t)std::min<uint64_t>(FETCH_CHUNK, u.size - pos)});
+    }
+    else
+    {
+        FILE *fp = fopen((path + ".chunks").c_str(), "rb");
+        if (!fp)
+            return nullptr;
+        char hex[80];
+        unsigned long long len;
+        while (pos < u.size && fscanf(fp, "%79s %llu", hex, &len) == 2)
+        {
+            of->chunks.push_back({(uint32_t)of->segs.size(), 0, pos, (uint32_t)len});
+            of->segs.push_back(store_path(hex));
+            pos += len;
+        }
+        fclose(fp);
+        if (pos != u.size)
+            return nullptr;
+    }
+    of->sums.reset(new std::atomic<uint64_t>[of->chunks.size()]());
+    of->crcs.reset(new std::atomic<uint64_t>[of->chunks.size()]());
+    return of;
+}
+
+// Mở file chứa chunk (dedup: mỗi chunk 1 block trong kho)
+static bool fetch_seg(Fetch &f, uint32_t seg)
+{
+    if (f.fp_seg == seg)
+        return true;
+    if (f.fp)
+        fclose(f.fp);
+    f.fp = fopen(f.file->segs[seg].c_str(), "rb");
+    f.fp_seg = f.fp ? seg : UINT32_MAX;
+    return f.fp != nullptr;
+}
+
+// PUBLISH_TEXT /sys/fetch_file (chạy dưới shared lock)
+static void fetch_file_request(mg_connection *c, Client &cli, PacketHeader &h, const uint8_t *payload)
+{
+    auto kv = parse_kv(std::string((const char *)payload, h.payloadLength));
+    bool priv = kv["private"] == "1";
+    std::string target = priv ? cli.username : kv["topic"];
+    if (target.empty() || !file_allowed(cli, priv, target))
+    {
+        send_error(c, h.messageId, "Khong co quyen nhan file nay");
+        return;
+    }
+    auto it = g_uploads.find(priv ? "@" + target : target);
+
+    // không có name: trả danh sách file đã lưu
+    if (!kv.count("name"))
+    {
+        std::string list;
+        if (it != g_uploads.end())
+            for (auto &u : it->second)
+                list += "name=" + u.filename + ";from=" + u.sender + ";size=" + std::to_string(u.size) + "\n";
+        PacketHeader ph{};
+        ph.msgType = MSG_PUBLISH_TEXT;
+        ph.payloadLength = (uint32_t)list.size();
+        ph.messageId = h.messageId;
+        ph.timestamp = time(nullptr);
+        ph.version = PROTOCOL_VERSION;
+        strncpy(ph.topic, FETCH_TOPIC, MAX_TOPIC_LEN - 1);
+        send_packet(c, ph, list.data());
+        send_ack(c, h.messageId);
+        return;
+    }
+
+    StoredUpload *u = nullptr;
+    if (it != g_uploads.end())
+        for (auto &e : it->second)
+            if (e.filename == kv["name"])
+                u = &e;
+    if (!u)
+    {
+        send_error(c, h.messageId, "Khong tim thay file da luu");
+        return;
+    }
+    auto owner = g_upload_owner.find(u->filename);
+    if (owner == g_upload_owner.end() || owner->second != u->file_id)
+    {
+        send_error(c, h.messageId, "File da bi ghi de tren server");
+        return;
+    }
+    if (u->stored->load(std::memory_order_acquire) < u->size)
+    {
+        send_error(c, h.messageId, "File dang duoc luu, thu lai sau");
+        return;
+    }
+    std::shared_ptr<OpenedFile> of;
+    {
+        std::lock_guard<std::mutex> lk(g_opened_mu);
+        if (!u->opened)
+            u->opened = fetch_open(*u);
+        of = u->opened;
+    }
+
+    // bắt đầu từ chunk chứa offset
+    uint64_t off = std::min<uint64_t>(strtoull(kv["offset"].c_str(), nullptr, 10), u->size);
+    Fetch f;
+    f.c = c;
+    f.id = c->id;
+    f.file = of;
+    f.size = u->size;
+    f.hash_trailer = u->hash_trailer;
+    if (of)
+        f.next = std::upper_bound(of->chunks.begin(), of->chunks.end(), off,
+                                  [](uint64_t o, const FetchChunk &ch) { return o < ch.pos + ch.len; }) -
+                 of->chunks.begin();
+    // mở file ngay khi còn giữ g_mu (vừa kiểm tra chủ): lượt gửi mới cùng tên
+    // chỉ xóa tên cũ sau đó nên fetch luôn đọc đúng bản đã kiểm tra
+    if (!of || (f.next < of->chunks.size() && !fetch_seg(f, of->chunks[f.next].seg)))
+    {
+        send_error(c, h.messageId, "Khong mo duoc file tren server");
+        return;
+    }
+    uint64_t start = f.next < of->chunks.size() ? of->chunks[f.next].pos : u->size;
+
+    f.h.messageId = h.messageId;
+    f.h.timestamp = time(nullptr);
+    f.h.version = PROTOCOL_VERSION;
+    f.h.flags = u->is_private ? FLAG_PRIVATE : FLAG_GROUP;
+    strncpy(f.h.sender, u->sender.c_str(), MAX_USERNAME_LEN - 1);
+    strncpy(f.h.topic, u->target.c_str(), MAX_TOPIC_LEN - 1);
+
+    // thông báo file như lúc gửi, kèm key để người nhận ghi theo offset
+    std::string key = u->key.empty() ? "fetch-" + std::to_string(u->file_id) : u->key;
+    std::string notice = u->filename + '\0' + "key=" + key + ";size=" + std::to_string(u->size) +
+                         (u->hash_trailer.empty() ? "" : ";hash=xxh64");
+    PacketHeader ph = f.h;
+    ph.msgType = MSG_PUBLISH_FILE;
+    ph.payloadLength = (uint32_t)notice.size();
+    send_packet(c, ph, notice.data());
+    send_ack(c, h.messageId, "offset=" + std::to_string(start) + ";size=" + std::to_string(u->size));
+
+    f.h.msgType = MSG_FILE_DATA;
+    conn_state(c)->fetches++;
+    t_shard->fetches.push_back(std::move(f));
+    g_fetches.fetch_add(1, std::memory_order_relaxed);
+    g_stats.fetches.fetch_add(1, std::memory_order_relaxed);
+}
+
+// ---------------- GAME HANDLER ----------------
+
+// Server KHÔNG giữ board, chỉ forward /game/* cho đúng người
+void handle_game(mg_connection *c, uint32_t tid, PacketHeader &h, const uint8_t *payload)
+{
+    // ==== JOIN ====
+    if (tid == TID_GAME_JOIN)
+    {
+        if (g_game.started)
+        {
+            send_game_text(c, "/game/reject", "room_full");
+            return;
+        }
+
+        if (!g_game.p1)
+        {
+            g_game.p1 = c;
+            send_game_text(c, "/game/wait", "waiting_player");
+            return;
+        }
+
+        if (!g_game.p2 && c != g_game.p1)
+        {
+            g_game.p2 = c;
+            g_game.started = true;
+            send_game_text(g_game.p1, "/game/start", "X");
+            send_game_text(g_game.p2, "/game/start", "O");
+            return;
+        }
+        return;
+    }
+
+    // ==== MOVE ====
+    if (tid == TID_GAME_MOVE)
+    {
+        if (!g_game.started)
+            return;
+
+        mg_connection *other = (c == g_game.p1) ? g_game.p2 : (c == g_game.p2) ? g_game.p1
+                                                                               : nullptr;
+        if (!other)
+            return;
+
+        // Forward move
+        send_packet(other, h, payload);
+    }
+}
+
+// ---------------- PACKET HANDLER ----------------
+void dispatch_packet(mg_connection *c, Client &cli, PacketHeader &h, const uint8_t *payload)
+{
+    // connection phụ (MSG_FILE_JOIN) chỉ dùng cho dữ liệu file: không login,
+    // logout hay subscribe để không rời khỏi danh sách connection phụ
+    if ((cli.rx_main || !cli.transfer.empty()) && h.msgType != MSG_FILE_DATA && h.msgType != MSG_FILE_REF &&
+        h.msgType != MSG_FILE_JOIN)
+    {
+        send_error(c, h.messageId, "Connection phu chi dung cho file");
+        return;
+    }
+
+    switch (h.msgType)
+    {
+
+    case MSG_LOGIN:
+        // login lại bằng tên khác trên cùng connection (connection phụ nhận
+        // file của tên cũ không đi theo)
+        if (!cli.username.empty() && cli.username != h.sender)
+        {
+            session_end(c, cli);
+            file_rx_drop(c, cli);
+        }
+        cli.username = h.sender;
+        cli.uid = g_user_ids.intern(cli.username);
+
+        // ghi journal khi user vừa online
+        if (session_add(cli.uid, c))
+        {
+            journal_append(J_USER_ON, cli.username);
+            dir_publish(DIR_USERS, true, cli.username);
+        }
+        // payload "caps=<hex>" (hoặc "compress=lz", "wire=2", ...): các đường nhanh 2 bên cùng hỗ trợ
+        login_options(c, h, payload, &cli);
+        break;
+
+    case MSG_LOGOUT:
+        // game reset nếu đang chơi
+        if (c == g_game.p1 || c == g_game.p2)
+        {
+            mg_connection *other = (c == g_game.p1) ? g_game.p2 : g_game.p1;
+            if (other)
+                send_game_text(other, "/game/abort", "opponent_left");
+            g_game = GameRoom{};
+        }
+
+        session_end(c, cli);
+        topic_unsubscribe_all(c, cli);
+        file_rx_drop(c, cli);
+        g_clients.erase(c);
+
+        break;
+
+    case MSG_SUBSCRIBE:
+    {
+        std::string topic_str(h.topic);
+        uint32_t tid = g_topic_ids.intern(topic_str);
+        topic_subscribe(c, cli, tid);
+        // connection v2 nhận id để publish bằng id
+        send_ack(c, h.messageId, conn_state(c)->v2 ? "tid=" + std::to_string(tid) : std::string());
+
+        // topic hệ thống (/sys/dir) không lưu
+        if (is_sys_topic(topic_str))
+            break;
+
+        // ---- Lưu user-topic ----
+        if (!cli.username.empty() && g_user_topics[cli.username].insert(topic_str).second)
+            journal_append(J_SUB_ADD, cli.username, topic_str);
+
+        // ---- Lưu topic chung ----
+        if (g_topics.insert(topic_str).second)
+        {
+            journal_append(J_TOPIC_ADD, "", topic_str);
+            dir_publish(DIR_TOPICS, true, topic_str);
+        }
+        break;
+    }
+
+    case MSG_UNSUBSCRIBE:
+        topic_unsubscribe(c, cli, g_topic_ids.find(h.topic));
+        send_ack(c, h.messageId);
+
+        // Xóa mapping user:topic
+        {
+            auto it = g_user_topics.find(cli.username);
+            if (it != g_user_topics.end() && it->second.erase(h.topic))
+                journal_append(J_SUB_DEL, cli.username, h.topic);
+        }
+        break;
+
+    case MSG_PUBLISH_TEXT:
+    {
+        // id của topic (của user nhận nếu FLAG_PRIVATE): packet v2 gửi kèm id thì
+        // không phải hash tên, còn lại tra 1 lần. Từ đây chỉ so sánh số.
+        bool priv = h.flags & FLAG_PRIVATE;
+        uint32_t tid = t_ids.topic ? t_ids.topic : (priv ? g_user_ids : g_topic_ids).find(h.topic);
+
+        // === LIST USERS ===
+        if (!priv && (tid == TID_GET_USERS || tid == TID_GET_TOPICS))
+        {
+            bool users = tid == TID_GET_USERS;
+            std::string request((const char *)payload, h.payloadLength);
+            std::string list;
+            if (users && request.empty())
+                list = dir_snapshot(DIR_USERS)->joined; // kiểu cũ: cả danh sách
+            else
+                list = dir_page(users ? DIR_USERS : DIR_TOPICS, request);
+
+            PacketHeader ph{};
+            ph.msgType = MSG_PUBLISH_TEXT;
+            ph.payloadLength = (uint32_t)list.size();
+            ph.messageId = h.messageId;
+            ph.timestamp = time(nullptr);
+            ph.version = PROTOCOL_VERSION;
+            strncpy(ph.topic, users ? "/sys/user_list" : "/sys/topic_list", MAX_TOPIC_LEN - 1);
+
+            send_packet(c, ph, list.data());
+            send_ack(c, h.messageId);
+            return;
+        }
+
+        // === FILE ĐÃ LƯU ===
+        if (!priv && tid == TID_FETCH)
+        {
+            fetch_file_request(c, cli, h, payload);
+            return;
+        }
+
+        // === STATS / QUEUES ===
+        if (!priv && (tid == TID_STATS || tid == TID_QUEUES))
+        {
+            std::string text = tid == TID_STATS ? stats_text() : queues_text(std::string((const char *)payload, h.payloadLength));
+            PacketHeader ph{};
+            ph.msgType = MSG_PUBLISH_TEXT;
+            ph.payloadLength = (uint32_t)text.size();
+            ph.timestamp = time(nullptr);
+            ph.version = PROTOCOL_VERSION;
+            strncpy(ph.topic, tid == TID_STATS ? "/sys/stats" : "/sys/queues", MAX_TOPIC_LEN - 1);
+            send_packet(c, ph, text.data());
+            send_ack(c, h.messageId);
+            return;
+        }
+
+        // === GAME ===
+        if (strncmp(h.topic, "/game/", 6) == 0)
+        {
+            handle_game(c, priv ? g_topic_ids.find(h.topic) : tid, h, payload);
+            send_ack(c, h.messageId);
+            return;
+        }
+
+        // === PRIVATE / TOPIC ===
+        if (priv)
+        {
+            if (!conns_of(true, tid))
+            {
+                send_error(c, h.messageId, "User khong ton tai hoac offline!");
+                return;
+            }
+            send_private(tid, h, payload);
+        }
+        else
+        {
+            if (cli.topics.count(tid) == 0)
+            {
+                send_error(c, h.messageId, "Ban chua subscribe topic nay!");
+                return;
+            }
+            auto subs = conns_of(false, tid);
+            if (!subs)
+                send_error(c, h.messageId, "Topic khong co subscriber!");
+            else
+                send_fanout(*subs, h, payload, nullptr);
+        }
+        send_ack(c, h.messageId);
+        break;
+    }
+
+    case MSG_PUBLISH_FILE:
+        // khởi tạo file
+        {
+            IncomingFile f;
+            f.target = h.topic;
+            f.sender = h.sender;
+            f.is_private = h.flags & FLAG_PRIVATE;
+            f.target_id = t_ids.topic ? t_ids.topic : (f.is_private ? g_user_ids : g_topic_ids).find(f.target);
+            uint32_t target_id = f.target_id;
+
+            if (f.is_private && !conns_of(true, f.target_id))
+            {
+                send_error(c, h.messageId, "User khong ton tai hoac offline!");
+                return;
+            }
+            if (!f.is_private && !conns_of(false, f.target_id))
+            {
+                send_error(c, h.messageId, "Topic khong co subscriber!");
+                return;
+            }
+
+            // payload: "tên file" hoặc "tên file\0key=value;..." (tùy chọn truyền file)
+            std::string raw((char *)payload, h.payloadLength);
+            size_t nul = raw.find('\0');
+            bool hasOpts = nul != std::string::npos;
+            auto opts = hasOpts ? parse_kv(raw.substr(nul + 1)) : std::unordered_map<std::string, std::string>{};
+            std::string name = raw.substr(0, nul);
+
+            f.filename = name.empty() ? "upload_" + f.sender + "_" + f.target : name;
+            f.relay = g_cfg.file_relay || opts["relay"] == "1";
+
+            // key + size: chunk có offset, giữ manifest để nối lại khi rớt mạng
+            FileManifest *m = nullptr;
+            if (opts.count("key"))
+            {
+                if (!opts.count("size") || opts["key"].empty())
+                {
+                    send_error(c, h.messageId, "File co key phai kem size");
+                    return;
+                }
+                time_t now = time(nullptr);
+                manifest_sweep(now);
+                f.manifest = file_owner(cli, h) + "/" + opts["key"];
+                uint64_t size = strtoull(opts["size"].c_str(), nullptr, 10);
+                auto mit = g_manifests.find(f.manifest);
+                if (mit != g_manifests.end() &&
+                    (mit->second.complete || mit->second.size != size || mit->second.target != f.target ||
+                     mit->second.is_private != f.is_private || mit->second.filename != f.filename))
+                {
+                    g_manifests.erase(mit); // cùng key nhưng file/đích khác: gửi lại từ đầu
+                    mit = g_manifests.end();
+                }
+                bool fresh = mit == g_manifests.end();
+                if (fresh)
+                {
+                    FileManifest nm;
+                    nm.key = opts["key"];
+                    nm.sender = f.sender;
+                    nm.target = f.target;
+                    nm.is_private = f.is_private;
+                    nm.filename = f.filename;
+                    nm.size = size;
+                    nm.relay = f.relay;
+                    nm.stored = std::make_shared<std::atomic<uint64_t>>(0);
+                    mit = g_manifests.emplace(f.manifest, std::move(nm)).first;
+                }
+                else
+                {
+                    // người gửi nối lại: connection cũ có thể chưa bị đóng
+                    for (auto it = g_files.begin(); it != g_files.end();)
+                        it = it->second.manifest == f.manifest ? file_detach(it) : std::next(it);
+                    g_stats.file_resumes.fetch_add(1, std::memory_order_relaxed);
+                }
+                m = &mit->second;
+                m->msg_id = h.messageId;
+                m->active = true;
+                m->touched = now;
+                // hash cả file: lần gửi đầu chưa xin thì phần đã nhận không có hash, LAST sẽ không kiểm tra được
+                if (opts["hash"] == "xxh64" && !m->hashed)
+                {
+                    m->hashed = true;
+                    m->hash.reset(m->size);
+                }
+                f.relay = m->relay; // giữ chế độ của lần gửi đầu
+                f.offset = m->received;
+
+                // stripes: người gửi dùng thêm connection phụ, chunk tới theo offset bất
+                // kỳ. Có người nhận không có CAP_KEYED_FILES hoặc lần gửi đầu lưu qua kho
+                // chống trùng thì không cho (cần chunk theo thứ tự), người gửi gửi trên
+                // connection chính như thường.
+                if (opts.count("stripes") && atol(opts["stripes"].c_str()) > 0 && !m->dedup &&
+                    file_targets_keyed(f.is_private, f.target_id, c))
+                {
+                    f.stripes = (uint32_t)std::min<long>(atol(opts["stripes"].c_str()), FILE_STRIPES_MAX);
+                    char id[17];
+                    uint64_t r;
+                    mg_random(&r, sizeof(r));
+                    snprintf(id, sizeof(id), "%016llx", (unsigned long long)r);
+                    f.transfer = id;
+                    g_transfers[f.transfer] = file_owner(cli, h) + "#" + std::to_string(h.messageId);
+                    g_stats.file_striped.fetch_add(1, std::memory_order_relaxed);
+                }
+                // chống trùng cần block tới theo thứ tự nên không dùng cùng stripes;
+                // gửi tiếp giữ cách lưu của lần gửi đầu
+                if (fresh)
+                    m->dedup = g_cfg.file_dedup && !f.relay && !f.stripes && opts["dedup"] == "1";
+                f.dedup = m->dedup;
+                // người nhận cũ chỉ nhận được file gửi từ đầu, nối tiếp: gửi lại từ giữa thì bỏ qua họ
+                f.plain = f.offset == 0 && !f.stripes;
+            }
+
+            if (!f.relay)
+            {
+                f.file_id = g_next_file_id.fetch_add(1, std::memory_order_relaxed);
+                f.stored = m ? m->stored : std::make_shared<std::atomic<uint64_t>>(0);
+                g_upload_owner[f.filename] = f.file_id;
+                persist_file_open(f.file_id, "upload/" + f.filename, c, h.messageId, f.offset, f.stored, f.dedup);
+            }
+            // chunk: lấy theo yêu cầu của người gửi nhưng không vượt giới hạn server
+            if (opts.count("chunk"))
+                f.chunk = std::min<size_t>(std::max(1L, atol(opts["chunk"].c_str())), g_cfg.chunk_max);
+
+            // window: số chunk được gửi trước khi có ACK, giới hạn theo byte
+            f.src = c;
+            f.msg_id = h.messageId;
+            if (opts.count("window"))
+            {
+                size_t w = std::max(2L, atol(opts["window"].c_str()));
+                size_t byChunk = FILE_WINDOW_BYTES / (f.chunk ? f.chunk : g_cfg.chunk_max);
+                f.window = (uint32_t)std::max<size_t>(2, std::min({w, (size_t)FILE_WINDOW_MAX, byChunk}));
+            }
+
+            std::string agreed;
+            if (hasOpts)
+            {
+                agreed = std::string("relay=") + (f.relay ? "1" : "0") + ";chunk_max=" + std::to_string(g_cfg.chunk_max);
+                if (f.chunk)
+                    agreed += ";chunk=" + std::to_string(f.chunk);
+                if (f.window)
+                    agreed += ";window=" + std::to_string(f.window);
+                if (m)
+                    agreed += ";key=" + m->key + ";offset=" + std::to_string(f.offset);
+                if (m && m->hashed)
+                    agreed += ";hash=xxh64";
+                if (f.dedup)
+                    agreed += ";block=" + std::to_string(STORE_BLOCK);
+                if (f.stripes)
+                    agreed += ";stripes=" + std::to_string(f.stripes) + ";transfer=" + f.transfer;
+            }
+            bool credit = f.window > 0;
+            bool plain = f.plain;
+
+            g_files[file_owner(cli, h) + "#" + std::to_string(h.messageId)] = std::move(f);
+
+            // người nhận chỉ thấy tên file (file có key: kèm key + size để ghi theo offset)
+            std::string notice = m ? manifest_notice(*m) : name;
+            h.payloadLength = (uint32_t)notice.size();
+            if (m)
+                file_forward(h.flags & FLAG_PRIVATE, target_id, h, notice.data(), c, SIZE_MAX,
+                             plain ? name.data() : nullptr, (uint32_t)name.size());
+            else if (h.flags & FLAG_PRIVATE)
+                send_private(target_id, h, notice.data());
+            else
+                broadcast_topic(target_id, h, notice.data(), c);
+
+            send_ack(c, h.messageId, agreed);
+            if (!credit)
+                send_ack(c, h.messageId, agreed); // client cũ nhận 2 ACK
+
+        }
+        break;
+
+    case MSG_FILE_DATA:
+    case MSG_FILE_REF:
+    {
+        // connection phụ (MSG_FILE_JOIN) tìm file theo mã lượt gửi
+        auto it = g_files.end();
+        if (cli.transfer.empty())
+            it = g_files.find(file_owner(cli, h) + "#" + std::to_string(h.messageId));
+        else if (g_transfers.count(cli.transfer))
+            it = g_files.find(g_transfers[cli.transfer]);
+        if (it == g_files.end() || (cli.transfer.empty() && it->second.src != c))
+        {
+            send_error(c, h.messageId, "File not found on server");
+            return;
+        }
+        IncomingFile &f = it->second;
+        bool ref = h.msgType == MSG_FILE_REF;
+        if (ref && !f.dedup)
+        {
+            send_error(c, h.messageId, "File khong dung kho chong trung");
+            return;
+        }
+        bool last = !ref && (h.flags & FLAG_LAST);
+        if (last && c != f.src)
+        {
+            send_error(c, h.messageId, "LAST phai gui tren connection chinh");
+            return;
+        }
+
+        // file có key: 8 byte đầu là offset, phải nối tiếp phần server đã có
+        // (gửi song song: đoạn bất kỳ trong file)
+        const uint8_t *data = payload;
+        size_t len = h.payloadLength;
+        uint64_t off = 0;
+        std::string verdict; // kết quả kiểm tra hash cả file (LAST)
+        if (!f.manifest.empty())
+        {
+            if (len < FILE_OFFSET_SIZE)
+            {
+                send_error(c, h.messageId, "Chunk thieu offset");
+                return;
+            }
+            memcpy(&off, payload, FILE_OFFSET_SIZE);
+            data += FILE_OFFSET_SIZE;
+            len -= FILE_OFFSET_SIZE;
+            auto m = g_manifests.find(f.manifest);
+            uint64_t size = m == g_manifests.end() ? 0 : m->second.size;
+            if (f.stripes && !last ? off + len > size : off != f.offset)
+            {
+                std::string msg = "Offset khong khop, server dang cho offset=" + std::to_string(f.offset);
+                send_error(c, h.messageId, msg.c_str());
+                return;
+            }
+            // LAST: sau offset là hash cả file, không phải dữ liệu
+            if (last && m != g_manifests.end() && file_hash_check(it, m->second, data, len, verdict))
+                return;
+            if (last)
+                len = 0;
+        }
+
+        // MSG_FILE_REF: [offset][hash] -> lấy block trong kho (đã đọc sẵn
+        // ngoài g_mu, file_ref_read), người nhận vẫn nhận FILE_DATA bình thường
+        std::string refHex;
+        std::vector<uint8_t> refData;
+        if (ref)
+        {
+            refData.swap(t_ref);
+            if (refData.empty())
+            {
+                send_error(c, h.messageId, "Block khong co tren server");
+                return;
+            }
+            refHex = hex_of(data, FILE_HASH_SIZE);
+            payload = refData.data();
+            data = payload + FILE_OFFSET_SIZE;
+            len = refData.size() - FILE_OFFSET_SIZE;
+            h.msgType = MSG_FILE_DATA;
+            h.flags &= ~FLAG_LAST;
+            h.payloadLength = (uint32_t)refData.size();
+        }
+        else if (f.chunk && len > f.chunk)
+        {
+            send_error(c, h.messageId, "Chunk lon hon kich thuoc da thoa thuan");
+            return;
+        }
+
+        // relay: chuyển thẳng chunk cho người nhận, không đụng tới đĩa
+        if (f.relay)
+            g_stats.file_bytes_relayed.fetch_add(len, std::memory_order_relaxed);
+        else if (ref)
+        {
+            persist_file_ref(f.file_id, refHex, len);
+            g_stats.file_ref_bytes.fetch_add(len, std::memory_order_relaxed);
+        }
+        else
+        {
+            persist_file_write(f.file_id, data, len, f.stripes ? off : UINT64_MAX);
+            g_stats.file_bytes_archived.fetch_add(len, std::memory_order_relaxed);
+        }
+
+        // file có key: chunk có thể đi qua connection phụ của người nhận (cả đoạn
+        // hash trên cùng 1 connection để người nhận tính hash theo thứ tự).
+        // Người nhận cũ nhận phần dữ liệu không offset, LAST rỗng.
+        if (!f.manifest.empty())
+            file_forward(f.is_private, f.target_id, h, payload, f.src, (size_t)(off / FILE_HASH_LEAF),
+                         f.plain ? data : nullptr, (uint32_t)len);
+        else if (f.is_private)
+            send_private(f.target_id, h, payload);
+        else
+            broadcast_topic(f.target_id, h, payload, c);
+
+        bool full = false; // gửi song song: đã đủ mọi đoạn của file
+        if (!f.manifest.empty())
+        {
+            if (f.stripes)
+                range_add(f.offset, f.got, off, off + len);
+            else
+                f.offset += len;
+            auto m = g_manifests.find(f.manifest);
+            if (m != g_manifests.end())
+            {
+                if (m->second.hashed && len)
+                    m->second.hash.add(off, data, len);
+                m->second.received = f.offset;
+                m->second.touched = time(nullptr);
+                full = f.stripes && f.offset == m->second.size;
+                if (last)
+                {
+                    m->second.complete = f.offset == m->second.size;
+                    m->second.active = false;
+                }
+            }
+        }
+
+        // ACK: cộng dồn theo cửa sổ credit, hoặc từng chunk với client cũ.
+        // Gửi song song: đủ dữ liệu thì ACK ngay để người gửi biết mà gửi LAST.
+        f.received++;
+        f.bytes += len;
+        if (f.window)
+            file_credit(f.msg_id, f, last || full);
+        else
+        {
+            send_ack(f.src, h.messageId);
+            if (!f.relay)
+                persist_pause_src(c);
+        }
+
+        // kết thúc file
+        if (last)
+        {
+            if (!f.relay)
+            {
+                persist_file_close(f.file_id);
+                upload_remember(f);
+            }
+            if (!verdict.empty())
+                send_ack(f.src, f.msg_id, verdict);
+            g_transfers.erase(f.transfer);
+            std::cout << "File transfer completed: "
+                      << f.sender << " -> " << f.target
+                      << " (" << f.filename << ")\n";
+            g_files.erase(it);
+        }
+    }
+    break;
+
+    case MSG_FILE_RESUME:
+        file_resume_request(c, cli, h, payload);
+        break;
+
+    case MSG_FILE_JOIN:
+        file_join_request(c, cli, h, payload);
+        break;
+
+    case MSG_FILE_HAVE:
+        file_have_request(c, h, payload);
+        break;
+
+    default:
+        send_error(c, h.messageId, "INVALID_MSG");
+    }
+}
+
+// Publish text (trừ game) chỉ đọc state chung nên các shard chạy song song
+// với shared lock; MSG_FILE_HAVE chỉ đọc kho block (có lock riêng). Mọi
+// message khác thay đổi state nên cần lock độc quyền.
+bool is_read_only(const PacketHeader &h)
+{
+    if (h.msgType == MSG_FILE_HAVE)
+        return true;
+    return h.msgType == MSG_PUBLISH_TEXT && strncmp(h.topic, "/game/", 6) != 0;
+}
+
+// Packet v2 gửi id thay cho tên: điền lại tên vào header để forward và các
+// handler dùng được (chỉ chép chuỗi, không hash). false nếu id chưa được cấp.
+static bool wire_resolve_ids(PacketHeader &h)
+{
+    if (t_ids.sender)
+    {
+        if (t_ids.sender >= g_user_ids.size())
+            return false;
+        const std::string &n = g_user_ids.name(t_ids.sender);
+        memcpy(h.sender, n.data(), std::min(n.size(), (size_t)MAX_USERNAME_LEN - 1));
+    }
+    if (t_ids.topic)
+    {
+        const NameTable &tbl = (h.flags & FLAG_PRIVATE) ? g_user_ids : g_topic_ids;
+        if (t_ids.topic >= tbl.size())
+            return false;
+        const std::string &n = tbl.name(t_ids.topic);
+        memcpy(h.topic, n.data(), std::min(n.size(), (size_t)MAX_TOPIC_LEN - 1));
+    }
+    return true;
+}
+
+// Block của MSG_FILE_REF đọc từ kho trên thread của shard trước khi lấy g_mu
+// (kho chỉ cần g_store_mu, như backfill): out = [offset][dữ liệu], rỗng nếu
+// packet sai dạng hoặc kho không có block
+static void file_ref_read(const PacketHeader &h, const uint8_t *payload, std::vector<uint8_t> &out)
+{
+    out.clear();
+    if (h.msgType != MSG_FILE_REF || h.payloadLength != FILE_OFFSET_SIZE + FILE_HASH_SIZE)
+        return;
+    out.assign(payload, payload + FILE_OFFSET_SIZE);
+    if (!store_read(hex_of(payload + FILE_OFFSET_SIZE, FILE_HASH_SIZE), out))
+        out.clear();
+}
+
+void handle_packet(mg_connection *c, PacketHeader &h, const uint8_t *payload)
+{
+    file_ref_read(h, payload, t_ref);
+    bool ids = t_ids.sender || t_ids.topic;
+    if (ids || is_read_only(h))
+    {
+        std::shared_lock<std::shared_mutex> lk(g_mu);
+        if (ids && !wire_resolve_ids(h))
+        {
+            send_error(c, h.messageId, "Id khong hop le");
+            return;
+        }
+        if (is_read_only(h))
+        {
+            auto it = g_clients.find(c);
+            if (it != g_clients.end())
+            {
+                dispatch_packet(c, it->second, h, payload);
+                return;
+            }
+        }
+    }
+    std::unique_lock<std::shared_mutex> lk(g_mu);
+    dispatch_packet(c, g_clients[c], h, payload);
+}
+
+// ---------------- BATCH ----------------
+// MSG_BUNDLE: payload là nhiều packet con nối tiếp (header v1/v2 + payload).
+// Packet con không được là MSG_BUNDLE hay mang FLAG_COMPRESSED (muốn nén thì
+// nén cả lô). Cả lô được xử lý trong 1 lần lấy g_mu (shared nếu mọi packet
+// con chỉ đọc). ACK rỗng của packet con gộp thành 1 ACK "batch=<số packet>"
+// theo messageId của lô; lỗi và ACK có nội dung vẫn gửi riêng.
+struct BatchItem
+{
+    PacketHeader h;
+    WireIds ids;
+    const uint8_t *payload = nullptr;
+    bool bad_ids = false; // id chưa được cấp
+    bool bad_crc = false; // FLAG_CRC32C nhưng CRC sai
+    std::vector<uint8_t> ref; // MSG_FILE_REF: block đọc sẵn (file_ref_read)
+};
+
+static void batch_dispatch(mg_connection *c, Client &cli, BatchItem &it)
+{
+    if (it.bad_crc)
+    {
+        send_error(c, it.h.messageId, "Checksum CRC32C khong khop");
+        return;
+    }
+    if (it.bad_ids)
+    {
+        send_error(c, it.h.messageId, "Id khong hop le");
+        return;
     }
+    t_ids = it.ids;
+    t_wire = WirePayload{};
+    t_ref.swap(it.ref);
+    dispatch_packet(c, cli, it.h, it.payload);
 }
 
-// ---------------- PACKET HANDLER ----------------
-void handle_packet(mg_connection *c, PacketHeader &h, const uint8_t *payload)
+void handle_batch(mg_connection *c, const PacketHeader &bh, const uint8_t *payload)
 {
-    std::lock_guard<std::mutex> lk(g_mu);
-    Client &cli = g_clients[c];
-    std::string topic_str(h.topic);
+    static thread_local std::vector<BatchItem> items;
+    items.clear();
+    for (size_t off = 0; off < bh.payloadLength;)
+    {
+        BatchItem it;
+        long hn = wire_decode_header(payload + off, bh.payloadLength - off, it.h, &it.ids);
+        if (hn <= 0 || bh.payloadLength - off - (size_t)hn < it.h.payloadLength || it.h.msgType == MSG_BUNDLE ||
+            (it.h.flags & FLAG_COMPRESSED))
+        {
+            send_error(c, bh.messageId, "Batch khong hop le");
+            return;
+        }
+        it.payload = it.h.payloadLength ? payload + off + hn : nullptr;
+        it.bad_crc = !crc_ok(it.h, it.payload);
+        if (!it.bad_crc)
+            file_ref_read(it.h, it.payload, it.ref);
+        off += (size_t)hn + it.h.payloadLength;
+        items.push_back(std::move(it));
+    }
 
-    switch (h.msgType)
+    uint32_t merged = 0;
+    t_batch_acks = &merged;
+    bool done = false;
+    {
+        // điền tên cho packet con gửi bằng id; tên không đổi sau khi cấp nên
+        // vẫn dùng được sau khi đổi sang lock độc quyền
+        std::shared_lock<std::shared_mutex> lk(g_mu);
+        bool ro = true;
+        for (auto &it : items)
+        {
+            t_ids = it.ids;
+            it.bad_ids = (it.ids.sender || it.ids.topic) && !wire_resolve_ids(it.h);
+            ro = ro && !it.bad_ids && is_read_only(it.h);
+        }
+        auto cl = g_clients.find(c);
+        if (ro && cl != g_clients.end())
+        {
+            for (auto &it : items)
+                batch_dispatch(c, cl->second, it);
+            done = true;
+        }
+    }
+    if (!done)
     {
+        std::unique_lock<std::shared_mutex> lk(g_mu);
+        for (auto &it : items)
+            batch_dispatch(c, g_clients[c], it); // LOGOUT trong lô xóa client: tra lại mỗi packet
+    }
+    t_batch_acks = nullptr;
+    t_ids = WireIds{};
 
-    case MSG_LOGIN:
-        cli.username = h.sender;
-        onlineUsers.insert(h.sender);
+    g_stats.batch_frames.fetch_add(1, std::memory_order_relaxed);
+    g_stats.batch_messages.fetch_add(items.size(), std::memory_order_relaxed);
+    g_stats.batch_acks_merged.fetch_add(merged, std::memory_order_relaxed);
+    send_ack(c, bh.messageId, "batch=" + std::to_string(items.size()));
+}
+
+// ---------------- FRAMING ----------------
 
-        // ghi online.txt
+// Tách mọi packet hoàn chỉnh trong buf và xử lý ngay trên buffer, payload
+// được truyền dạng con trỏ vào buf (không copy). Trả về số byte đã dùng,
+// phần dư là packet chưa nhận đủ.
+size_t parse_packets(mg_connection *c, const uint8_t *buf, size_t len)
+{
+    size_t off = 0;
+    while (off < len)
+    {
+        // header v1 (PacketHeader nguyên) hoặc v2 (byte đầu WIRE_V2_MAGIC)
+        PacketHeader h;
+        WireIds ids;
+        long hn = wire_decode_header(buf + off, len - off, h, &ids);
+        if (hn == 0)
+            break;
+        if (hn < 0)
         {
-            std::ofstream ofs(ONLINE_FILE, std::ios::app);
-            ofs << h.sender << "\n";
+            send_error(c, 0, "Header v2 khong hop le");
+            c->is_draining = 1;
+            return len;
         }
-        send_ack(c, h.messageId);
-        break;
-
-    case MSG_LOGOUT:
-        // game reset nếu đang chơi
-        if (c == g_game.p1 || c == g_game.p2)
+        if (h.payloadLength > MAX_PAYLOAD_SIZE)
         {
-            mg_connection *other = (c == g_game.p1) ? g_game.p2 : g_game.p1;
-            if (other)
-                send_game_text(other, "/game/abort", "opponent_left");
-            g_game = GameRoom{};
+            // packet không bao giờ vừa recv buffer
+            send_error(c, h.messageId, "Packet too large");
+            c->is_draining = 1;
+            return len;
         }
+        if (len - off - (size_t)hn < h.payloadLength)
+            break;
 
-        if (!cli.username.empty())
+        // TCP bị ngừng đọc (--sendq-policy pause): để phần còn lại trong
+        // recv, xử lý tiếp khi được mở lại
+        if (c->is_full && c->pfn == nullptr)
+            break;
+
+        size_t n = (size_t)hn + h.payloadLength; // handler có thể sửa h
+        const uint8_t *payload = h.payloadLength ? buf + off + hn : nullptr;
+        off += n;
+        if (!crc_ok(h, payload))
+        {
+            send_error(c, h.messageId, "Checksum CRC32C khong khop");
+            continue;
+        }
+        if ((h.flags & FLAG_COMPRESSED) && !wire_decompress(h, payload))
         {
-            std::string user = cli.username;
+            send_error(c, h.messageId, "Payload nen khong hop le");
+            continue;
+        }
+        g_stats.packets_in.fetch_add(1, std::memory_order_relaxed);
+        t_src = c;
+        t_ids = ids;
+        if (h.msgType == MSG_BUNDLE)
+            handle_batch(c, h, payload);
+        else
+            handle_packet(c, h, payload);
+        t_src = nullptr;
+        t_wire = WirePayload{};
+        t_ids = WireIds{};
+    }
+    return off;
+}
 
-            // Xóa khỏi onlineUsers
-            onlineUsers.erase(user);
-            std::ofstream ofs(ONLINE_FILE, std::ios::trunc);
-            for (auto &u : onlineUsers)
-                ofs << u << "\n";
+// ---------------- SHARD LOOP ----------------
 
-            // Xóa tất cả dòng user-topic của user
-            std::ifstream ifs(USER_TOPIC_FILE);
-            std::vector<std::string> lines;
-            std::string line;
-            while (std::getline(ifs, line))
-            {
-                if (line.find(user + ":") != 0)
-                    lines.push_back(line); // giữ các dòng khác user
-            }
-            ifs.close();
+// Gửi các packet shard khác chuyển sang (chạy trên thread của shard)
+void shard_drain(Shard &s)
+{
+    std::vector<Handoff> batch;
+    {
+        std::lock_guard<std::mutex> lk(s.mu);
+        batch.swap(s.inbox);
+    }
+    for (auto &ho : batch)
+    {
+        auto it = s.live.find(ho.id);
+        if (it == s.live.end() || it->second != ho.c)
+            continue; // connection đã đóng
+        queue_frame(ho.c, std::move(ho.frame));
+    }
+}
 
-            std::ofstream ofs2(USER_TOPIC_FILE, std::ios::trunc);
-            for (auto &l : lines)
-                ofs2 << l << "\n";
-        }
-        g_clients.erase(c);
+// Flush các connection có frame mới trong vòng poll này
+void shard_flush(Shard &s)
+{
+    std::vector<unsigned long> ids;
+    ids.swap(s.dirty);
+    for (unsigned long id : ids)
+    {
+        auto it = s.live.find(id);
+        if (it == s.live.end())
+            continue;
+        conn_state(it->second)->dirty = false;
+        flush_conn(it->second);
+    }
+}
 
-        break;
+// epoll của mongoose luôn đăng ký EPOLLIN, connection đang ngừng đọc mà còn
+// dữ liệu trong socket sẽ làm epoll_wait trả về liên tục. mg_iotest còn MOD lại
+// c->fd (kèm EPOLLIN) mỗi vòng c->send còn dữ liệu, nên khi ngừng đọc ta bỏ hẳn
+// c->fd khỏi epoll và đăng ký 1 fd dup (chỉ EPOLLOUT) thay vào: MOD của mongoose
+// lên c->fd khi đó trả ENOENT, không mở lại EPOLLIN được.
+static void sendq_epoll_read(mg_connection *c, bool rd)
+{
+#if defined(MG_ENABLE_EPOLL) && MG_ENABLE_EPOLL
+    ConnState *st = conn_state(c);
+    int fd = (int)(size_t)c->fd, efd = c->mgr->epoll_fd;
+    epoll_event ev{};
+    ev.events = (uint32_t)EPOLLERR | (uint32_t)EPOLLHUP | (rd ? (uint32_t)EPOLLIN : 0u) |
+                (c->send.len || st->fetches ? (uint32_t)EPOLLOUT : 0u);
+    ev.data.ptr = c;
+    if (rd && st->parked >= 0)
+    {
+        epoll_ctl(efd, EPOLL_CTL_DEL, st->parked, nullptr); // c->fd còn mở: close thôi chưa bỏ đăng ký
+        close(st->parked);
+        st->parked = -1;
+        epoll_ctl(efd, EPOLL_CTL_ADD, fd, &ev);
+    }
+    else if (!rd && st->parked < 0 && (st->parked = dup(fd)) >= 0)
+    {
+        epoll_ctl(efd, EPOLL_CTL_DEL, fd, nullptr);
+        epoll_ctl(efd, EPOLL_CTL_ADD, st->parked, &ev);
+    }
+    else
+        epoll_ctl(efd, EPOLL_CTL_MOD, st->parked >= 0 ? st->parked : fd, &ev);
+#else
+    (void)c, (void)rd;
+#endif
+}
 
-    case MSG_SUBSCRIBE:
-        cli.topics.insert(h.topic);
-        send_ack(c, h.messageId);
+void sendq_mask_paused(Shard &s)
+{
+    for (unsigned long id : s.paused)
+    {
+        auto it = s.live.find(id);
+        if (it != s.live.end() && it->second->is_full)
+            sendq_epoll_read(it->second, false);
+    }
+}
 
-        // ---- Lưu user-topic ----
+// Timer của shard: mở lại các publisher bị ngừng đọc khi connection nghẽn
+// đã vơi dưới nửa giới hạn (hoặc đã đóng/logout), người gửi file bị ngừng vì
+// đĩa chậm khi hàng đợi ghi đĩa vơi dưới nửa PERSIST_PENDING_LIMIT
+void sendq_resume_timer(void *arg)
+{
+    Shard *s = (Shard *)arg;
+    if (s->paused.empty())
+        return;
+    std::vector<mg_connection *> ready;
+    {
+        std::shared_lock<std::shared_mutex> lk(g_mu);
+        for (size_t i = 0; i < s->paused.size();)
         {
-            std::unordered_set<std::string> existingUserTopics;
-            std::ifstream ifs(USER_TOPIC_FILE);
-            std::string line;
-            while (std::getline(ifs, line))
-                existingUserTopics.insert(line);
-            ifs.close();
-
-            std::string entry = cli.username + ":" + h.topic;
-            if (existingUserTopics.find(entry) == existingUserTopics.end())
+            auto it = s->live.find(s->paused[i]);
+            mg_connection *c = it == s->live.end() ? nullptr : it->second;
+            mg_connection *dst = c ? conn_state(c)->paused_by : nullptr;
+            if (c && (dst ? g_clients.count(dst) &&
+                                conn_state(dst)->pending.load(std::memory_order_relaxed) > g_cfg.sendq_max / 2
+                          : persist_backlogged(PERSIST_PENDING_LIMIT / 2)))
             {
-                std::ofstream ofs(USER_TOPIC_FILE, std::ios::app);
-                ofs << entry << "\n";
+                i++;
+                continue;
             }
+            if (c)
+                ready.push_back(c);
+            s->paused[i] = s->paused.back();
+            s->paused.pop_back();
+            g_sendq_paused.fetch_sub(1, std::memory_order_relaxed);
         }
-
-        // ---- Lưu topic chung ----
+    }
+    for (mg_connection *c : ready)
+    {
+        c->is_full = 0;
+        conn_state(c)->paused_by = nullptr;
+        sendq_epoll_read(c, true);
+        // packet còn trong recv không chờ tới lần đọc socket sau
+        if (c->recv.len)
         {
-            std::unordered_set<std::string> existingTopics;
-            std::ifstream ifs(TOPICS_FILE);
-            std::string tline;
-            while (std::getline(ifs, tline))
-                existingTopics.insert(tline);
-            ifs.close();
-
-            if (existingTopics.find(h.topic) == existingTopics.end())
-            {
-                std::ofstream ofs(TOPICS_FILE, std::ios::app);
-                ofs << h.topic << "\n";
-            }
+            long n = 0;
+            mg_call(c, MG_EV_READ, &n);
         }
-        break;
+    }
+}
 
-    case MSG_UNSUBSCRIBE:
-        cli.topics.erase(h.topic);
-        send_ack(c, h.messageId);
+// ---------------- FILE FETCH: GỬI ----------------
+// Socket đầy giữa chunk thì EPOLLOUT (giữ bởi ConnState::fetches) đánh thức
+// shard; khi không có epoll, vòng poll ngắn của shard_loop gửi tiếp.
 
-        // Xóa mapping khỏi file
-        {
-            std::ifstream ifs(USER_TOPIC_FILE);
-            std::vector<std::string> lines;
-            std::string line;
-            std::string entryToRemove = cli.username + ":" + h.topic;
+// Checksum payload của chunk (offset 8 byte + dữ liệu): crc = CRC32C cả
+// payload, không thì XOR của riêng dữ liệu (người gọi XOR thêm offset). Đọc
+// 1 lần cho mỗi file và kiểu checksum, lượt fetch sau (kể cả ở shard khác) dùng lại.
+static bool fetch_chunk_sum(Fetch &f, const FetchChunk &ch, bool crc, uint32_t &sum)
+{
+    std::atomic<uint64_t> &cached = crc ? f.file->crcs[f.next] : f.file->sums[f.next];
+    uint64_t v = cached.load(std::memory_order_relaxed);
+    if (v & 1)
+    {
+        sum = (uint32_t)(v >> 1);
+        return true;
+    }
+    static thread_local std::vector<uint8_t> buf;
+    buf.resize(ch.len);
+    if (file_seek(f.fp, ch.off) != 0 || fread(buf.data(), 1, ch.len, f.fp) != ch.len)
+        return false;
+    g_stats.fetch_read_bytes.fetch_add(ch.len, std::memory_order_relaxed);
+    if (crc)
+        sum = calc_crc32c(buf.data(), ch.len, calc_crc32c((const uint8_t *)&ch.pos, FILE_OFFSET_SIZE));
+    else
+        sum = calc_checksum(buf.data(), ch.len);
+    cached.store(((uint64_t)sum << 1) | 1, std::memory_order_relaxed);
+    return true;
+}
 
-            while (std::getline(ifs, line))
-                if (line != entryToRemove)
-                    lines.push_back(line);
-            ifs.close();
+// Ghi tiếp header của chunk. Linux: MSG_MORE để kernel gộp với dữ liệu
+// sendfile phía sau thành cùng segment TCP.
+static long fetch_send_head(Fetch &f)
+{
+#ifdef __linux__
+    ssize_t r = send((int)(size_t)f.c->fd, f.head + f.head_off, f.head_len - f.head_off,
+                     MSG_NOSIGNAL | MSG_DONTWAIT | MSG_MORE);
+    if (r < 0)
+        return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+    return (long)r;
+#else
+    IoVec v;
+    iov_set(v, f.head + f.head_off, f.head_len - f.head_off);
+    return sock_writev(f.c, &v, 1);
+#endif
+}
 
-            std::ofstream ofs(USER_TOPIC_FILE, std::ios::trunc);
-            for (auto &l : lines)
-                ofs << l << "\n";
-        }
-        break;
+// Ghi tiếp dữ liệu của chunk: > 0 số byte đã gửi, 0 socket đầy, < 0 lỗi
+static long fetch_send_body(Fetch &f)
+{
+    long w;
+#ifdef __linux__
+    off_t off = (off_t)f.body_off;
+    ssize_t r = sendfile((int)(size_t)f.c->fd, fileno(f.fp), &off, (size_t)f.body_left);
+    if (r < 0)
+        return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+    if (r == 0)
+        return -1; // file ngắn hơn bảng chunk (bị sửa ngoài server)
+    w = (long)r;
+#else
+    // không có sendfile: đọc từng đoạn vào bộ nhớ rồi ghi ra socket
+    static thread_local std::vector<uint8_t> buf(64 * 1024);
+    size_t n = (size_t)std::min<uint64_t>(buf.size(), f.body_left);
+    if (file_seek(f.fp, f.body_off) != 0 || fread(buf.data(), 1, n, f.fp) != n)
+        return -1;
+    g_stats.fetch_read_bytes.fetch_add(n, std::memory_order_relaxed);
+    IoVec v;
+    iov_set(v, buf.data(), n);
+    w = sock_writev(f.c, &v, 1);
+#endif
+    if (w > 0)
+        g_stats.fetch_bytes.fetch_add((uint64_t)w, std::memory_order_relaxed);
+    return w;
+}
 
-    case MSG_PUBLISH_TEXT:
-        // === LIST USERS ===
-        if (topic_str == "/sys/get_users")
+// Gửi tiếp tối đa FETCH_STEP_BYTES, trả về true khi xong (hoặc phải dừng)
+static bool fetch_step(Fetch &f)
+{
+    mg_connection *c = f.c;
+    ConnState *st = conn_state(c);
+    OpenedFile &of = *f.file;
+    size_t sent = 0;
+    while (!c->is_closing)
+    {
+        if (!f.busy)
         {
-            std::string list;
-            for (auto &u : onlineUsers)
-                list += u + "\n";
+            // frame khác (hoặc chunk của lượt fetch khác) đang chờ thì gửi chúng trước
+            if (st->streaming)
+                return false;
+            flush_conn(c);
+            if (!st->out.empty() || st->spill || c->send.len || sent >= FETCH_STEP_BYTES)
+                return false;
 
-            PacketHeader ph{};
-            ph.msgType = MSG_PUBLISH_TEXT;
-            ph.payloadLength = (uint32_t)list.size();
-            ph.timestamp = time(nullptr);
-            ph.version = PROTOCOL_VERSION;
-            strncpy(ph.topic, "/sys/user_list", MAX_TOPIC_LEN - 1);
+            if (f.next == of.chunks.size())
+            {
+                // xong: LAST mang offset = kích thước file (+ hash cả file)
+                std::string tail((const char *)&f.size, FILE_OFFSET_SIZE);
+                tail += f.hash_trailer;
+                f.h.flags |= FLAG_LAST;
+                f.h.payloadLength = (uint32_t)tail.size();
+                send_packet(c, f.h, tail.data());
+                return true;
+            }
+            const FetchChunk &ch = of.chunks[f.next];
+            uint32_t sum;
+            if (!fetch_seg(f, ch.seg) || !fetch_chunk_sum(f, ch, st->crc, sum))
+            {
+                send_error(c, f.h.messageId, "Loi doc file tren server");
+                return true;
+            }
+            if (!st->crc)
+                for (size_t i = 0; i < FILE_OFFSET_SIZE; i++)
+                    sum ^= (uint8_t)(ch.pos >> (8 * i));
+            f.h.flags = st->crc ? (f.h.flags | FLAG_CRC32C) : (f.h.flags & ~FLAG_CRC32C);
 
-            std::vector<uint8_t> pl(list.begin(), list.end());
-            send_packet(c, ph, pl.data());
-            send_ack(c, h.messageId);
-            return;
+            f.h.payloadLength = (uint32_t)(FILE_OFFSET_SIZE + ch.len);
+            f.h.checksum = sum;
+            uint8_t hb[WIRE_HEADER_MAX];
+            size_t hn = wire_encode_header(f.h, st->v2, hb);
+            f.head_len = st->is_ws ? ws_frame_header(f.head, hn + f.h.payloadLength) : 0;
+            memcpy(f.head + f.head_len, hb, hn);
+            memcpy(f.head + f.head_len + hn, &ch.pos, FILE_OFFSET_SIZE);
+            f.head_len += hn + FILE_OFFSET_SIZE;
+            f.head_off = 0;
+            f.body_off = ch.off;
+            f.body_left = ch.len;
+            f.busy = true;
+            st->streaming = true;
         }
 
-        // === GAME ===
-        if (strncmp(h.topic, "/game/", 6) == 0)
+        long w = 0;
+        if (f.head_off < f.head_len)
         {
-            handle_game(c, h, payload);
-            send_ack(c, h.messageId);
-            return;
+            if ((w = fetch_send_head(f)) > 0)
+                f.head_off += (size_t)w;
         }
-
-        // === PRIVATE / TOPIC ===
-        if (h.flags & FLAG_PRIVATE)
+        else if (f.body_left)
         {
-            if (!user_online(h.topic))
+            if ((w = fetch_send_body(f)) > 0)
             {
-                send_error(c, h.messageId, "User khong ton tai hoac offline!");
-                return;
+                f.body_off += (uint64_t)w;
+                f.body_left -= (uint64_t)w;
+                sent += (size_t)w;
             }
-            send_private(h.topic, h, payload);
         }
-        else
+        if (w < 0)
         {
-            if (cli.topics.count(h.topic) == 0)
-            {
-                send_error(c, h.messageId, "Ban chua subscribe topic nay!");
-                return;
-            }
-            bool sent = false;
-            for (auto &[c2, cli2] : g_clients)
-            {
-                if (cli2.topics.count(h.topic))
-                {
-                    send_packet(c2, h, payload);
-                    sent = true;
-                }
-            }
-            if (!sent)
-                send_error(c, h.messageId, "Topic khong co subscriber!");
+            mg_error(c, "sendfile failed");
+            return true;
         }
-        send_ack(c, h.messageId);
-        break;
+        if (w == 0 && (f.head_off < f.head_len || f.body_left))
+            return false; // socket đầy, chờ EPOLLOUT
 
-    case MSG_PUBLISH_FILE:
-        // khởi tạo file
+        if (f.head_off == f.head_len && !f.body_left)
         {
-            IncomingFile f;
-            f.target = h.topic;
-            f.sender = h.sender;
-            f.is_private = h.flags & FLAG_PRIVATE;
-
-            if (f.is_private && !user_online(f.target))
-            {
-                send_error(c, h.messageId, "User khong ton tai hoac offline!");
-                return;
-            }
-            if (!f.is_private && !topic_has_subscribers(f.target))
-            {
-                send_error(c, h.messageId, "Topic khong co subscriber!");
-                return;
-            }
-
-            std::string filename = (h.payloadLength > 0)
-                                       ? std::string((char *)payload, h.payloadLength)
-                                       : "upload_" + f.sender + "_" + f.target;
-            f.filename = filename;
-            f.ofs.open("upload/" + filename, std::ios::binary);
-            if (!f.ofs)
-            {
-                send_error(c, h.messageId, "Cannot create file on server");
-                return;
-            }
-
-            g_files[h.messageId] = std::move(f);
-            // ====== 🔥 THIẾU ĐOẠN NÀY ======
-            if (h.flags & FLAG_PRIVATE)
-                send_private(h.topic, h, payload);
-            else
-                broadcast_topic(h.topic, h, payload, c);
-            // ==============================
-
-            send_ack(c, h.messageId);
-            send_ack(c, h.messageId);
+            f.busy = false;
+            st->streaming = false;
+            f.next++;
         }
-        break;
+    }
+    return true;
+}
 
-    case MSG_FILE_DATA:
+// Gọi sau mỗi vòng poll: gửi tiếp các lượt fetch của shard
+void fetch_pump(Shard &s)
+{
+    for (size_t i = 0; i < s.fetches.size();)
     {
-        auto it = g_files.find(h.messageId);
-        if (it == g_files.end())
+        Fetch &f = s.fetches[i];
+        auto it = s.live.find(f.id);
+        bool alive = it != s.live.end() && it->second == f.c;
+        if (alive && !fetch_step(f))
         {
-            send_error(c, h.messageId, "File not found on server");
-            return;
+            sendq_epoll_read(f.c, !f.c->is_full); // chờ socket writable
+            i++;
+            continue;
         }
-
-        it->second.ofs.write((char *)payload, h.payloadLength);
-
-        if (it->second.is_private)
-            send_private(it->second.target, h, payload);
-        else
-            broadcast_topic(it->second.target, h, payload, c);
-
-        // kết thúc file
-        if (h.flags & FLAG_LAST)
+        if (alive)
         {
-            it->second.ofs.close();
-            std::cout << "File transfer completed: "
-                      << it->second.sender << " -> " << it->second.target
-                      << " (" << it->second.filename << ")\n";
-            g_files.erase(it);
+            ConnState *st = conn_state(f.c);
+            st->fetches--;
+            if (f.busy)
+                st->streaming = false;
+            sendq_epoll_read(f.c, !f.c->is_full);
         }
-
-        send_ack(c, h.messageId);
-    }
-    break;
-
-    default:
-        send_error(c, h.messageId, "INVALID_MSG");
+        if (f.fp)
+            fclose(f.fp);
+        s.fetches[i] = std::move(s.fetches.back());
+        s.fetches.pop_back();
+        g_fetches.fetch_sub(1, std::memory_order_relaxed);
     }
 }
 
@@ -480,6 +4070,10 @@ static void event_handler(mg_connection *c, int ev, void *ev_data)
 {
     if (ev == MG_EV_ACCEPT)
     {
+        ConnState *st = new ConnState();
+        memcpy(c->data, &st, sizeof(st));
+        shard_of(c)->live[c->id] = c;
+        std::unique_lock<std::shared_mutex> lk(g_mu);
         g_clients[c] = Client{};
     }
     else if (ev == MG_EV_HTTP_MSG)
@@ -488,73 +4082,42 @@ static void event_handler(mg_connection *c, int ev, void *ev_data)
         if (mg_match(hm->uri, mg_str("/websocket"), nullptr))
         {
             mg_ws_upgrade(c, hm, nullptr);
-            g_clients[c].is_ws = true;
+            std::unique_lock<std::shared_mutex> lk(g_mu);
+            conn_state(c)->is_ws = true;
         }
     }
     else if (ev == MG_EV_WS_MSG)
     {
+        // 1 message WS có thể chứa nhiều packet liền nhau
         auto *wm = (mg_ws_message *)ev_data;
-        if (wm->data.len < sizeof(PacketHeader))
-            return;
-
-        PacketHeader h{};
-        memcpy(&h, wm->data.buf, sizeof(h));
-
-        std::vector<uint8_t> payload(h.payloadLength);
-        if (h.payloadLength)
-            memcpy(payload.data(), wm->data.buf + sizeof(h), h.payloadLength);
-
-        handle_packet(c, h, payload.empty() ? nullptr : payload.data());
+        parse_packets(c, (const uint8_t *)wm->data.buf, wm->data.len);
     }
-    else if (ev == MG_EV_READ)
+    else if (ev == MG_EV_READ && c->pfn == nullptr)
     {
-        // TCP read
-        while (c->recv.len >= sizeof(PacketHeader))
-        {
-            PacketHeader h{};
-            memcpy(&h, c->recv.buf, sizeof(h));
-            if (c->recv.len < sizeof(h) + h.payloadLength)
-                break;
-
-            std::vector<uint8_t> payload(h.payloadLength);
-            if (h.payloadLength)
-                memcpy(payload.data(), c->recv.buf + sizeof(h), h.payloadLength);
-
-            handle_packet(c, h, payload.empty() ? nullptr : payload.data());
-            mg_iobuf_del(&c->recv, 0, sizeof(h) + h.payloadLength);
-        }
+        // TCP read (connection HTTP/WS do pfn của mongoose xử lý)
+        size_t used = parse_packets(c, c->recv.buf, c->recv.len);
+        if (used)
+            mg_iobuf_del(&c->recv, 0, used); // dồn buffer 1 lần cho cả lượt đọc
+    }
+    else if (ev == MG_EV_WRITE)
+    {
+        // c->send vừa gửi hết: tiếp tục ghi các frame đang chờ
+        if (c->is_accepted && c->send.len == 0)
+            flush_conn(c);
+        else if (c->is_accepted)
+            conn_update_pending(c);
     }
     else if (ev == MG_EV_CLOSE)
     {
-        if (!g_clients[c].username.empty())
-        {
-            std::string user = g_clients[c].username;
-
-            // 1. Xóa user khỏi onlineUsers
-            onlineUsers.erase(user);
-            std::ofstream ofs(ONLINE_FILE, std::ios::trunc);
-            for (auto &u : onlineUsers)
-                ofs << u << "\n";
-
-            // 2. Xóa tất cả entry của user trong user_topics.txt
-            {
-                std::ifstream ifs(USER_TOPIC_FILE);
-                std::vector<std::string> lines;
-                std::string line;
-                while (std::getline(ifs, line))
-                {
-                    if (line.find(user + ":") != 0)
-                    { // nếu không phải user này
-                        lines.push_back(line);
-                    }
-                }
-                ifs.close();
+        if (!c->is_accepted)
+            return;
+        shard_of(c)->live.erase(c->id);
+        std::unique_lock<std::shared_mutex> lk(g_mu);
 
-                std::ofstream ofs(USER_TOPIC_FILE, std::ios::trunc);
-                for (auto &l : lines)
-                    ofs << l << "\n";
-            }
-        }
+        // 1+2. Xóa session, dọn online.txt và user_topics.txt nếu là session cuối
+        auto it = g_clients.find(c);
+        if (it != g_clients.end())
+            session_end(c, it->second);
 
         // 3. Reset game nếu người chơi rời
         if (c == g_game.p1 || c == g_game.p2)
@@ -566,32 +4129,212 @@ static void event_handler(mg_connection *c, int ev, void *ev_data)
             std::cout << "Game reset (player left)\n";
         }
 
+        // 4. Xóa khỏi index topic -> subscriber (và danh sách connection phụ nhận file)
+        if (it != g_clients.end())
+        {
+            topic_unsubscribe_all(c, it->second);
+            file_rx_drop(c, it->second);
+        }
         g_clients.erase(c);
+
+        // 5. Bỏ các file đang gửi dở
+        file_drop_sender(c);
+
+        // 6. Không còn ai tham chiếu tới connection, giải phóng hàng đợi gửi
+        // (và fd dup của connection đang ngừng đọc, nó giữ socket mở)
+#if defined(MG_ENABLE_EPOLL) && MG_ENABLE_EPOLL
+        if (conn_state(c)->parked >= 0)
+        {
+            epoll_ctl(c->mgr->epoll_fd, EPOLL_CTL_DEL, conn_state(c)->parked, nullptr);
+            close(conn_state(c)->parked);
+        }
+#endif
+        sendq_release(conn_state(c));
+        delete conn_state(c);
+    }
+}
+
+#if defined(SO_REUSEPORT) && MG_ARCH == MG_ARCH_UNIX
+#define HAVE_REUSEPORT 1
+
+// Mở listener với SO_REUSEPORT để mỗi shard có hàng đợi accept riêng,
+// kernel tự chia connection mới cho các shard.
+static mg_connection *listen_reuseport(mg_mgr *mgr, int port, mg_event_handler_t pfn)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return nullptr;
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(fd, (sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 1024) != 0)
+    {
+        close(fd);
+        return nullptr;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+    mg_connection *c = mg_wrapfd(mgr, fd, event_handler, nullptr);
+    if (c)
+    {
+        c->is_listening = 1;
+        c->loc.port = mg_htons((uint16_t)port);
+        c->pfn = pfn; // connection accept ra sẽ kế thừa protocol handler
+    }
+    return c;
+}
+#endif
+
+// Tạo listener TCP + WS cho shard, trả về false nếu không bind được
+static bool shard_listen(Shard &s)
+{
+    mg_mgr *mgr = &s.mgr;
+    if (g_cfg.threads == 1)
+    {
+        mg_http_listen(mgr, WS_PORT, event_handler, nullptr);
+        mg_connection *lc = mg_listen(mgr, TCP_PORT, event_handler, nullptr);
+        if (!lc)
+            return false;
+        s.doorbell_id = lc->id;
+        return true;
+    }
+#ifdef HAVE_REUSEPORT
+    // mongoose không export http handler, lấy từ 1 listener tạm trên port ngẫu nhiên
+    mg_connection *probe = mg_http_listen(mgr, "http://127.0.0.1:0", event_handler, nullptr);
+    if (!probe)
+        return false;
+    mg_event_handler_t http_pfn = probe->pfn;
+    probe->is_closing = 1;
+
+    mg_connection *ws = listen_reuseport(mgr, WS_PORT_NUM, http_pfn);
+    mg_connection *tcp = listen_reuseport(mgr, TCP_PORT_NUM, nullptr);
+    if (!ws || !tcp)
+        return false;
+    s.doorbell_id = tcp->id;
+    return true;
+#else
+    return false;
+#endif
+}
+
+static void shard_loop(Shard *s)
+{
+    t_shard = s;
+    for (;;)
+    {
+        // có file đang bị giữ ACK / đang gửi lại hoặc publisher đang ngừng
+        // đọc thì poll ngắn để timer kiểm tra kịp
+        bool waiting = g_files_stalled.load(std::memory_order_relaxed) || g_sendq_paused.load(std::memory_order_relaxed) ||
+                       g_backfills.load(std::memory_order_relaxed) || g_fetches.load(std::memory_order_relaxed);
+        mg_mgr_poll(&s->mgr, waiting ? FILE_CREDIT_TIMER_MS : 500);
+        shard_drain(*s);
+        shard_flush(*s);
+        fetch_pump(*s);
+        sendq_mask_paused(*s);
+    }
+}
+
+// Đọc tham số dòng lệnh
+static void parse_args(int argc, char **argv)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        std::string a = argv[i];
+        if (a == "--threads" && i + 1 < argc)
+            g_cfg.threads = std::max(1, atoi(argv[++i]));
+        else if (a == "--fanout" && i + 1 < argc)
+            g_cfg.fanout_copy = std::string(argv[++i]) == "copy";
+        else if (a == "--chunk-max" && i + 1 < argc)
+            g_cfg.chunk_max = std::max(1024L, atol(argv[++i]));
+        else if (a == "--files" && i + 1 < argc)
+        {
+            std::string m = argv[++i];
+            g_cfg.file_relay = m == "relay";
+            g_cfg.file_dedup = m == "dedup";
+        }
+        else if (a == "--log-level" && i + 1 < argc)
+            g_cfg.log_level = atoi(argv[++i]);
+        else if (a == "--sendq-max" && i + 1 < argc)
+            g_cfg.sendq_max = (size_t)std::max(0L, atol(argv[++i]));
+        else if (a == "--sendq-policy" && i + 1 < argc)
+        {
+            std::string p = argv[++i];
+            g_cfg.sendq_policy = p == "pause" ? SQ_PAUSE : p == "spill" ? SQ_SPILL : p == "disconnect" ? SQ_DISCONNECT : SQ_DROP;
+        }
+        else if (a == "--compress" && i + 1 < argc)
+            g_cfg.compress = std::string(argv[++i]) != "off";
+        else if (a == "--wire" && i + 1 < argc)
+            g_cfg.wire_v2 = std::string(argv[++i]) != "v1";
+    }
+    g_cfg.chunk_max = std::min<size_t>(g_cfg.chunk_max, MAX_PAYLOAD_SIZE);
+#ifndef HAVE_REUSEPORT
+    if (g_cfg.threads > 1)
+    {
+        std::cout << "SO_REUSEPORT khong ho tro, chay 1 thread\n";
+        g_cfg.threads = 1;
     }
+#endif
 }
 
 // ---------------- MAIN ----------------
-int main()
+int main(int argc, char **argv)
 {
+    parse_args(argc, argv);
+    if (g_cfg.log_level >= 0)
+        mg_log_set(g_cfg.log_level);
+
     // reset các file
     std::ofstream(ONLINE_FILE, std::ios::trunc).close();
     std::ofstream(TOPICS_FILE, std::ios::trunc).close();
     std::ofstream(USER_TOPIC_FILE, std::ios::trunc).close();
+    if (!journal_open(JOURNAL_FILE))
+    {
+        std::cout << "Cannot open " << JOURNAL_FILE << "\n";
+        return 1;
+    }
+    if (g_cfg.file_dedup)
+        store_load();
+    std::thread(persist_loop).detach();
 
-    mg_mgr mgr;
-    mg_mgr_init(&mgr);
+    for (int i = 0; i < g_cfg.threads; i++)
+    {
+        auto s = std::make_unique<Shard>();
+        s->index = i;
+        mg_mgr_init(&s->mgr);
+        s->mgr.userdata = s.get();
+        mg_wakeup_init(&s->mgr);
+        mg_timer_add(&s->mgr, FILE_CREDIT_TIMER_MS, MG_TIMER_REPEAT, file_credit_timer, s.get());
+        mg_timer_add(&s->mgr, SENDQ_RESUME_MS, MG_TIMER_REPEAT, sendq_resume_timer, s.get());
+        mg_timer_add(&s->mgr, FILE_CREDIT_TIMER_MS, MG_TIMER_REPEAT, file_backfill_timer, s.get());
 
-    // lắng nghe WS & TCP
-    mg_http_listen(&mgr, WS_PORT, event_handler, nullptr);
-    mg_listen(&mgr, TCP_PORT, event_handler, nullptr);
+        // lắng nghe WS & TCP
+        if (!shard_listen(*s))
+        {
+            std::cout << "Cannot listen on " << TCP_PORT << " / " << WS_PORT << "\n";
+            return 1;
+        }
+        g_shards.push_back(std::move(s));
+    }
 
     std::cout << "SERVER RUNNING\n";
     std::cout << "WS  : ws://localhost:8000/websocket\n";
     std::cout << "TCP : 8080\n";
+    std::cout << "Threads: " << g_cfg.threads << "\n";
 
-    for (;;)
-        mg_mgr_poll(&mgr, 500);
+    // shard 0 chạy trên main thread
+    std::vector<std::thread> workers;
+    for (int i = 1; i < g_cfg.threads; i++)
+        workers.emplace_back(shard_loop, g_shards[i].get());
+    shard_loop(g_shards[0].get());
 
-    mg_mgr_free(&mgr);
+    for (auto &t : workers)
+        t.join();
+    for (auto &s : g_shards)
+        mg_mgr_free(&s->mgr);
     return 0;
 }